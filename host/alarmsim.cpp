@@ -0,0 +1,312 @@
+//   EMONTX3-CONTINUOUS - host-side tools
+//
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   alarmsim - time from fault to alarm of the half-cycle overcurrent and
+//   residual current alarm (FAST_ALARM in cont.h), on simulated faults,
+//   run by the firmware itself.
+//
+//   Usage:
+//     alarmsim [prescalar [freq]]
+//       prescalar - ADC clock prescalar, 128, 64 or 32
+//                   (default ADC_PRESCALAR_CONT)
+//       freq      - mains frequency [Hz] (default 50)
+//
+//   The firmware is linked in and run by devsim (see devsim.h): the
+//   waveforms below are sampled by the modelled ADC, accum_stats() and
+//   check_alarm() see the readings exactly as on the device, and the
+//   alarms are taken from the lines that send_alarm() writes to the
+//   serial port.  After startup, and a switch to the requested profile
+//   with the "prof" command, a load current on every input steps to a
+//   fault at 72 points of the mains cycle, one fault at a time on each
+//   input in turn, and back again until the alarm has cleared.  The
+//   residual current test (when ALARM_RESID_CHAN is set, see
+//   alarmsim-res in the Makefile) puts a leakage current on the first of
+//   those inputs, whose currents otherwise sum to zero.
+//
+//   For each fault level the delay from the fault to the reading that
+//   raised the alarm is reported (min/mean/max), the worst delay from the
+//   first zero crossing after the fault, and the worst time until the
+//   alarm line had been sent.  The check passes (exit status 0) when
+//     - every fault above the threshold raises an alarm on its input,
+//     - a current of 0.9 times the threshold raises none, and neither
+//       does the load,
+//     - every alarm is raised within half a mains cycle of the first zero
+//       crossing after the fault, plus two readings for the crossing to
+//       be seen and the reading to complete (the check runs only at the
+//       crossings, so the half cycle the fault starts in is not counted).
+//   The line times depend on the nominal CPU time of devsim and are for
+//   information; the bound printed adds the worst case of a full
+//   transmit buffer and of N_READINGS readings queued behind calc_stats().
+//
+//   The Makefile builds it for the Mega, the only board with FAST_ALARM
+//   by default; build with BOARD= to check emonTx settings.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <Arduino.h>
+#include "../src/cont.h"
+#include "devsim.h"
+
+#ifndef FAST_ALARM
+#error "alarmsim needs FAST_ALARM (see cont.h)"
+#endif
+
+#define ALARM_LINE 56                     // [bytes] longest alarm line
+#define LOAD_AMPS 10.0                    // [A] RMS current before the fault
+#define VOLT_ADU 400.0                    // [ADU] peak of the voltage input
+#define FAULT_CYCLES 3                    // mains cycles of each fault
+#define CLEAR_CYCLES 3                    // mains cycles after it, at least
+#define N_PHASE 72                        // fault starting points per cycle
+#define STARTUP_TIMEOUT 60.0              // [s]
+
+// Signals
+static double f_mains = 50.0;
+static int fault_kind = 0;                // ALARM_OVER or ALARM_RESID
+static int fault_chan = -1;               // current channel, for ALARM_OVER
+static double fault_amps = 0;             // [A] fault or leakage current
+static double fault_t0 = 1e30, fault_t1 = 1e30; // [s] device time
+#define ALARM_CLEAR 0                     // as alarm.cpp
+#define ALARM_OVER  1
+#define ALARM_RESID 2
+
+// Residual current channels: the first carries the phase current, the
+// others its return in equal parts
+static int res_first = -1, res_n = 0;
+
+// adc() - the 10-bit ADC, for a signal around mid-scale
+static int adc(double v)
+{
+  int x = (int) floor(v + 512.0 + 0.5);
+  if (x < 0) x = 0;
+  if (x > 1023) x = 1023;
+  return x;
+}
+
+// input() - level of an ADC pin: pin 0 is the voltage, pin j+1 CT j
+static int input(uint8_t pin, double t)
+{
+  double s = sin(2*M_PI*f_mains*t);
+  double a = LOAD_AMPS;
+  int j = pin - 1;
+  int faulted = (t >= fault_t0 && t < fault_t1);
+
+  if (pin == 0) return adc(VOLT_ADU * s);
+  if (j >= N_CUR_CHAN) return 0;
+  if (res_n && (ALARM_RESID_CHAN & (1 << j))) {
+    if (j == res_first) {
+      if (faulted && fault_kind == ALARM_RESID) a += fault_amps;
+    } else {
+      a = -LOAD_AMPS / (res_n - 1);
+    }
+  } else if (faulted && fault_kind == ALARM_OVER && j == fault_chan) {
+    a = fault_amps;
+  }
+  return adc(a * M_SQRT2 / ical[j] * s);
+}
+
+// Alarms seen on the serial port
+struct alarm_seen {
+  int type, chan;
+  double t;       // [s] device time of the reading that raised it
+  double tline;   // [s] device time the line was sent
+};
+#define N_SEEN 64
+static struct alarm_seen seen[N_SEEN];
+static int nseen = 0;
+static int started = 0, profile_seen = -1;
+
+// field() - value of a field of a line, or -1 if it is not there
+static double field(const char *s, const char *name)
+{
+  const char *p = strstr(s, name);
+  return p ? atof(p + strlen(name)) : -1;
+}
+
+// line() - a line from the firmware
+static void line(const char *s, double t)
+{
+  if (strstr(s, "#STATE_FREQ:vmains_quadlookback")) started = 1;
+  if (strstr(s, "prof:")) profile_seen = (int) field(s, "prof:");
+  if (strncmp(s, "alrm:", 5) == 0 && nseen < N_SEEN) {
+    struct alarm_seen *a = &seen[nseen++];
+    a->type = (int) field(s, "alrm:");
+    a->chan = (int) field(s, "alch:");
+    a->t = field(s, "tsec:") + 1e-6 * field(s, "tus:") + devsim_clock_offset();
+    a->tline = t;
+  }
+}
+
+static int nfail = 0;
+
+// fail() - report a failed check
+static void fail(const char *name, double amps, double phase, const char *what)
+{
+  if (nfail < 20) printf("FAIL %s %.2f A at %.0f deg: %s\n", name, amps, phase, what);
+  nfail ++;
+}
+
+// testable() - an overcurrent fault of amps [A] on channel j can be tested:
+//   it is not a residual channel, and the fault is within its ADC range
+static int testable(int j, double amps)
+{
+  if (res_n && (ALARM_RESID_CHAN & (1 << j))) return 0;
+  return (amps * M_SQRT2 / ical[j] < 511);
+}
+
+// run() - a fault at every point of the cycle, and the delays
+//   name - for the report
+//   kind - ALARM_OVER or ALARM_RESID
+//   amps - [A] fault or leakage current
+//   expect - an alarm must (1) or must not (0) be raised
+//   budget - [s] longest delay from the first zero crossing after the fault
+//   extra - [s] worst case added to the line time
+static void run(const char *name, int kind, double amps, int expect,
+                double budget, double extra)
+{
+  double tcyc = 1.0 / f_mains;
+  double dmin = 1e9, dmax = 0, dsum = 0, cmax = 0, lmax = 0;
+  int nmiss = 0, nfalse = 0, nlate = 0, n = 0;
+
+  for (int k = 0; k < N_PHASE; k++) {
+    double phase = 360.0 * k / N_PHASE;
+    double t0 = (floor(devsim_time() / tcyc) + 2 + phase/360.0) * tcyc;
+    double tcross = ceil(t0 * 2*f_mains) / (2*f_mains);
+    const struct alarm_seen *hit = 0;
+    int j;
+
+    fault_kind = kind;
+    fault_amps = amps;
+    fault_chan = (kind == ALARM_OVER) ? k % N_CUR_CHAN : -1;
+    // Overcurrent on a residual channel would also be a residual current,
+    // and a channel whose ADC range ends below the fault cannot see it
+    while (kind == ALARM_OVER && !testable(fault_chan, amps)) {
+      fault_chan = (fault_chan + 1) % N_CUR_CHAN;
+    }
+    fault_t0 = t0;
+    fault_t1 = t0 + FAULT_CYCLES * tcyc;
+    nseen = 0;
+    devsim_run(fault_t1 + CLEAR_CYCLES * tcyc);
+    // Wait for the alarm to clear and its line to be sent
+    for (j = 0; j < 10 && nseen > 0 && seen[nseen-1].type != ALARM_CLEAR; j++) {
+      devsim_run(devsim_time() + tcyc);
+    }
+    fault_t0 = fault_t1 = 1e30;
+
+    for (j = 0; j < nseen; j++) {
+      const struct alarm_seen *a = &seen[j];
+      if (a->type == ALARM_CLEAR) continue;
+      if (a->t < t0 || !expect || a->type != kind ||
+          (kind == ALARM_OVER && a->chan != fault_chan)) {
+        nfalse ++;
+        fail(name, amps, phase, "false alarm");
+      } else if (!hit) {
+        hit = a;
+      }
+    }
+    if (nseen > 0 && seen[nseen-1].type != ALARM_CLEAR) fail(name, amps, phase, "not cleared");
+    if (!expect) continue;
+    if (!hit) {
+      nmiss ++;
+      fail(name, amps, phase, "missed");
+      continue;
+    }
+    double d = hit->t - t0, c = hit->t - tcross, l = hit->tline - t0;
+    if (c > budget) {
+      nlate ++;
+      fail(name, amps, phase, "late");
+    }
+    if (d < dmin) dmin = d;
+    if (d > dmax) dmax = d;
+    if (c > cmax) cmax = c;
+    if (l > lmax) lmax = l;
+    dsum += d; n++;
+  }
+  printf("%-10s %7.2f", name, amps);
+  if (n) {
+    printf("  %6.2f %6.2f %6.2f  %6.2f  %6.2f %6.2f", 1e3*dmin, 1e3*dsum/n, 1e3*dmax,
+           1e3*cmax, 1e3*lmax, 1e3*(dmax+extra));
+  } else {
+    printf("  %6s %6s %6s  %6s  %6s %6s", "-", "-", "-", "-", "-", "-");
+  }
+  printf("  %4d %5d %4d\n", nmiss, nfalse, nlate);
+}
+
+int main(int argc, char **argv)
+{
+  int prescalar = (argc > 1) ? atoi(argv[1]) : ADC_PRESCALAR_CONT;
+  int profile;
+  double tread, budget, extra;
+
+  f_mains = (argc > 2) ? atof(argv[2]) : 50.0;
+  switch (prescalar) {
+    case 128: profile = 0; break;
+    case 64:  profile = 1; break;
+    case 32:  profile = 2; break;
+    default:
+      fprintf(stderr, "alarmsim: prescalar must be 128, 64 or 32\n");
+      return 1;
+  }
+  for (int j = 0; j < N_CUR_CHAN; j++) {
+    if (!(ALARM_RESID_CHAN & (1 << j))) continue;
+    if (res_first < 0) res_first = j;
+    res_n ++;
+  }
+
+  // Start up, and switch to the profile
+  devsim_start(input, line, HIGH);
+  while (!started && devsim_time() < STARTUP_TIMEOUT) devsim_run(devsim_time() + 0.1);
+  if (profile != ADC_PROFILE) {
+    char cmd[16];
+    snprintf(cmd, sizeof(cmd), "prof %d\r\n", profile);
+    devsim_send(cmd);
+    while (profile_seen != profile && devsim_time() < STARTUP_TIMEOUT + ACCUM_PERIOD/SECS) {
+      devsim_run(devsim_time() + 0.1);
+    }
+  }
+  if (!started || (profile != ADC_PROFILE && profile_seen != profile)) {
+    printf("FAIL firmware did not start\n");
+    return 1;
+  }
+
+  tread = ADC_NCONV * 13.0 * prescalar / F_CPU;
+  // The firmware's crossing is up to a reading late, and a zero point that
+  // is off by the 1 ADU of its truncation moves it by up to 1/VOLT_ADU rad
+  budget = 0.5 / f_mains + 2*tread + asin(1.0/VOLT_ADU) / (2*M_PI*f_mains);
+  // Worst case added to the detection: the line in progress, the alarm
+  // line itself, and a calc_stats() stall
+  extra = (UART_TX_SIZE + ALARM_LINE) * 10.0 / UART_BAUD + N_READINGS * tread;
+
+  printf("# prescalar %d, %d conversions/reading, mains %.1f Hz, %.1f readings/half cycle, load %.1f A\n",
+         prescalar, ADC_NCONV, f_mains, 0.5/(f_mains*tread), LOAD_AMPS);
+  printf("# thresholds: overcurrent %.1f A, residual %.2f A (channels 0x%x); budget from crossing %.2f ms\n",
+         ALARM_IMAX, ALARM_IRES, (unsigned) ALARM_RESID_CHAN, 1e3*budget);
+  for (int j = 0; j < N_CUR_CHAN; j++) {
+    if (!testable(j, 3.0*ALARM_IMAX) && !(res_n && (ALARM_RESID_CHAN & (1 << j)))) {
+      printf("# channel %d: ADC range %.1f A RMS, faults beyond it not tested\n", j, 511 * ical[j] / M_SQRT2);
+    }
+  }
+  printf("# %-8s %7s  %6s %6s %6s  %6s  %6s %6s  %4s %5s %4s\n", "fault", "[A]",
+         "min", "mean", "max", "cross", "line", "bound", "miss", "false", "late");
+  run("over", ALARM_OVER, 0.9*ALARM_IMAX, 0, budget, extra);
+  run("over", ALARM_OVER, 1.2*ALARM_IMAX, 1, budget, extra);
+  run("over", ALARM_OVER, 2.0*ALARM_IMAX, 1, budget, extra);
+  run("over", ALARM_OVER, 3.0*ALARM_IMAX, 1, budget, extra);
+  if (res_n) {
+    run("resid", ALARM_RESID, 0.9*ALARM_IRES, 0, budget, extra);
+    run("resid", ALARM_RESID, 1.2*ALARM_IRES, 1, budget, extra);
+    run("resid", ALARM_RESID, 2.0*ALARM_IRES, 1, budget, extra);
+    run("resid", ALARM_RESID, 5.0*ALARM_IRES, 1, budget, extra);
+  }
+  if (nfail) {
+    printf("FAIL %d checks\n", nfail);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,238 @@
+//   EMONTX3-CONTINUOUS - host-side tools
+//
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   devsim - the firmware on the host (see devsim.h)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Arduino.h>
+#include "../src/cont.h"
+#include "devsim.h"
+
+// The sketch, and the interrupt handlers modelled
+void setup(void);
+void loop(void);
+extern "C" void ADC_vect(void);
+extern "C" void USART_UDRE_vect(void);
+extern "C" void USART_RX_vect(void);
+extern uint32_t adc_clock;
+
+// Registers of the shim
+ring_sreg SREG;
+devsim_udr UDR0;
+volatile uint8_t ADMUX, ADCSRA, ADCSRB, DIDR0, DIDR2, GPIOR0;
+volatile uint16_t ADCW;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+volatile uint16_t TCNT1;
+volatile uint8_t UCSR0A, UCSR0B, UCSR0C;
+volatile uint16_t UBRR0;
+
+// mem.cpp reads the stack painted by the AVR startup code; not here
+uint16_t stack_high_water(void) { return 0; }
+uint16_t stack_free(void) { return 0; }
+
+static devsim_input_fn input_fn = 0;
+static devsim_line_fn line_fn = 0;
+static int dip_level = HIGH;
+
+// ============================= Clock and interrupts
+static uint64_t cycle = 0;          // [cycles] since power on
+static uint64_t adc_start = 0;      // [cycles] start of the first conversion
+static uint8_t sreg_i = 0;          // I flag
+static uint8_t in_isr = 0;
+static uint64_t next_event = ~0ULL; // [cycles] earliest interrupt due
+
+// ADC
+static uint8_t adc_on = 0;
+static uint8_t conv_pin = 0;        // pin of the conversion in progress
+static uint64_t conv_begin, conv_end; // [cycles] of the conversion in progress
+static double clock_offset = 0;     // [s] see devsim_clock_offset()
+
+// Serial port
+#define LINE_MAX 512
+static uint64_t tx_free = 0;        // [cycles] data register free
+static int tx_instant = 0;          // see devsim_tx_instant()
+static char line_buf[LINE_MAX];
+static int line_len = 0;
+static char rx_queue[256];
+static int rx_head = 0, rx_tail = 0;
+static uint64_t rx_next = 0;        // [cycles] next character received
+static uint8_t rx_char = 0;
+
+static double dev_time(uint64_t c)
+{
+  return ((double) c - (double) adc_start) / F_CPU;
+}
+
+// char_cycles() - [cycles] per character, 8N1 in double speed mode
+static uint64_t char_cycles(void)
+{
+  return 10ULL * 8 * (UBRR0 + 1);
+}
+
+// conv_cycles() - [cycles] per conversion at the prescalar in ADCSRA
+static uint64_t conv_cycles(void)
+{
+  uint8_t adps = ADCSRA & (_BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0));
+  return 13ULL << (adps ? adps : 1);
+}
+
+// mux_pin() - ADC pin selected by the multiplexer
+static uint8_t mux_pin(void)
+{
+  uint8_t pin = ADMUX & 0x07;
+#ifdef BOARD_MEGA
+  if (ADCSRB & _BV(MUX5)) pin |= 0x08;
+#endif
+  return pin;
+}
+
+// schedule() - find the earliest interrupt that can become due
+static void schedule(void)
+{
+  next_event = ~0ULL;
+  if (adc_on) next_event = conv_end;
+  if ((UCSR0B & _BV(UDRIE0)) && tx_free < next_event) next_event = tx_free;
+  if (rx_head != rx_tail && (UCSR0B & _BV(RXCIE0)) && rx_next < next_event) next_event = rx_next;
+}
+
+// interrupt() - run the interrupt handler, with the I flag clear
+static void interrupt(void (*handler)(void))
+{
+  // Timer1 free runs at F_CPU/8 once init_pulse() starts it.  Its
+  // overflow interrupt is not run; the high word is kept here instead.
+  if (TCCR1B & _BV(CS11)) {
+    TCNT1 = (uint16_t) (cycle / 8);
+    pulse_timer_hi = (uint16_t) (cycle / 8 >> 16);
+    TIFR1 = 0;
+  }
+  in_isr = 1;
+  sreg_i = 0;
+  handler();
+  sreg_i = 1;
+  in_isr = 0;
+}
+
+// run_interrupts() - run the interrupts that are due, in time order
+static void run_interrupts(void)
+{
+  for (;;) {
+    schedule();
+    if (next_event > cycle) return;
+    if (adc_on && conv_end == next_event) {
+      // Free running: the next conversion starts at once, on the pin
+      // selected now, and the handler then reports this one
+      ADCW = (uint16_t) input_fn(conv_pin, dev_time(conv_begin));
+      conv_pin = mux_pin();
+      conv_begin = conv_end;
+      conv_end += conv_cycles();
+      uint32_t clock = adc_clock;
+      interrupt(ADC_vect);
+      if (adc_clock != clock) clock_offset = dev_time(conv_begin) - 1e-6 * adc_clock;
+    } else if ((UCSR0B & _BV(UDRIE0)) && tx_free == next_event) {
+      interrupt(USART_UDRE_vect);
+    } else {
+      rx_char = (uint8_t) rx_queue[rx_tail];
+      rx_tail = (rx_tail + 1) % (int) sizeof(rx_queue);
+      rx_next = next_event + char_cycles();
+      interrupt(USART_RX_vect);
+    }
+  }
+}
+
+// step() - one memory access of the firmware
+static void step(void)
+{
+  cycle += DEVSIM_ACCESS_CYCLES;
+  if (!adc_on && (ADCSRA & _BV(ADEN))) {
+    if (adc_start == 0) adc_start = cycle;
+    adc_on = 1;
+    conv_pin = mux_pin();
+    conv_begin = cycle;
+    conv_end = cycle + conv_cycles();
+  } else if (adc_on && !(ADCSRA & _BV(ADEN))) {
+    adc_on = 0;
+  }
+  if (sreg_i && !in_isr && cycle >= next_event) run_interrupts();
+  else if (!in_isr) schedule();
+}
+
+// Callbacks of the instrumentation and of the shim
+extern "C" {
+void __tsan_init(void) { }
+void __tsan_func_entry(void *) { }
+void __tsan_func_exit(void) { }
+#define DEVSIM_ACCESS(n) \
+  void __tsan_read##n(void *)  { step(); } \
+  void __tsan_write##n(void *) { step(); }
+DEVSIM_ACCESS(1) DEVSIM_ACCESS(2) DEVSIM_ACCESS(4) DEVSIM_ACCESS(8) DEVSIM_ACCESS(16)
+}
+uint8_t ring_sreg_read(void) { return sreg_i ? 0x80 : 0; }
+void ring_sreg_write(uint8_t v) { sreg_i = (v & 0x80) != 0; }
+void ring_cli(void) { sreg_i = 0; }
+void ring_sei(void) { sreg_i = 1; }
+int digitalRead(uint8_t) { return dip_level; }
+
+uint8_t devsim_udr_read(void) { return rx_char; }
+void devsim_udr_write(uint8_t v)
+{
+  tx_free = ((tx_free > cycle) ? tx_free : cycle) + (tx_instant ? 1 : char_cycles());
+  if (v == '\n') {
+    if (line_len > 0 && line_buf[line_len-1] == '\r') line_len--;
+    line_buf[line_len] = 0;
+    if (line_fn) line_fn(line_buf, dev_time(tx_free));
+    line_len = 0;
+  } else if (line_len < LINE_MAX-1) {
+    line_buf[line_len++] = (char) v;
+  }
+}
+
+// ============================= Interface
+void devsim_start(devsim_input_fn input, devsim_line_fn line, int dip)
+{
+  input_fn = input;
+  line_fn = line;
+  dip_level = dip;
+  sreg_i = 1;  // the Arduino core enables interrupts before setup()
+  setup();
+}
+
+void devsim_run(double t)
+{
+  while (!adc_on || dev_time(cycle) < t) loop();
+}
+
+void devsim_tx_instant(int on)
+{
+  tx_instant = on;
+}
+
+void devsim_stall(double t)
+{
+  while (!adc_on || dev_time(cycle) < t) step();
+}
+
+double devsim_time(void)
+{
+  return dev_time(cycle);
+}
+
+double devsim_clock_offset(void)
+{
+  return clock_offset;
+}
+
+void devsim_send(const char *s)
+{
+  if (rx_head == rx_tail) rx_next = cycle + char_cycles();
+  for (; *s; s++) {
+    int next = (rx_head + 1) % (int) sizeof(rx_queue);
+    if (next == rx_tail) break;
+    rx_queue[rx_head] = *s;
+    rx_head = next;
+  }
+}
@@ -0,0 +1,64 @@
+//   EMONTX3-CONTINUOUS - host-side tools
+//
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   devsim - runs the whole firmware on the host, against the shim in
+//   shim/, with a model of the ADC and the serial port.
+//
+//   All of src/ except mem.cpp (which needs the AVR linker) is compiled
+//   with the instrumentation of -fsanitize=thread, like ringsim, and the
+//   hooks of the instrumentation are the clock of the model: every memory
+//   access of the firmware takes DEVSIM_ACCESS_CYCLES, and the interrupts
+//   that fall due meanwhile run before the next access while the I flag
+//   is set.  The ADC is free running at the prescalar in ADCSRA, and each
+//   conversion samples the pin selected when it started; the serial port
+//   takes one byte per character time.  The access cost is nominal, not a
+//   model of the AVR: it makes time pass while the firmware computes or
+//   waits for the transmit buffer, so that the ring and the serial port
+//   fill as they would, but it does not stand in for a cycle count.
+//
+//   Device time counts from the start of the first conversion, as the
+//   reading times of adc.cpp do.  They stay equal until a sampling profile
+//   switch: the reading in progress is then counted at the new rate, and
+//   the firmware's times are offset by a part of a reading from then on
+//   (devsim_clock_offset()).
+//
+
+#ifndef DEVSIM_H
+#define DEVSIM_H
+
+#include <stdint.h>
+
+#define DEVSIM_ACCESS_CYCLES 2  // [cycles] nominal cost of a memory access
+
+// Level of an ADC pin [ADU, 0-1023] at device time t [s]
+typedef int (*devsim_input_fn)(uint8_t pin, double t);
+// A line sent on the serial port, without the line break, and the device
+// time [s] at which its last character left
+typedef void (*devsim_line_fn)(const char *line, double t);
+
+// devsim_start() - power on: run setup()
+//   input - the signals at the ADC pins
+//   line - called for every line sent, or 0
+//   dip - level of the mains voltage DIP switch (HIGH: 240 V)
+void devsim_start(devsim_input_fn input, devsim_line_fn line, int dip);
+// devsim_run() - run loop() until device time t [s]
+void devsim_run(double t);
+// devsim_stall() - hold loop() until device time t [s]: only the
+//   interrupts run, as while the firmware is busy
+void devsim_stall(double t);
+// devsim_tx_instant() - send each character as soon as it is written
+//   (1) or at the baud rate (0, the default): with 1 the serial port
+//   never holds up the firmware
+void devsim_tx_instant(int on);
+// devsim_time() - device time [s]
+double devsim_time(void);
+// devsim_clock_offset() - [s] device time of the model less the
+//   firmware's time, for the last reading completed
+double devsim_clock_offset(void);
+// devsim_send() - characters for the firmware to receive, one per
+//   character time from now
+void devsim_send(const char *s);
+
+#endif
@@ -0,0 +1,693 @@
+//   EMONTX3-CONTINUOUS - host-side tools
+// 
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   emoningest - read the serial stream of one or more emonTx units and
+//   write the decoded records to a file.
+//
+//   Usage:
+//     emoningest [options] input [input ...]
+//       input - serial device (configured raw at --baud), FIFO or file,
+//               or - for standard input
+//       -o file   - output file (default standard output)
+//       -f csv    - CSV, one row per field: unit,time,name,retained,value
+//       -f col    - compact columnar file (see below)
+//       -b baud   - serial speed (default 115200)
+//       -n rows   - records per output batch (default 1024)
+//       -r file   - write the raw reading stream (src/raw.cpp) as a raw
+//                   capture for emonreproc; with several inputs, the unit
+//                   number is appended to the file name
+//     emoningest --bench [nrecords]
+//       decode a synthetic stream from memory and report the decode rate
+//     emoningest --check-pty [nrecords]
+//       send a synthetic stream with raw frames through a pseudo-terminal
+//       to a second emoningest, which reads the master side on standard
+//       input, and check its CSV
+//       and raw capture against decoding the same stream in memory
+//     emoningest --bench-raw
+//       encode synthetic readings as the firmware's raw stream, and report
+//       the data rate for each number of channels and sampling profile,
+//       and the decode rate
+//
+//   Each input is decoded independently; its index on the command line is
+//   the "unit" number in the output.  Records are stamped with the host
+//   clock when their line break is read.
+//
+//   Columnar file format (little-endian):
+//     "EMCOL1\n"                           file header
+//     per batch:
+//       uint32 nrows, uint16 ncols
+//       uint16 unit[nrows]
+//       int64  t_ns[nrows]                 arrival time, ns since 1970
+//       per column:
+//         uint8 namelen, char name[namelen], uint8 retained
+//         double value[nrows]              NaN where a row lacks the field
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/wait.h>
+#ifdef __APPLE__
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "emonparse.h"
+#include "emonraw.h"
+
+static int64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// ===================================================================
+// Output writers
+
+class writer {
+ public:
+  virtual ~writer() {}
+  virtual void add(uint16_t unit, const emon_record &rec) = 0;
+  virtual void flush(void) = 0;
+};
+
+// CSV: one row per field, so that records of any shape share one file
+class csv_writer : public writer {
+ public:
+  explicit csv_writer(FILE *fp_) : fp(fp_) {
+    fputs("unit,time,name,retained,value\n", fp);
+  }
+  void add(uint16_t unit, const emon_record &rec) {
+    char tbuf[32];
+    snprintf(tbuf, sizeof(tbuf), "%lld.%06lld",
+             (long long) (rec.t_ns / 1000000000LL),
+             (long long) ((rec.t_ns % 1000000000LL) / 1000));
+    for (size_t i=0; i<rec.fields.size(); i++) {
+      const emon_field &f = rec.fields[i];
+      if (f.is_int) {
+        fprintf(fp, "%u,%s,%s,%u,%lld\n", unit, tbuf, f.name, f.retained,
+                (long long) f.ivalue);
+      } else {
+        fprintf(fp, "%u,%s,%s,%u,%.9g\n", unit, tbuf, f.name, f.retained,
+                f.value);
+      }
+    }
+  }
+  void flush(void) { fflush(fp); }
+ private:
+  FILE *fp;
+};
+
+// Columnar: buffer a batch of rows and write each field as a column
+class col_writer : public writer {
+ public:
+  col_writer(FILE *fp_, size_t batch_) : fp(fp_), batch(batch_), nrows(0) {
+    fputs("EMCOL1\n", fp);
+  }
+  ~col_writer() { flush(); }
+  void add(uint16_t unit, const emon_record &rec) {
+    units.push_back(unit);
+    times.push_back(rec.t_ns);
+    for (size_t i=0; i<rec.fields.size(); i++) {
+      const emon_field &f = rec.fields[i];
+      column &c = cols[std::string(f.name)];
+      if (c.values.size() < nrows) c.values.resize(nrows, NAN);
+      c.retained = f.retained;
+      // Repeated names in one record keep the last value
+      if (c.values.size() == nrows) c.values.push_back(f.value);
+      else c.values[nrows] = f.value;
+    }
+    nrows ++;
+    if (nrows >= batch) flush();
+  }
+  void flush(void) {
+    if (nrows == 0) return;
+    uint32_t n = nrows;
+    uint16_t ncols = cols.size();
+    fwrite(&n, sizeof(n), 1, fp);
+    fwrite(&ncols, sizeof(ncols), 1, fp);
+    fwrite(&units[0], sizeof(uint16_t), nrows, fp);
+    fwrite(&times[0], sizeof(int64_t), nrows, fp);
+    for (std::map<std::string,column>::iterator it = cols.begin(); it != cols.end(); ++it) {
+      uint8_t len = it->first.size();
+      it->second.values.resize(nrows, NAN);
+      fwrite(&len, 1, 1, fp);
+      fwrite(it->first.data(), 1, len, fp);
+      fwrite(&it->second.retained, 1, 1, fp);
+      fwrite(&it->second.values[0], sizeof(double), nrows, fp);
+    }
+    fflush(fp);
+    cols.clear();
+    units.clear();
+    times.clear();
+    nrows = 0;
+  }
+ private:
+  struct column {
+    column() : retained(0) {}
+    uint8_t retained;
+    std::vector<double> values;
+  };
+  FILE *fp;
+  size_t batch, nrows;
+  std::vector<uint16_t> units;
+  std::vector<int64_t> times;
+  std::map<std::string,column> cols;
+};
+
+// Forwards one unit's records to the shared writer, and its raw stream
+// frames to its capture
+class unit_sink : public emon_sink {
+ public:
+  unit_sink(uint16_t unit_, writer *out_, emon_capture_writer *cap_)
+    : unit(unit_), out(out_), cap(cap_), nbad(0) {}
+  void record(const emon_record &rec) { if (out) out->add(unit, rec); }
+  void frame(const uint8_t *buf, size_t n, int64_t t_ns) {
+    if (!cap) return;
+    if (emon_frame_decode(buf, n, &f)) cap->add(f);
+    else nbad ++;
+  }
+  emon_capture_writer *capture(void) const { return cap; }
+  uint64_t n_bad(void) const { return nbad; }
+ private:
+  uint16_t unit;
+  writer *out;
+  emon_capture_writer *cap;
+  emon_frame f;
+  uint64_t nbad;
+};
+
+// ===================================================================
+// Inputs
+
+static speed_t baud_code(long baud)
+{
+  switch (baud) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+#ifdef B500000
+    case 500000: return B500000;
+#endif
+#ifdef B1000000
+    case 1000000: return B1000000;
+#endif
+  }
+  return 0;
+}
+
+static int open_input(const char *path, long baud)
+{
+  int fd;
+  if (strcmp(path, "-") == 0) {
+    fd = dup(STDIN_FILENO);
+    if (fd >= 0) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  } else {
+    fd = open(path, O_RDONLY | O_NOCTTY | O_NONBLOCK);
+  }
+  if (fd < 0) return -1;
+  if (isatty(fd)) {
+    struct termios tio;
+    speed_t sp = baud_code(baud);
+    if (tcgetattr(fd, &tio) == 0) {
+      cfmakeraw(&tio);
+      tio.c_cflag |= CLOCAL | CREAD;
+      if (sp) { cfsetispeed(&tio, sp); cfsetospeed(&tio, sp); }
+      tcsetattr(fd, TCSANOW, &tio);
+    }
+  }
+  return fd;
+}
+
+// ===================================================================
+// Benchmark
+
+class count_sink : public emon_sink {
+ public:
+  count_sink() : nvals(0), sum(0) {}
+  void record(const emon_record &rec) {
+    nvals += rec.fields.size();
+    if (!rec.fields.empty()) sum += rec.fields[0].value;
+  }
+  uint64_t nvals;
+  double sum;
+};
+
+// Build a stream that looks like the output of one unit with four
+// inputs and the per-cycle stream on: mostly cs/cpN lines, and the lines
+// of each report (see the report ring in src/cont.h) in turn
+static std::string synth_stream(size_t nrecords)
+{
+  std::string s;
+  char line[512];
+  for (size_t i=0; i<nrecords; i++) {
+    unsigned long tsec = i / 50, tus = (i % 50) * 20000;
+    unsigned k = i % 64, j;
+    int n = 0;
+    switch (k) {
+      case 0:
+        n = snprintf(line, sizeof(line), "vrms:%.2f,vfrq:%.3f,vcrs:%.3f,tsec:%lu,tus:%lu,\r\n",
+                     240.0 + (i%7)*0.13, 50.0 + (i%9)*0.001, 1.409 + (i%5)*0.001, tsec, tus);
+        break;
+      case 1: case 2: case 3: case 4:
+        j = k - 1;
+        n = snprintf(line, sizeof(line),
+                     "irm%u:%.3f,pac%u:%.1f,pre%u:%.1f,pow%u:%.4f,ipk%u:%.2f,icf%u:%.3f,tsec:%lu,tus:%lu,\r\n",
+                     j, 5.432 + j, j, 1234.5 + i%11, j, -12.3 * j, j, 0.9468, j, 7.65 + j, j, 1.409,
+                     tsec, tus);
+        break;
+      case 5: case 6: case 7: case 8:
+        j = k - 5;
+        n = snprintf(line, sizeof(line), "pmn%u:%.1f,pmx%u:%.1f,pme%u:%.1f,tsec:%lu,tus:%lu,\r\n",
+                     j, 1200.0 - j, j, 1260.0 + j, j, 1234.0 + i%13, tsec, tus);
+        break;
+      case 9:
+        n = snprintf(line, sizeof(line),
+                     "_enac:%lu,_enre:%lu,_adcd:%u,_novr:0,_lost:%lu,_uptm:%lu,_stkh:%u,_memf:%u,"
+                     "tsec:%lu,tus:%lu,\r\n",
+                     (unsigned long) (i*3), (unsigned long) (i/7), 6 + (unsigned) (i%5),
+                     (unsigned long) (i/1000), tsec, 180 + (unsigned) (i%3), 72, tsec, tus);
+        break;
+      case 10:
+        n = snprintf(line, sizeof(line),
+                     "pulse:%lu,plav:%.1f,plsp:%.1f,plmn:%.1f,plmx:%.1f,tsec:%lu,tus:%lu,\r\n",
+                     (unsigned long) (i/64), 845.2, 850.0, 812.5, 901.3, tsec, tus);
+        break;
+      case 11:
+        n = snprintf(line, sizeof(line),
+                     "dmtm:%lu,dme0:%.2f,dme1:%.2f,dme2:%.2f,dme3:%.2f,dmet:%.2f,_dmpk:%.3f,_dmpt:%lu,"
+                     "tsec:%lu,tus:%lu,\r\n",
+                     tsec, 301.25, 12.5, 0.0, 44.75, 358.5, 1.434, tsec, tsec, tus);
+        break;
+      case 12:
+        n = snprintf(line, sizeof(line), "evch:%u,evdp:%.1f,evdq:%.1f,evst:%u,tsec:%lu,tus:%lu,\r\n",
+                     (unsigned) (i%4), 1980.4, -35.2, 60, tsec, tus);
+        break;
+      default:
+        n = snprintf(line, sizeof(line), "cs:%lu,cp0:%d,cp1:%d,cp2:%d,cp3:%d,\r\n",
+                     (unsigned long) (i & 0xff), (int) (i%1000), -5, 0, 312);
+        break;
+    }
+    s.append(line, n);
+  }
+  return s;
+}
+
+static int bench(size_t nrecords)
+{
+  std::string s = synth_stream(nrecords);
+  count_sink sink;
+  emon_parser parser(&sink);
+  const size_t chunk = 4096;   // typical read() size
+  int passes = 0;
+  int64_t t0 = now_ns(), t1;
+  do {
+    for (size_t i=0; i<s.size(); i+=chunk) {
+      size_t n = s.size() - i;
+      if (n > chunk) n = chunk;
+      parser.feed(s.data()+i, n, 0);
+    }
+    passes ++;
+    t1 = now_ns();
+  } while (t1 - t0 < 1000000000LL);
+
+  double secs = (t1 - t0) * 1e-9;
+  printf("bench: %llu fields in %llu records, %.1f MB, %.3f s\n",
+         (unsigned long long) parser.n_fields(),
+         (unsigned long long) parser.n_records(),
+         s.size()*passes*1e-6, secs);
+  printf("bench: %.2f Mfields/s, %.1f MB/s, %llu errors\n",
+         parser.n_fields()/secs*1e-6, s.size()*passes/secs*1e-6,
+         (unsigned long long) parser.n_errors());
+  return parser.n_errors() ? 1 : 0;
+}
+
+// Raw stream: synthetic readings of a 50 Hz supply, with a distorted
+// load on each CT, as raw ADC values
+static void synth_reading(size_t i, double usec, int16_t vals[5])
+{
+  static const double amp[5] = {400, 300, 120, 40, 8};
+  double t = i * usec * 1e-6;
+  for (int j = 0; j < 5; j++) {
+    double ph = 2*M_PI*50.0*(t + j*usec*1e-6/5) - 0.4*j;
+    double v = amp[j] * (sin(ph) + (j ? 0.3*sin(3*ph) + 0.15*sin(5*ph) : 0.03*sin(3*ph)));
+    vals[j] = (int16_t) floor(512.0 + v + 0.5 + ((int) ((i*7 + j*3) % 5) - 2) * 0.4);
+  }
+}
+
+static int bench_raw(void)
+{
+  static const int prescalar[3] = {128, 64, 32};
+  static const long bauds[4] = {115200, 250000, 500000, 1000000};
+  const double secs = 10.0;
+  int errors = 0;
+
+  printf("bench-raw: 50 Hz, V + distorted CT loads, %.0f s per case, 64 byte frames\n", secs);
+  printf("%9s %5s %10s %8s %10s %9s", "prescalar", "chans", "readings/s", "B/read", "bytes/s", "B/sample");
+  for (int b = 0; b < 4; b++) printf("  dec@%-7ld", bauds[b]);
+  printf("\n");
+  for (int pi = 0; pi < 3; pi++) {
+    double usec = 13.0 * prescalar[pi] / 16.0 * 5;   // 5 conversions per reading
+    size_t nread = (size_t) (secs * 1e6 / usec);
+    for (int nch = 1; nch <= 5; nch++) {
+      emon_frame_encoder enc((1 << nch) - 1, 1, (uint16_t) usec);
+      int16_t vals[EMON_FRAME_MAXCHAN] = {0};
+      for (size_t i = 0; i < nread; i++) {
+        synth_reading(i, usec, vals);
+        enc.add(vals, (uint32_t) (i * usec), 0);
+      }
+      enc.flush();
+      double bps = enc.out.size() / secs;
+      printf("%9d %5d %10.0f %8.2f %10.0f %9.3f", prescalar[pi], nch, nread / secs,
+             (double) enc.out.size() / nread, bps, (double) enc.out.size() / nread / nch);
+      // Smallest decimation that fits 90% of each line rate
+      for (int b = 0; b < 4; b++) {
+        double cap = 0.9 * bauds[b] / 10.0;
+        printf("  %-11d", (int) ceil(bps / cap));
+      }
+      printf("\n");
+    }
+  }
+
+  // Decode rate, and a check that the readings come back
+  {
+    double usec = 260;
+    size_t nread = 2000000;
+    emon_frame_encoder enc(0x1f, 1, (uint16_t) usec);
+    int16_t vals[EMON_FRAME_MAXCHAN] = {0};
+    for (size_t i = 0; i < nread; i++) {
+      synth_reading(i, usec, vals);
+      enc.add(vals, (uint32_t) (i * usec), 0);
+    }
+    enc.flush();
+
+    class check_sink : public emon_sink {
+     public:
+      check_sink() : nread(0), nbad(0) {}
+      void record(const emon_record &rec) {}
+      void frame(const uint8_t *buf, size_t n, int64_t t_ns) {
+        if (!emon_frame_decode(buf, n, &f)) { nbad ++; return; }
+        for (size_t i = 0; i < f.nread; i++) {
+          int16_t vals[EMON_FRAME_MAXCHAN];
+          synth_reading(nread + i, 260, vals);
+          if (memcmp(vals, f.vals + 5*i, 5*sizeof(int16_t)) != 0) nbad ++;
+        }
+        nread += f.nread;
+      }
+      emon_frame f;
+      size_t nread, nbad;
+    } sink;
+    emon_parser parser(&sink);
+    int64_t t0 = now_ns();
+    for (size_t i = 0; i < enc.out.size(); i += 4096) {
+      size_t n = enc.out.size() - i;
+      if (n > 4096) n = 4096;
+      parser.feed((const char *) &enc.out[i], n, 0);
+    }
+    double dt = (now_ns() - t0) * 1e-9;
+    printf("bench-raw: decoded %zu readings of 5 channels in %.3f s (with check): "
+           "%.1f Mreadings/s, %.1f MB/s, %zu errors\n", sink.nread, dt,
+           sink.nread / dt * 1e-6, enc.out.size() / dt * 1e-6, sink.nbad + (size_t) parser.n_errors());
+    errors = (sink.nbad || parser.n_errors() || sink.nread != nread);
+  }
+  return errors;
+}
+
+// ===================================================================
+// Pseudo-terminal check
+
+// read_file() - whole contents of a file; with drop_time, the time column
+//   of each CSV row is removed
+static std::string read_file(const std::string &path, bool drop_time)
+{
+  std::string s;
+  char line[256];
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (!fp) return s;
+  if (!drop_time) {
+    size_t n;
+    while ((n = fread(line, 1, sizeof(line), fp)) > 0) s.append(line, n);
+  } else {
+    while (fgets(line, sizeof(line), fp)) {
+      char *c1 = strchr(line, ','), *c2 = c1 ? strchr(c1+1, ',') : 0;
+      if (c1 && c2) memmove(c1, c2, strlen(c2)+1);
+      s += line;
+    }
+  }
+  fclose(fp);
+  return s;
+}
+
+static int check_pty(const char *self, size_t nrecords)
+{
+  char dir[] = "/tmp/emoningest.XXXXXX";
+  if (!mkdtemp(dir)) { perror("emoningest: mkdtemp"); return 1; }
+  std::string d(dir);
+
+  // The stream: text lines with raw frames inserted after the first
+  // field of every third line, as the firmware interleaves them
+  std::string text = synth_stream(nrecords), s;
+  emon_frame_encoder enc(0x1f, 1, 260);
+  int16_t vals[EMON_FRAME_MAXCHAN] = {0};
+  size_t iread = 0, iframe = 0, nlines = 0;
+  for (size_t pos = 0; pos < text.size(); nlines++) {
+    size_t eol = text.find('\n', pos) + 1;
+    if (nlines % 3 == 0) {
+      size_t cut = text.find(',', pos) + 1;
+      while (iframe == enc.out.size()) {
+        synth_reading(iread, 260, vals);
+        enc.add(vals, (uint32_t) (iread * 260), 0);
+        iread ++;
+      }
+      size_t flen = enc.out[iframe+1] + 3;
+      s.append(text, pos, cut - pos);
+      s.append((const char *) &enc.out[iframe], flen);
+      s.append(text, cut, eol - cut);
+      iframe += flen;
+    } else {
+      s.append(text, pos, eol - pos);
+    }
+    pos = eol;
+  }
+
+  // Expected: the same stream decoded in memory
+  {
+    FILE *fp = fopen((d + "/exp.csv").c_str(), "wb");
+    FILE *cfp = fopen((d + "/exp.raw").c_str(), "wb");
+    if (!fp || !cfp) { perror("emoningest: check-pty"); return 1; }
+    csv_writer out(fp);
+    emon_capture_writer cap(cfp);
+    unit_sink sink(0, &out, &cap);
+    emon_parser parser(&sink);
+    for (size_t i = 0; i < s.size(); i += 4096) {
+      parser.feed(s.data()+i, std::min((size_t) 4096, s.size()-i), 0);
+    }
+    parser.flush();
+    fclose(fp);
+    fclose(cfp);
+  }
+
+  // The writer takes the terminal side of a pseudo-terminal, and the
+  // reader its master side on standard input.  Closing the master hangs
+  // the terminal side up and discards what it holds, whereas closing the
+  // terminal side lets the master read everything buffered before EIO,
+  // so the reader sees the whole stream and then its end.  Both sides
+  // are raw, so that no byte is translated or echoed.
+  int master, slave;
+  char name[256];
+  struct termios tio;
+  if (openpty(&master, &slave, name, 0, 0) < 0) { perror("emoningest: openpty"); return 1; }
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(master, STDIN_FILENO);
+    close(master);
+    close(slave);
+    execl(self, self, "-o", (d + "/act.csv").c_str(), "-r", (d + "/act.raw").c_str(),
+          "-", (char *) 0);
+    perror("emoningest: exec");
+    _exit(127);
+  }
+  close(master);
+  // Send in pieces of the size of a serial driver's buffer, then close
+  // the writer and wait for the reader to reach the end of the stream
+  int64_t t0 = now_ns();
+  for (size_t i = 0; i < s.size(); ) {
+    ssize_t n = write(slave, s.data()+i, std::min((size_t) 256, s.size()-i));
+    if (n < 0 && errno != EINTR) { perror("emoningest: write"); break; }
+    if (n > 0) i += n;
+  }
+  close(slave);
+  int status = 0;
+  waitpid(pid, &status, 0);
+  double secs = (now_ns() - t0) * 1e-9;
+
+  std::string exp_csv = read_file(d + "/exp.csv", true);
+  std::string act_csv = read_file(d + "/act.csv", true);
+  std::string exp_raw = read_file(d + "/exp.raw", false);
+  std::string act_raw = read_file(d + "/act.raw", false);
+  bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+            !exp_csv.empty() && exp_csv == act_csv && exp_raw.size() > 64 && exp_raw == act_raw;
+  printf("check-pty: %zu records, %zu raw readings, %.1f kB through %s in %.2f s: %s\n",
+         nrecords, iread, s.size() * 1e-3, name, secs, ok ? "ok" : "FAILED");
+  if (!ok) {
+    printf("check-pty: CSV %zu/%zu bytes, capture %zu/%zu bytes (expected/received); kept in %s\n",
+           exp_csv.size(), act_csv.size(), exp_raw.size(), act_raw.size(), dir);
+    return 1;
+  }
+  const char *files[] = {"exp.csv", "exp.raw", "act.csv", "act.raw"};
+  for (int i = 0; i < 4; i++) unlink((d + "/" + files[i]).c_str());
+  rmdir(dir);
+  return 0;
+}
+
+// ===================================================================
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "usage: emoningest [-o file] [-f csv|col] [-b baud] [-n rows] [-r capture] input ...\n"
+          "       emoningest --bench [nrecords]\n"
+          "       emoningest --bench-raw\n"
+          "       emoningest --check-pty [nrecords]\n");
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  const char *outpath = 0;
+  const char *format = "csv";
+  const char *rawpath = 0;
+  long baud = 115200;
+  size_t batch = 1024;
+  std::vector<const char *> inputs;
+
+  for (int i=1; i<argc; i++) {
+    const char *a = argv[i];
+    if (strcmp(a, "--bench") == 0) {
+      size_t n = (i+1 < argc) ? strtoul(argv[i+1], 0, 10) : 100000;
+      return bench(n ? n : 100000);
+    } else if (strcmp(a, "--bench-raw") == 0) {
+      return bench_raw();
+    } else if (strcmp(a, "--check-pty") == 0) {
+      size_t n = (i+1 < argc) ? strtoul(argv[i+1], 0, 10) : 20000;
+      return check_pty(argv[0], n ? n : 20000);
+    } else if (strcmp(a, "-o") == 0 && i+1 < argc) {
+      outpath = argv[++i];
+    } else if (strcmp(a, "-f") == 0 && i+1 < argc) {
+      format = argv[++i];
+    } else if (strcmp(a, "-r") == 0 && i+1 < argc) {
+      rawpath = argv[++i];
+    } else if (strcmp(a, "-b") == 0 && i+1 < argc) {
+      baud = strtol(argv[++i], 0, 10);
+    } else if (strcmp(a, "-n") == 0 && i+1 < argc) {
+      batch = strtoul(argv[++i], 0, 10);
+      if (batch == 0) batch = 1;
+    } else if (a[0] == '-' && a[1]) {
+      usage();
+    } else {
+      inputs.push_back(a);
+    }
+  }
+  if (inputs.empty()) usage();
+
+  FILE *fp = stdout;
+  if (outpath && !(fp = fopen(outpath, "wb"))) {
+    fprintf(stderr, "emoningest: %s: %s\n", outpath, strerror(errno));
+    return 1;
+  }
+  writer *out;
+  if (strcmp(format, "csv") == 0) out = new csv_writer(fp);
+  else if (strcmp(format, "col") == 0) out = new col_writer(fp, batch);
+  else usage();
+
+  std::vector<struct pollfd> fds;
+  std::vector<unit_sink *> sinks;
+  std::vector<emon_parser *> parsers;
+  for (size_t i=0; i<inputs.size(); i++) {
+    int fd = open_input(inputs[i], baud);
+    if (fd < 0) {
+      fprintf(stderr, "emoningest: %s: %s\n", inputs[i], strerror(errno));
+      return 1;
+    }
+    struct pollfd p = {fd, POLLIN, 0};
+    fds.push_back(p);
+    emon_capture_writer *cap = 0;
+    if (rawpath) {
+      std::string path(rawpath);
+      if (inputs.size() > 1) path += "." + std::to_string(i);
+      FILE *cfp = fopen(path.c_str(), "wb");
+      if (!cfp) {
+        fprintf(stderr, "emoningest: %s: %s\n", path.c_str(), strerror(errno));
+        return 1;
+      }
+      cap = new emon_capture_writer(cfp);
+    }
+    sinks.push_back(new unit_sink(i, out, cap));
+    parsers.push_back(new emon_parser(sinks.back()));
+  }
+
+  char buf[65536];
+  size_t nopen = fds.size();
+  while (nopen > 0) {
+    if (poll(&fds[0], fds.size(), -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    for (size_t i=0; i<fds.size(); i++) {
+      if (fds[i].fd < 0 || !(fds[i].revents & (POLLIN|POLLHUP|POLLERR))) continue;
+      ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+      if (n > 0) {
+        parsers[i]->feed(buf, n, now_ns());
+      } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        // End of file, or the device went away
+        parsers[i]->flush();
+        close(fds[i].fd);
+        fds[i].fd = -1;
+        nopen --;
+      }
+    }
+  }
+
+  out->flush();
+  for (size_t i=0; i<parsers.size(); i++) {
+    if (parsers[i]->n_errors()) {
+      fprintf(stderr, "emoningest: %s: %llu malformed fields dropped\n",
+              inputs[i], (unsigned long long) parsers[i]->n_errors());
+    }
+    if (emon_capture_writer *cap = sinks[i]->capture()) {
+      fprintf(stderr, "emoningest: %s: raw stream: %llu frames, %llu readings, "
+              "%llu readings lost in %llu frames, %llu frames skipped\n", inputs[i],
+              (unsigned long long) parsers[i]->n_frames(), (unsigned long long) cap->n_readings(),
+              (unsigned long long) cap->n_lost(), (unsigned long long) cap->n_frames_lost(),
+              (unsigned long long) (cap->n_skipped() + sinks[i]->n_bad()));
+      fclose(cap->file());
+      delete cap;
+    }
+    delete parsers[i];
+    delete sinks[i];
+  }
+  delete out;
+  if (fp != stdout) fclose(fp);
+  return 0;
+}
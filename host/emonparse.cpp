@@ -0,0 +1,195 @@
+//   EMONTX3-CONTINUOUS - host-side tools
+// 
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   Incremental decoder for the emontx3-continuous serial text format.
+//
+
+#include <math.h>
+#include <string.h>
+#include "emonparse.h"
+
+// Powers of ten for the decimal digits printed by Serial.print(float,digits)
+static const double pow10_neg[] = {
+  1e0, 1e-1, 1e-2, 1e-3, 1e-4, 1e-5, 1e-6, 1e-7, 1e-8, 1e-9, 1e-10,
+  1e-11, 1e-12, 1e-13, 1e-14, 1e-15, 1e-16, 1e-17, 1e-18
+};
+
+// Character classes
+static inline bool is_name_char(char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+static inline bool is_value_char(char c)
+{
+  return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ||
+    (c >= 'a' && c <= 'z');  // nan, inf, ovf
+}
+
+bool emon_parse_value(const char *s, size_t n, emon_field *f)
+{
+  size_t i = 0;
+  bool neg = false;
+  uint64_t mant = 0;
+  int ndigits = 0, nfrac = -1;
+
+  if (n == 0) return false;
+  // Arduino Print::printFloat() special values
+  if (n == 3 && memcmp(s, "nan", 3) == 0) { f->value = NAN; f->is_int = 0; return true; }
+  if (n == 3 && memcmp(s, "ovf", 3) == 0) { f->value = NAN; f->is_int = 0; return true; }
+  if (n == 3 && memcmp(s, "inf", 3) == 0) { f->value = INFINITY; f->is_int = 0; return true; }
+  if (n == 4 && memcmp(s, "-inf", 4) == 0) { f->value = -INFINITY; f->is_int = 0; return true; }
+
+  if (s[0] == '-' || s[0] == '+') { neg = (s[0] == '-'); i++; }
+  for (; i<n; i++) {
+    char c = s[i];
+    if (c >= '0' && c <= '9') {
+      if (ndigits >= 19) return false;   // would overflow the mantissa
+      mant = mant*10 + (c - '0');
+      ndigits ++;
+      if (nfrac >= 0) nfrac ++;
+    } else if (c == '.' && nfrac < 0) {
+      nfrac = 0;
+    } else {
+      return false;
+    }
+  }
+  if (ndigits == 0) return false;
+
+  if (nfrac < 0) {
+    f->is_int = 1;
+    f->ivalue = neg ? -(int64_t) mant : (int64_t) mant;
+    f->value = (double) f->ivalue;
+  } else {
+    f->is_int = 0;
+    f->value = (double) mant * pow10_neg[nfrac];
+    if (neg) f->value = -f->value;
+  }
+  return true;
+}
+
+emon_parser::emon_parser(emon_sink *sink_)
+  : sink(sink_), state(FIELD_START), name_len(0), value_len(0), frame_len(0),
+    nfields(0), nrecords(0), nerrors(0), ncomments(0), nframes(0)
+{
+  rec.t_ns = 0;
+  rec.fields.reserve(64);
+  memset(&cur, 0, sizeof(cur));
+}
+
+void emon_parser::error(char c)
+{
+  nerrors ++;
+  // Resynchronize at the next field separator
+  state = (c == ',') ? FIELD_START : SKIP;
+}
+
+bool emon_parser::finish_value(void)
+{
+  if (!emon_parse_value(value_buf, value_len, &cur)) return false;
+  rec.fields.push_back(cur);
+  nfields ++;
+  return true;
+}
+
+void emon_parser::end_line(int64_t t_ns)
+{
+  // A value not closed by "," was truncated
+  if (state == NAME || state == VALUE) nerrors ++;
+  if (!rec.fields.empty()) {
+    rec.t_ns = t_ns;
+    if (sink) sink->record(rec);
+    nrecords ++;
+    rec.fields.clear();
+  }
+  state = FIELD_START;
+}
+
+void emon_parser::end_frame(int64_t t_ns)
+{
+  uint8_t sum = 0;
+  for (size_t i = 1; i < frame_len-1; i++) sum ^= frame_buf[i];
+  if (sum == frame_buf[frame_len-1]) {
+    nframes ++;
+    if (sink) sink->frame(frame_buf, frame_len, t_ns);
+  } else {
+    nerrors ++;
+  }
+  frame_len = 0;
+}
+
+void emon_parser::feed(const char *buf, size_t n, int64_t t_ns)
+{
+  const char *end = buf + n;
+  for (const char *p = buf; p < end; p++) {
+    char c = *p;
+    // Raw stream frames, which leave the text state alone
+    if (frame_len > 0) {
+      frame_buf[frame_len++] = c;
+      if (frame_len > 2 && frame_len == (size_t) frame_buf[1] + 3) end_frame(t_ns);
+      continue;
+    }
+    if ((uint8_t) c == EMON_FRAME_SYNC) {
+      frame_buf[0] = c;
+      frame_len = 1;
+      continue;
+    }
+
+    if (c == '\n') { end_line(t_ns); continue; }
+    if (c == '\r') continue;
+
+    switch (state) {
+      case FIELD_START:
+        if (c == ',') break;
+        if (c == '#' && rec.fields.empty()) { ncomments ++; state = COMMENT; break; }
+        memset(cur.name, 0, sizeof(cur.name));
+        cur.retained = 0;
+        name_len = 0;
+        if (c == '_') { cur.retained = 1; state = NAME; break; }
+        if (!is_name_char(c)) { error(c); break; }
+        cur.name[name_len++] = c;
+        state = NAME;
+        break;
+
+      case NAME:
+        if (c == ':') {
+          if (name_len == 0) { error(c); break; }
+          value_len = 0;
+          state = VALUE;
+        } else if (is_name_char(c) && name_len < EMON_NAME_MAX-1) {
+          cur.name[name_len++] = c;
+        } else {
+          error(c);
+        }
+        break;
+
+      case VALUE:
+        if (c == ',') {
+          if (!finish_value()) nerrors ++;
+          state = FIELD_START;
+        } else if (is_value_char(c) && value_len < EMON_VALUE_MAX) {
+          value_buf[value_len++] = c;
+        } else {
+          error(c);
+        }
+        break;
+
+      case SKIP:
+        if (c == ',') state = FIELD_START;
+        break;
+
+      case COMMENT:
+        break;
+    }
+  }
+}
+
+void emon_parser::flush(void)
+{
+  if (frame_len > 0) nerrors ++;
+  frame_len = 0;
+  if (state == NAME || state == VALUE) nerrors ++;
+  rec.fields.clear();
+  state = FIELD_START;
+}
@@ -0,0 +1,102 @@
+//   EMONTX3-CONTINUOUS - host-side tools
+// 
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   Incremental decoder for the emontx3-continuous serial text format.
+//
+//   The firmware sends lines of "name:value," fields.  A leading "_" marks
+//   an MQTT retained value.  Each line break ends a record (a batch of
+//   related readings).  Lines beginning with "#" are comments.  The
+//   decoder accepts input in arbitrary pieces, as it arrives, and never
+//   allocates per field.  Malformed or truncated fields are dropped and
+//   counted, and decoding resynchronizes at the next "," or line break.
+//
+//   Binary frames of the raw reading stream (src/raw.cpp) may be inserted
+//   anywhere in the text.  They begin with EMON_FRAME_SYNC, a byte that
+//   never occurs in the text, and carry their length; they are taken out
+//   of the stream, checked, and passed to emon_sink::frame().  Frames with
+//   a bad checksum are dropped and counted as errors.
+//
+
+#ifndef EMONPARSE_H
+#define EMONPARSE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define EMON_NAME_MAX  8    // longest field name, including terminator
+#define EMON_VALUE_MAX 24   // longest value text
+#define EMON_FRAME_SYNC 0xA5 // first byte of a raw stream frame
+#define EMON_FRAME_MAX 258   // longest frame: sync, length, 255 bytes, checksum
+
+// One decoded field
+struct emon_field {
+  char name[EMON_NAME_MAX]; // without the "_" prefix
+  uint8_t retained;         // 1 if sent with the "_" prefix
+  uint8_t is_int;           // 1 if the value had no decimal point
+  int64_t ivalue;           // value, if is_int
+  double value;             // value (always set)
+};
+
+// One record: all fields of one line
+struct emon_record {
+  int64_t t_ns;             // arrival time of the line break [ns]
+  std::vector<emon_field> fields;
+};
+
+// Receiver of decoded records
+class emon_sink {
+ public:
+  virtual ~emon_sink() {}
+  virtual void record(const emon_record &rec) = 0;
+  // frame() - a raw stream frame, from the sync byte to the checksum
+  virtual void frame(const uint8_t *buf, size_t n, int64_t t_ns) {}
+};
+
+class emon_parser {
+ public:
+  explicit emon_parser(emon_sink *sink);
+
+  // feed() - decode the next piece of the stream
+  //   buf, n - received bytes
+  //   t_ns - arrival time of these bytes [ns]
+  void feed(const char *buf, size_t n, int64_t t_ns);
+
+  // flush() - end of stream; a final unterminated line is dropped
+  void flush(void);
+
+  uint64_t n_fields(void) const { return nfields; }
+  uint64_t n_records(void) const { return nrecords; }
+  uint64_t n_errors(void) const { return nerrors; }
+  uint64_t n_comments(void) const { return ncomments; }
+  uint64_t n_frames(void) const { return nframes; }
+
+ private:
+  enum state_t { FIELD_START, NAME, VALUE, SKIP, COMMENT };
+
+  void end_line(int64_t t_ns);
+  void end_frame(int64_t t_ns);
+  void error(char c);
+  bool finish_value(void);
+
+  emon_sink *sink;
+  state_t state;
+  emon_record rec;
+  emon_field cur;
+  uint8_t name_len;
+  char value_buf[EMON_VALUE_MAX+1];
+  uint8_t value_len;
+  uint8_t frame_buf[EMON_FRAME_MAX];
+  size_t frame_len;          // bytes of the frame received; 0 = in text
+  uint64_t nfields, nrecords, nerrors, ncomments, nframes;
+};
+
+// emon_parse_value() - convert value text as printed by the firmware
+//   s, n - text
+//   f - field to receive value, ivalue and is_int
+//   returns: true if the text is a valid value
+bool emon_parse_value(const char *s, size_t n, emon_field *f);
+
+#endif
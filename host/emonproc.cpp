@@ -0,0 +1,466 @@
+//   EMONTX3-CONTINUOUS - host-side tools
+//
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   Reprocessing engine (see emonproc.h).  Every step follows the
+//   corresponding firmware function in state.cpp; the comments name it.
+//   This file must be compiled with -fsingle-precision-constant and
+//   -ffp-contract=off (see the Makefile).
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <cmath>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "emonproc.h"
+
+using std::sqrt;
+using std::cos;
+using std::sin;
+
+// Firmware configuration and calibration
+#define F_CPU 16000000UL
+#define PGM_P const char *  // flash strings are plain strings on the host
+#include "../src/cont.h"
+#include "../src/cal.h"
+
+#if defined(ADC_INTERLEAVE) || defined(THREE_PHASE)
+#error "emonproc models the plain single-phase sampling sequence only"
+#endif
+#if N_ADC_CHAN > EMON_RAW_MAXCHAN
+#error "EMON_RAW_MAXCHAN is too small for this board"
+#endif
+
+// Calibration tables, as defined in the firmware
+const float ical[N_CUR_CHAN] = ICAL_CHANS;
+static const float iphcal[N_CUR_CHAN] = IPH_CHANS;
+uint8_t adc_notice_chan[N_CUR_CHAN] = ADC_NOTICE_CHAN;
+
+#define FREQ_NCYCLES   120   // accum_freq()
+
+// =========================================================
+// Voltage history, as store_vhist(), store_vhist_gap() and
+// retrieve_vhist()
+struct vhist {
+  int16_t ring[N_VHIST_RING];
+  uint8_t cur;
+
+  void init(void) { memset(ring, 0, sizeof(ring)); cur = N_VHIST_RING; }
+  void store(int16_t val) {
+    cur = (cur + 1) % N_VHIST_RING;
+    ring[cur] = val;
+  }
+  void store_gap(int16_t val, uint8_t gap) {
+    int16_t last = ring[cur % N_VHIST_RING];
+    int16_t dv = val - last;
+    uint16_t i = 1;
+    if (gap >= N_VHIST_RING) i = gap - N_VHIST_RING + 2;
+    for (; i <= gap; i++) store(last + (int16_t) ((int32_t) dv * i / (gap + 1)));
+    store(val);
+  }
+  int16_t get(uint8_t ilookback) const {
+    uint16_t c = (cur + N_VHIST_RING - ilookback);
+    while (c >= N_VHIST_RING) c -= N_VHIST_RING;
+    return ring[c];
+  }
+};
+
+// float40() of a 64-bit sum, through the device's 40-bit representation
+static float sum_float(int64_t v)
+{
+  struct sum40 a;
+  a.lo = (uint32_t) v;
+  a.hi = (int8_t) (v >> 32);
+  return float40(&a);
+}
+
+// =========================================================
+int emon_open(const char *path, struct emon_capture *cap)
+{
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  memset(cap, 0, sizeof(*cap));
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(cap->hdr)) { close(fd); return -1; }
+  cap->maplen = st.st_size;
+  cap->map = mmap(0, cap->maplen, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (cap->map == MAP_FAILED) { cap->map = 0; return -1; }
+  madvise(cap->map, cap->maplen, MADV_SEQUENTIAL);
+
+  memcpy(&cap->hdr, cap->map, sizeof(cap->hdr));
+  if (memcmp(cap->hdr.magic, EMON_RAW_MAGIC, sizeof(EMON_RAW_MAGIC)) != 0 ||
+      cap->hdr.nchan != N_ADC_CHAN || cap->hdr.reading_usec == 0) {
+    emon_close(cap);
+    return -1;
+  }
+  cap->rec = (const int16_t *) ((const char *) cap->map + sizeof(cap->hdr));
+  cap->nrec = (cap->maplen - sizeof(cap->hdr)) / (sizeof(int16_t) * cap->hdr.nchan);
+  return 0;
+}
+
+void emon_close(struct emon_capture *cap)
+{
+  if (cap->map) munmap(cap->map, cap->maplen);
+  cap->map = 0;
+}
+
+// =========================================================
+// derive_rate_constants(), for the plain sequence with all channels
+static void derive_rate_constants(struct emon_plan_info *info)
+{
+  uint32_t sample_period = info->sample_period, vmains_period = info->vmains_period;
+  uint8_t j;
+
+  info->vhist_lookback = (vmains_period + 2*sample_period) / (sample_period*4);
+  for (j=0; j<N_CUR_CHAN; j++) {
+    uint8_t adc_chan_offset = j+1;
+    float ph = M_PI/180.0*(PHV + iphcal[j]);
+    ph += (float) 2.0 * M_PI * adc_chan_offset * sample_period / ADC_NCONV / vmains_period;
+    info->cosph[j] = cos(ph);
+    info->sinph[j] = sin(ph);
+  }
+}
+
+enum { P_STAB, P_SCAN, P_ZER1, P_FREQ, P_STAT };
+
+int emon_plan(const struct emon_capture *cap, const struct emon_options *opt,
+              struct emon_plan_info *info, std::vector<struct emon_window> &windows)
+{
+  const uint8_t nchan = cap->hdr.nchan;
+  const uint32_t usec = cap->hdr.reading_usec;
+  const uint8_t nclear = N_READINGS+N_VHIST_RING;
+  int state = P_STAB;
+  uint32_t t = 0, t_start = 0, start_time = 0;
+  uint64_t t64 = 0;
+  int16_t off[EMON_RAW_MAXCHAN] = {0};
+  int16_t oldval = 0, val = 0;
+  uint16_t nreadings = 0, ncycles = 0;
+  int32_t val_sum[EMON_RAW_MAXCHAN];
+  uint32_t n[EMON_RAW_MAXCHAN];
+  size_t zer1_first = 0, next_first = 0;
+  struct emon_window w;
+  uint8_t j;
+
+  memset(info, 0, sizeof(*info));
+  info->nchan = nchan;
+  windows.clear();
+
+  for (size_t i = 0; i < cap->nrec; i++) {
+    const int16_t *r = cap->rec + i * nchan;
+    if (r[0] == EMON_RAW_GAP) {
+      // The device clock counted the lost readings
+      t += (uint32_t) (uint16_t) r[1] * usec;
+      t64 += (uint64_t) (uint16_t) r[1] * usec;
+      continue;
+    }
+    t += usec;
+    t64 += usec;
+
+    switch (state) {
+    case P_STAB: // stabilize_inputs()
+      if (nreadings++ == 0) t_start = t;
+      if ((t - t_start) < STABILIZE_DURATION) break;
+      nreadings = 0;
+      state = P_SCAN;
+      break;
+
+    case P_SCAN: // scan_inputs(); the zero points are still 0
+      if (nreadings == 0) {
+        start_time = t;
+        memset(val_sum, 0, sizeof(val_sum));
+        memset(n, 0, sizeof(n));
+      }
+      for (j = 0; j<nchan; j++) {
+        int16_t v = r[j];
+        if (v > 0) {
+          if (n[j] == 0) info->scan_min[j] = info->scan_max[j] = v;
+          if (v < info->scan_min[j]) info->scan_min[j] = v;
+          if (v > info->scan_max[j]) info->scan_max[j] = v;
+          val_sum[j] += v;
+          n[j] ++;
+        }
+      }
+      // Scanned for SCAN_DURATION by the reading timestamps
+      nreadings ++;
+      if ((t - start_time) < SCAN_DURATION) break;
+
+      info->sample_period = (t - start_time) / nreadings;
+      nreadings = 0;
+      start_time = 0;
+      if (n[0] == 0 || val_sum[0] == 0) return -1; // no voltage
+      info->present[0] = 1;
+      off[0] = val_sum[0] / n[0];
+      {
+        uint8_t ncur = 0;
+        for (j = 1; j<nchan; j++) {
+          info->present[j] = adc_notice_chan[j-1] && n[j] > 0 && val_sum[j] != 0;
+          if (info->present[j]) { off[j] = val_sum[j] / n[j]; ncur++; }
+        }
+        if (ncur == 0) return -1;
+      }
+      if (opt->use_offsets) {
+        for (j = 0; j<nchan; j++) if (cap->hdr.offset[j]) off[j] = cap->hdr.offset[j];
+      }
+      memcpy(info->offset, off, sizeof(off));
+      oldval = val = 0;
+      zer1_first = i + 1;
+      state = P_ZER1;
+      break;
+
+    case P_ZER1: // zero_crossing()
+      oldval = val; val = r[0] - off[0];
+      nreadings ++;
+      if (nreadings > nclear && oldval < 0 && val >= 0) {
+        nreadings = 0;
+        state = P_FREQ;
+      }
+      break;
+
+    case P_FREQ: // accum_freq(), then calc_freq()
+      if (start_time == 0) start_time = t;
+      oldval = val; val = r[0] - off[0];
+      if (!(oldval < 0 && val >= 0)) break;
+      if (++ncycles < FREQ_NCYCLES) break;
+      info->vmains_period = (t - start_time) / ncycles;
+      derive_rate_constants(info);
+      ncycles = 0;
+      start_time = 0;
+      next_first = i + 1;
+      state = P_STAT;
+      break;
+
+    case P_STAT: // accum_stats(); the windows end at zero crossings
+      if (start_time == 0) {
+        start_time = t;
+        ncycles = 0;
+      }
+      oldval = val; val = r[0] - off[0];
+      if (!(oldval < 0 && val >= 0)) break;
+      ncycles++;
+      if ((t - start_time) < ACCUM_PERIOD) break;
+
+      memset(&w, 0, sizeof(w));
+      w.first = next_first;
+      w.end = i + 1;
+      w.warm = (w.first > zer1_first + N_VHIST_RING) ? w.first - N_VHIST_RING : zer1_first;
+      w.t_start = start_time;
+      w.t_end = t;
+      w.t_end64 = t64;
+      w.ncycles = ncycles;
+      windows.push_back(w);
+      // calc_stats() starts the next window at this reading
+      start_time = t;
+      ncycles = 0;
+      next_first = i + 1;
+      break;
+    }
+  }
+  return (state == P_STAT) ? 0 : -1;
+}
+
+// =========================================================
+// emon_accumulate() - accum_stats() and the current channel kernels
+void emon_accumulate(const struct emon_capture *cap, const struct emon_plan_info *info,
+                     struct emon_window *w)
+{
+  const uint8_t nchan = info->nchan;
+  const uint8_t lookback = info->vhist_lookback;
+  struct vhist h;
+  uint8_t chans[EMON_RAW_MAXCHAN], nchans = 0, j, gap = 0;
+  uint32_t ngap = 0;
+  int16_t off[EMON_RAW_MAXCHAN];
+  size_t i;
+
+  memcpy(off, info->offset, sizeof(off));
+  for (j = 1; j<nchan; j++) if (info->present[j]) chans[nchans++] = j;
+  memset(w->s, 0, sizeof(w->s));
+  for (j = 0; j<nchan; j++) {
+    w->s[j].val_min = INT16_MAX;
+    w->s[j].val_max = INT16_MIN;
+  }
+  w->n = 0;
+  w->nlost = 0;
+
+  // Refill the voltage history as the earlier states did
+  h.init();
+  for (i = w->warm; i < w->first; i++) {
+    const int16_t *r = cap->rec + i * nchan;
+    if (r[0] == EMON_RAW_GAP) { ngap += (uint16_t) r[1]; continue; }
+    gap = (ngap > 255) ? 255 : ngap;  // as the device's reading->gap
+    h.store_gap(r[0] - off[0], gap);
+    ngap = 0;
+  }
+
+  for (i = w->first; i < w->end; i++) {
+    const int16_t *r = cap->rec + i * nchan;
+    struct emon_chan_sums *vs = &w->s[0];
+    int16_t vval, vdel;
+    if (r[0] == EMON_RAW_GAP) { ngap += (uint16_t) r[1]; continue; }
+
+    vval = r[0] - off[0];
+    if (ngap) {
+      gap = (ngap > 255) ? 255 : ngap;
+      w->nlost += gap;
+      h.store_gap(vval, gap);
+      ngap = 0;
+    } else {
+      h.store(vval);
+    }
+    vdel = h.get(lookback);
+
+    vs->val_sum += vval;
+    vs->val2 += (int32_t) vval * vval;
+    vs->proddel += (int32_t) vval * vdel;
+    if (vval > vs->val_max) vs->val_max = vval;
+    if (vval < vs->val_min) vs->val_min = vval;
+    w->n ++;
+
+    for (j = 0; j<nchans; j++) {
+      uint8_t c = chans[j];
+      struct emon_chan_sums *s = &w->s[c];
+      int16_t val = r[c] - off[c];
+      s->val_sum += val;
+      s->val2 += (int32_t) val * val;
+      s->prod += (int32_t) val * vval;
+      s->proddel += (int32_t) val * vdel;
+      if (val > s->val_max) s->val_max = val;
+      if (val < s->val_min) s->val_min = val;
+    }
+  }
+}
+
+// =========================================================
+// emon_calc() - calc_stats(), window by window
+void emon_calc(const struct emon_plan_info *info, const struct emon_options *opt,
+               const std::vector<struct emon_window> &windows,
+               std::vector<struct emon_result> &results)
+{
+  float VCAL, VCAL2;
+  float vavg_ra = 0.0, iavg_ra[N_CUR_CHAN] = {0};
+  float vmains_fprod = 0.0;
+  int32_t energy_fracac = 0, energy_fracre = 0;
+  int32_t energy_active = 0, energy_reactive = 0;
+  float pac_prev[N_CUR_CHAN] = {0}, pre_prev[N_CUR_CHAN] = {0};
+  uint8_t j;
+
+  // init_cal()
+  if (opt->vmains == 120) VCAL = VCAL_120VAC*VCAL_ADC;
+  else                    VCAL = VCAL_240VAC*VCAL_ADC;
+  VCAL2 = VCAL*VCAL;
+
+  results.resize(windows.size());
+  for (size_t k = 0; k < windows.size(); k++) {
+    const struct emon_window *w = &windows[k];
+    struct emon_result *res = &results[k];
+    float invwt, invt, accum_time, tlost, vavg;
+    int16_t vmin, vmax;
+
+    memset(res, 0, sizeof(*res));
+    res->t_end = w->t_end64;
+    res->nlost = w->nlost;
+    invwt = 1.0 / w->n;
+    accum_time = 1.0e-6*(w->t_end - w->t_start);
+    res->accum_time = accum_time;
+    invt = 1.0 / accum_time;
+    // Lost readings, at the previous window's power
+    tlost = 1.0e-6*(w->nlost * info->sample_period);
+    if (tlost > accum_time) tlost = accum_time;
+    res->vfreq = w->ncycles / accum_time;
+
+    // Voltage; init_stats() starts the minimum and maximum at 0
+    {
+      float vavg2, vrms2, vrms;
+      float vcal = invwt * VCAL, vcal2 = vcal * VCAL;
+      float crest_factor = 1.0, vpeak;
+
+      vavg = (float) w->s[0].val_sum * vcal;
+      if (vavg_ra == 0) vavg_ra = vavg;
+      vavg_ra = RA_PAST * vavg_ra + RA_CUR * vavg;
+      vavg2 = vavg_ra*vavg_ra;
+      vrms2 = sum_float(w->s[0].val2) * vcal2 - vavg2;
+      if (vrms2 <= 0) vrms2 = 0;
+      vrms = sqrt(vrms2);
+      vmin = (w->s[0].val_min < 0) ? w->s[0].val_min : 0;
+      vmax = (w->s[0].val_max > 0) ? w->s[0].val_max : 0;
+      vpeak = (vmax-vmin)*VCAL/2.0;
+      if (vrms > 100.0) crest_factor = vpeak / vrms;
+      res->vrms = vrms;
+      res->vcrest = crest_factor;
+
+      if (vmains_fprod == 0) {
+        vmains_fprod = sum_float(w->s[0].proddel) * invwt * VCAL2 - vavg2;
+        vmains_fprod /= vrms2;
+      }
+    }
+
+    // Current channels
+    for (j = 0; j<N_CUR_CHAN; j++) {
+      const struct emon_chan_sums *s = &w->s[j+1];
+      float iavg, iavg2, irms2, irms;
+      float pre0, pac0, pre1, pac1;
+      float p_offset, pow_ac, pow_re, pap, power_factor, eac, ere;
+      float ical1 = ical[j]*invwt, ical2 = ical1*ical[j], ivcal = ical1*VCAL;
+      int32_t old_energy_active = energy_active, old_energy_reactive = energy_reactive;
+      int16_t imin, imax, init_min = 0, init_max = 0;
+
+      if (!info->present[j+1]) continue;
+
+      iavg = (float) s->val_sum * ical1;
+      if (iavg_ra[j] == 0) iavg_ra[j] = iavg;
+      iavg_ra[j] = RA_PAST * iavg_ra[j] + RA_CUR * iavg;
+      iavg2 = iavg_ra[j]*iavg_ra[j];
+      p_offset = vavg_ra * iavg_ra[j];
+
+      irms2 = sum_float(s->val2) * ical2 - iavg2;
+      if (irms2 <= 0) irms2 = 0;
+      irms = sqrt(irms2);
+
+      pac0 = sum_float(s->prod)    * ivcal - p_offset;
+      pre0 = sum_float(s->proddel) * ivcal - p_offset;
+      pac1 = pac0;
+      pre1 = pre0 - vmains_fprod*pac0;
+      pow_ac =  info->cosph[j]*pac1 - info->sinph[j]*pre1;
+      pow_re = +info->sinph[j]*pac1 + info->cosph[j]*pre1;
+
+      if (k == 0) { pac_prev[j] = pow_ac; pre_prev[j] = pow_re; }
+      eac = pow_ac * (accum_time - tlost) + pac_prev[j] * tlost;
+      ere = pow_re * (accum_time - tlost) + pre_prev[j] * tlost;
+      pac_prev[j] = pow_ac; pre_prev[j] = pow_re;
+
+      energy_fracac += eac;
+      energy_fracre += ere;
+      energy_active   += energy_fracac / 3600; energy_fracac %= 3600;
+      energy_reactive += energy_fracre / 3600; energy_fracre %= 3600;
+      if ((old_energy_active >  0x70000000 && energy_active < 0) ||
+          (old_energy_active < -0x70000000 && energy_active > 0)) energy_active = 0;
+      if ((old_energy_reactive >  0x70000000 && energy_reactive < 0) ||
+          (old_energy_reactive < -0x70000000 && energy_reactive > 0)) energy_reactive = 0;
+
+      // As queue_reports() reports the window: the active and reactive
+      // power are those its energy is counted at
+      pow_ac = eac * invt;
+      pow_re = ere * invt;
+      pap = (irms*res->vrms);
+      power_factor = 1.0;
+      if (pap > MIN_POWER && pap >= pow_ac) power_factor = pow_ac / pap;
+
+      // The first window still has the extremes of the input scan
+      if (k == 0) { init_min = info->scan_min[j+1]; init_max = info->scan_max[j+1]; }
+      imin = (s->val_min < init_min) ? s->val_min : init_min;
+      imax = (s->val_max > init_max) ? s->val_max : init_max;
+      res->ipk[j] = ((imax > -imin) ? imax : -imin) * ical[j];
+
+      res->irms[j] = irms;
+      res->pac[j] = pow_ac;
+      res->pre[j] = pow_re;
+      res->pf[j] = power_factor;
+    }
+    res->enac = energy_active;
+    res->enre = energy_reactive;
+  }
+}
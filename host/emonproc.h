@@ -0,0 +1,157 @@
+//   EMONTX3-CONTINUOUS - host-side tools
+//
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   Reprocessing engine: runs the firmware's measurement pipeline over a
+//   recorded raw capture of ADC readings.
+//
+//   The pipeline is that of state.cpp for the plain sampling sequence:
+//   the startup states (stabilize, scan for inputs and zero points, wait
+//   for a zero crossing, measure the mains period), then the accumulation
+//   windows of accum_stats() and the arithmetic of calc_stats().  The
+//   configuration (cont.h) and the calibration (cal.h) are compiled in from
+//   the firmware sources, so a capture can be reprocessed with corrected
+//   constants by editing cal.h and rebuilding.
+//
+//   Work is split in three passes:
+//     emon_plan()       - sequential; follows the voltage channel through
+//                         the startup states and finds every window
+//                         boundary (the zero crossings)
+//     emon_accumulate() - the integer sums of one window; windows are
+//                         independent, so any number run in parallel
+//     emon_calc()       - sequential, in window order; the floating point
+//                         stage of calc_stats(), which carries running
+//                         averages and energy from window to window
+//
+//   Exactness: the integer sums are the same as the device's.  The
+//   floating point stage is evaluated in single precision (the engine is
+//   compiled with -fsingle-precision-constant, like double on the AVR) in
+//   the same order, so the results are the same to the bit, except where
+//   the cos() and sin() of the phase correction differ between avr-libc
+//   and the host library in the last place.  emon_calc() is written after
+//   calc_stats() rather than compiled from it, so emonreproc --check
+//   compares the whole pipeline with the reports of the firmware itself,
+//   run by reprocsim on the same capture, to the digits it prints.
+//
+//   Not modelled: ADC_INTERLEAVE, THREE_PHASE, sampling profile changes and
+//   current transformer hot-plug during the capture.
+//
+
+#ifndef EMONPROC_H
+#define EMONPROC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define EMON_RAW_MAXCHAN 16
+
+// Raw capture file (little-endian):
+//   struct emon_raw_header
+//   one record of int16 vals[nchan] per reading: raw ADC values (0-1023)
+//   in channel order, voltage first, before the zero point is removed.
+//   A record with vals[0] == EMON_RAW_GAP marks readings lost; vals[1] is
+//   their number (1-32767), and the next record is the reading that
+//   follows them.  Consecutive gap records add up; like the device, the
+//   pipeline counts at most 255 lost readings before one reading.
+#define EMON_RAW_MAGIC "EMRAW1\n"
+#define EMON_RAW_GAP ((int16_t) -32768)
+struct emon_raw_header {
+  char magic[8];          // EMON_RAW_MAGIC
+  uint8_t nchan;          // values per reading
+  uint8_t reserved[3];
+  uint32_t reading_usec;  // [us] time per reading
+  int16_t offset[EMON_RAW_MAXCHAN]; // device zero points, or 0 if unknown
+};
+
+// A capture, mapped into memory
+struct emon_capture {
+  struct emon_raw_header hdr;
+  const int16_t *rec;     // records
+  size_t nrec;            // number of records
+  void *map;              // mapping, for emon_close()
+  size_t maplen;
+};
+
+// Sums of one channel over a window (the 40-bit sums of reading_stats)
+struct emon_chan_sums {
+  int32_t val_sum;
+  int64_t val2, prod, proddel;
+  int16_t val_min, val_max;
+};
+
+// One accumulation window
+struct emon_window {
+  size_t warm;            // first record to refill the voltage history from
+  size_t first, end;      // records accumulated: first .. end-1
+  uint32_t t_start, t_end; // [us] device reading times (32-bit, as on the device)
+  uint64_t t_end64;       // [us] device time at the end of the window
+  uint16_t ncycles;       // mains cycles
+  // Filled in by emon_accumulate()
+  uint32_t n;             // readings accumulated
+  uint32_t nlost;         // readings lost
+  struct emon_chan_sums s[EMON_RAW_MAXCHAN];
+};
+
+// Constants found by emon_plan(), as the device finds them at startup
+struct emon_plan_info {
+  uint8_t nchan;
+  uint8_t present[EMON_RAW_MAXCHAN]; // channel j is used (0 = voltage)
+  int16_t offset[EMON_RAW_MAXCHAN];  // zero points
+  uint32_t sample_period;            // [us]
+  uint32_t vmains_period;            // [us]
+  uint8_t vhist_lookback;            // [readings] quarter cycle
+  float cosph[EMON_RAW_MAXCHAN-1], sinph[EMON_RAW_MAXCHAN-1];
+  // Minimum and maximum of each current channel during the input scan,
+  // which the device carries into the first window
+  int16_t scan_min[EMON_RAW_MAXCHAN], scan_max[EMON_RAW_MAXCHAN];
+};
+
+// Results of one window (calc_stats())
+struct emon_result {
+  uint64_t t_end;          // [us] device time at the end of the window
+  float accum_time;        // [sec]
+  float vrms, vfreq, vcrest;
+  uint32_t nlost;
+  // pac and pre as reported: the lost time counts at the previous power
+  float irms[EMON_RAW_MAXCHAN-1], pac[EMON_RAW_MAXCHAN-1], pre[EMON_RAW_MAXCHAN-1];
+  float pf[EMON_RAW_MAXCHAN-1];
+  float ipk[EMON_RAW_MAXCHAN-1];  // [A] peak current in the window
+  int32_t enac, enre;      // [Wh] cumulative energy registers
+};
+
+// Options
+struct emon_options {
+  int vmains;              // 120 or 240 (the DIP switch)
+  int use_offsets;         // use the zero points in the header, if known
+};
+
+int emon_open(const char *path, struct emon_capture *cap);
+void emon_close(struct emon_capture *cap);
+
+// emon_plan() - follow the startup states and find the windows
+//   returns: 0 on success, or -1 if the capture ends before the first
+//   window starts or the input scan finds no voltage or no current input
+//   (the device would start over; info is then incomplete)
+int emon_plan(const struct emon_capture *cap, const struct emon_options *opt,
+              struct emon_plan_info *info, std::vector<struct emon_window> &windows);
+
+// emon_accumulate() - integer sums of one window
+void emon_accumulate(const struct emon_capture *cap, const struct emon_plan_info *info,
+                     struct emon_window *w);
+
+// emon_calc() - calc_stats() for the windows in order
+void emon_calc(const struct emon_plan_info *info, const struct emon_options *opt,
+               const std::vector<struct emon_window> &windows,
+               std::vector<struct emon_result> &results);
+
+// emon_synth() - synthesize a capture in memory (emonsynth.cpp)
+//   minutes - length
+//   gaps - mark runs of readings lost now and then
+//   data - the records, which cap points into
+#define EMON_CHECK_MINUTES 1.5   // length of the capture of emonreproc --check
+void emon_synth(double minutes, bool gaps, std::vector<int16_t> &data,
+                struct emon_capture *cap);
+
+#endif
@@ -0,0 +1,174 @@
+//   EMONTX3-CONTINUOUS - host-side tools
+//
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   Raw reading stream (see emonraw.h and src/raw.cpp)
+//
+
+#include <string.h>
+#include "emonraw.h"
+#include "emonproc.h"
+
+static inline uint16_t get16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static inline uint32_t get32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+bool emon_frame_decode(const uint8_t *buf, size_t n, emon_frame *f)
+{
+  const uint8_t *p = buf + EMON_FRAME_HEADER, *end = buf + n - 1;
+  int16_t last[EMON_FRAME_MAXCHAN];
+  uint8_t chans[EMON_FRAME_MAXCHAN];
+  size_t nvals = 0;
+  uint8_t j;
+
+  if (n < EMON_FRAME_HEADER + 1) return false;
+  f->seq = buf[2];
+  f->mask = get16(buf+3);
+  f->dec = buf[5];
+  f->usec = get16(buf+6);
+  f->t = get32(buf+8);
+  f->nchan = 0;
+  for (j = 0; j < EMON_FRAME_MAXCHAN; j++) {
+    if (f->mask & (1 << j)) chans[f->nchan++] = j;
+  }
+  if (f->nchan == 0) return false;
+  memset(last, 0, sizeof(last));
+
+  while (p < end) {
+    uint16_t z = *p++;
+    if (z & 0x80) {
+      if (p >= end) return false;
+      z = ((z & 0x7f) << 8) | *p++;
+    }
+    uint8_t c = chans[nvals % f->nchan];
+    int16_t d = (int16_t) ((z >> 1) ^ -(z & 1));
+    last[c] += d;
+    f->vals[nvals++] = last[c];
+  }
+  if (nvals % f->nchan) return false;
+  f->nread = nvals / f->nchan;
+  return true;
+}
+
+// =========================================================
+emon_frame_encoder::emon_frame_encoder(uint16_t mask_, uint8_t dec_, uint16_t usec_,
+                                       size_t frame_size_)
+  : nframes(0), mask(mask_), dec(dec_), count(0), seq(0), maxlen(0), usec(usec_),
+    frame_size(frame_size_)
+{
+  for (int j = 0; j < EMON_FRAME_MAXCHAN; j++) if (mask & (1 << j)) maxlen += 2;
+  frame.reserve(frame_size);
+}
+
+void emon_frame_encoder::open(uint32_t t)
+{
+  frame.clear();
+  frame.push_back(EMON_FRAME_SYNC);
+  frame.push_back(0);
+  frame.push_back(seq);
+  frame.push_back(mask);
+  frame.push_back(mask >> 8);
+  frame.push_back(dec);
+  frame.push_back(usec);
+  frame.push_back(usec >> 8);
+  for (int i = 0; i < 4; i++) frame.push_back(t >> (8*i));
+  memset(last, 0, sizeof(last));
+}
+
+void emon_frame_encoder::flush(void)
+{
+  uint8_t sum = 0;
+  if (frame.empty()) return;
+  frame[1] = frame.size() - 2;
+  for (size_t i = 1; i < frame.size(); i++) sum ^= frame[i];
+  frame.push_back(sum);
+  out.insert(out.end(), frame.begin(), frame.end());
+  frame.clear();
+  seq ++;
+  nframes ++;
+}
+
+void emon_frame_encoder::add(const int16_t *vals, uint32_t t, uint8_t gap)
+{
+  if (gap) { flush(); count = 0; }
+  if (count) { count--; return; }
+  count = dec - 1;
+  if (frame.empty()) open(t);
+  for (int j = 0; j < EMON_FRAME_MAXCHAN; j++) {
+    if (!(mask & (1 << j))) continue;
+    int16_t d = vals[j] - last[j];
+    uint16_t z = ((uint16_t) d << 1) ^ (uint16_t) (d >> 15);
+    if (z < 0x80) {
+      frame.push_back(z);
+    } else {
+      frame.push_back(0x80 | (z >> 8));
+      frame.push_back(z);
+    }
+    last[j] = vals[j];
+  }
+  if (frame.size() + maxlen + 1 > frame_size) flush();
+}
+
+// =========================================================
+emon_capture_writer::emon_capture_writer(FILE *fp_)
+  : fp(fp_), started(false), mask(0), nchan(0), dec(0), seq(0), usec(0), t_next(0),
+    nreadings(0), nlost(0), nframes_lost(0), nskipped(0)
+{
+}
+
+void emon_capture_writer::write_header(const emon_frame &f)
+{
+  struct emon_raw_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, EMON_RAW_MAGIC, sizeof(EMON_RAW_MAGIC));
+  nchan = (f.mask >> 5) ? 16 : 5;
+  hdr.nchan = nchan;
+  hdr.reading_usec = (uint32_t) f.usec * f.dec;
+  fwrite(&hdr, sizeof(hdr), 1, fp);
+  mask = f.mask;
+  dec = f.dec;
+  usec = f.usec;
+  started = true;
+}
+
+void emon_capture_writer::add(const emon_frame &f)
+{
+  int16_t rec[EMON_FRAME_MAXCHAN];
+  uint32_t period = (uint32_t) f.usec * f.dec;
+
+  if (!started) {
+    write_header(f);
+  } else {
+    if (f.mask != mask || f.dec != dec || f.usec != usec) { nskipped ++; return; }
+    nframes_lost += (uint8_t) (f.seq - seq - 1);
+    // Readings lost between frames, from the frame times
+    uint32_t dt = f.t - t_next;
+    uint64_t lost = (dt + period/2) / period;
+    if (dt < 0x80000000u && lost > 0) {
+      nlost += lost;
+      while (lost > 0) {
+        uint16_t k = (lost > 32767) ? 32767 : lost;
+        memset(rec, 0, sizeof(rec));
+        rec[0] = EMON_RAW_GAP;
+        rec[1] = k;
+        fwrite(rec, sizeof(int16_t), nchan, fp);
+        lost -= k;
+      }
+    }
+  }
+  seq = f.seq;
+  t_next = f.t + f.nread * period;
+
+  for (size_t i = 0; i < f.nread; i++) {
+    uint8_t k = 0;
+    memset(rec, 0, sizeof(rec));
+    for (uint8_t j = 0; j < nchan; j++) {
+      if (mask & (1 << j)) rec[j] = f.vals[i*f.nchan + k++];
+    }
+    fwrite(rec, sizeof(int16_t), nchan, fp);
+  }
+  nreadings += f.nread;
+}
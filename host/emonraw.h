@@ -0,0 +1,93 @@
+//   EMONTX3-CONTINUOUS - host-side tools
+//
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   Raw reading stream: frame decoder, capture writer, and an encoder
+//   that produces the same frames as the firmware (for benchmarks).  The
+//   frame layout is described in src/raw.cpp.  Frames are separated from
+//   the text reports by emon_parser (emonparse.h).
+//
+
+#ifndef EMONRAW_H
+#define EMONRAW_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+#include "emonparse.h"
+
+#define EMON_FRAME_HEADER 12  // bytes before the payload
+#define EMON_FRAME_MAXCHAN 16
+
+// One decoded frame
+struct emon_frame {
+  uint8_t seq;             // sequence number
+  uint16_t mask;           // channels (bit 0 = voltage)
+  uint8_t nchan;           // channels in the mask
+  uint8_t dec;             // decimation
+  uint16_t usec;           // [us] time per reading taken
+  uint32_t t;              // [us] device time of the first reading
+  size_t nread;            // readings
+  int16_t vals[EMON_FRAME_MAX]; // raw values, nchan per reading
+};
+
+// emon_frame_decode() - decode a frame
+//   buf, n - frame, from the sync byte to the checksum (already checked)
+//   f - decoded frame
+//   returns: true if the payload holds a whole number of readings
+bool emon_frame_decode(const uint8_t *buf, size_t n, emon_frame *f);
+
+// Encoder, as stream_raw() in the firmware
+class emon_frame_encoder {
+ public:
+  emon_frame_encoder(uint16_t mask, uint8_t dec, uint16_t usec, size_t frame_size = 64);
+  // add() - add one reading taken by the device
+  //   vals - raw values of all channels
+  //   t - [us] device time of the reading
+  //   gap - readings lost just before it
+  void add(const int16_t *vals, uint32_t t, uint8_t gap);
+  // flush() - send the open frame
+  void flush(void);
+  std::vector<uint8_t> out;  // frames sent
+  uint64_t nframes;
+
+ private:
+  void open(uint32_t t);
+  uint16_t mask;
+  uint8_t dec, count, seq, maxlen;
+  uint16_t usec;
+  size_t frame_size;
+  std::vector<uint8_t> frame;
+  int16_t last[EMON_FRAME_MAXCHAN];
+};
+
+// Writes the readings of decoded frames as a raw capture (emonproc.h), in
+// the channel layout of the board: 5 channels, or 16 if the mask has
+// channels beyond 4.  Channels not streamed are written as 0, which
+// emonreproc treats as not connected.  Readings lost between frames are
+// recorded as gaps.  The capture keeps the channels, decimation and
+// reading time of its first frame; frames that differ are skipped.
+class emon_capture_writer {
+ public:
+  explicit emon_capture_writer(FILE *fp);
+  void add(const emon_frame &f);
+  uint64_t n_readings(void) const { return nreadings; }
+  uint64_t n_lost(void) const { return nlost; }        // readings lost
+  uint64_t n_frames_lost(void) const { return nframes_lost; }
+  uint64_t n_skipped(void) const { return nskipped; }  // frames skipped
+  FILE *file(void) const { return fp; }
+
+ private:
+  void write_header(const emon_frame &f);
+  FILE *fp;
+  bool started;
+  uint16_t mask;
+  uint8_t nchan, dec, seq;
+  uint16_t usec;
+  uint32_t t_next;          // [us] expected time of the next reading
+  uint64_t nreadings, nlost, nframes_lost, nskipped;
+};
+
+#endif
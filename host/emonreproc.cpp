@@ -0,0 +1,339 @@
+//   EMONTX3-CONTINUOUS - host-side tools
+//
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   emonreproc - reprocess recorded raw captures with the firmware's
+//   measurement pipeline (see emonproc.h), on all cores.
+//
+//   Usage:
+//     emonreproc [options] capture ...
+//       -j threads   worker threads (default: one per core)
+//       -o file      write the CSV to file (default: standard output)
+//       -V 120|240   mains voltage setting (default 240)
+//       -O           use the zero points in the capture header instead
+//                    of measuring them as the device does
+//       --from sec, --to sec
+//                    report only windows ending in this range of device
+//                    time.  Processing stops at --to, but every window
+//                    before --from is still processed, since the running
+//                    averages and energy carry forward: a range late in a
+//                    long capture costs nearly as much as all of it.
+//     emonreproc --bench [minutes]
+//       synthesize a capture of the given length (default 30) in memory,
+//       and report the throughput with one thread and with all threads,
+//       and the time of each pass
+//     emonreproc --check reference.csv
+//       process a fixed synthetic capture, with lost readings, on one
+//       thread and on four, and compare the CSV with the reports of the
+//       firmware itself on the same capture (see reprocsim.cpp)
+//
+//   Each capture is planned (its windows found) on its own thread, then
+//   the windows of all captures are shared out among the threads in
+//   chunks, and finally calc_stats() runs over each capture's windows in
+//   order.  One CSV row is written per window.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <atomic>
+#include <thread>
+#include <string>
+#include <vector>
+#include "emonproc.h"
+
+#define CHUNK_WINDOWS 4  // windows per work item
+#define CHECK_TOL 1e-6    // relative tolerance of --check, beyond the digits printed
+
+struct job {
+  const char *name;
+  struct emon_capture cap;
+  struct emon_plan_info info;
+  std::vector<struct emon_window> windows;
+  std::vector<struct emon_result> results;
+  int ok;
+};
+
+static double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+// run_threads() - call fn(k) for k = 0..n-1 on nthreads threads; each
+//   thread takes the next item from a shared counter
+template<typename F> static void run_threads(size_t n, int nthreads, F fn)
+{
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> pool;
+  auto worker = [&]() {
+    size_t k;
+    while ((k = next++) < n) fn(k);
+  };
+  if (nthreads < 1) nthreads = 1;
+  for (int i = 1; i < nthreads; i++) pool.emplace_back(worker);
+  worker();
+  for (auto &th : pool) th.join();
+}
+
+// process() - plan, accumulate and calculate all jobs
+//   to - [sec] device time to stop at: later windows are dropped
+//   tpass - if given, [sec] time of each pass
+static void process(std::vector<struct job> &jobs, const struct emon_options *opt, int nthreads,
+                    double to = 1e300, double *tpass = 0)
+{
+  std::vector<std::pair<size_t, size_t> > items; // (job, first window)
+  double t0 = now_sec(), t1, t2;
+
+  run_threads(jobs.size(), nthreads, [&](size_t k) {
+    jobs[k].ok = (emon_plan(&jobs[k].cap, opt, &jobs[k].info, jobs[k].windows) == 0);
+    while (!jobs[k].windows.empty() && 1.0e-6 * jobs[k].windows.back().t_end64 >= to) {
+      jobs[k].windows.pop_back();
+    }
+  });
+  for (size_t k = 0; k < jobs.size(); k++) {
+    if (!jobs[k].ok) continue;
+    for (size_t w = 0; w < jobs[k].windows.size(); w += CHUNK_WINDOWS) items.push_back(std::make_pair(k, w));
+  }
+  t1 = now_sec();
+  run_threads(items.size(), nthreads, [&](size_t i) {
+    struct job &jb = jobs[items[i].first];
+    size_t end = items[i].second + CHUNK_WINDOWS;
+    if (end > jb.windows.size()) end = jb.windows.size();
+    for (size_t w = items[i].second; w < end; w++) emon_accumulate(&jb.cap, &jb.info, &jb.windows[w]);
+  });
+  t2 = now_sec();
+  run_threads(jobs.size(), nthreads, [&](size_t k) {
+    if (jobs[k].ok) emon_calc(&jobs[k].info, opt, jobs[k].windows, jobs[k].results);
+  });
+  if (tpass) {
+    tpass[0] = t1 - t0;
+    tpass[1] = t2 - t1;
+    tpass[2] = now_sec() - t2;
+  }
+}
+
+// write_csv() - one row per window
+static void write_csv(FILE *f, const std::vector<struct job> &jobs, double from, double to)
+{
+  uint8_t nchan = 0;
+  for (const struct job &jb : jobs) if (jb.ok) nchan = jb.info.nchan;
+  fprintf(f, "file,tsec,accum,vrms,vfrq,vcrs,lost");
+  for (uint8_t j = 1; j < nchan; j++) fprintf(f, ",irm%d,pac%d,pre%d,pow%d,ipk%d", j, j, j, j, j);
+  fprintf(f, ",enac,enre\n");
+
+  for (const struct job &jb : jobs) {
+    for (const struct emon_result &r : jb.results) {
+      double tsec = 1.0e-6 * r.t_end;
+      if (tsec < from || tsec >= to) continue;
+      fprintf(f, "%s,%.6f,%.9g,%.9g,%.9g,%.9g,%u", jb.name, tsec, r.accum_time,
+              r.vrms, r.vfreq, r.vcrest, r.nlost);
+      for (uint8_t j = 1; j < jb.info.nchan; j++) {
+        if (!jb.info.present[j]) { fprintf(f, ",,,,,"); continue; }
+        fprintf(f, ",%.9g,%.9g,%.9g,%.9g,%.9g", r.irms[j-1], r.pac[j-1], r.pre[j-1],
+                r.pf[j-1], r.ipk[j-1]);
+      }
+      fprintf(f, ",%d,%d\n", r.enac, r.enre);
+    }
+  }
+}
+
+// =========================================================
+// Benchmark.  The plan and calc passes run one thread per capture, so
+// with one capture only the accumulate pass is shared out; the times of
+// the passes bound the speed-up on more cores.
+
+static void bench(double minutes, int nthreads)
+{
+  std::vector<int16_t> data;
+  std::vector<struct job> jobs(1);
+  struct emon_options opt = {240, 0};
+  double tpass[3];
+
+  jobs[0].name = "bench";
+  emon_synth(minutes, false, data, &jobs[0].cap);
+  size_t nread = jobs[0].cap.nrec, nchan = jobs[0].cap.hdr.nchan;
+
+  printf("# %.0f min capture: %zu readings, %zu samples\n", minutes, nread, nread * nchan);
+  for (int pass = 0; pass < 2; pass++) {
+    int nth = pass ? nthreads : 1;
+    double t0 = now_sec(), dt;
+    process(jobs, &opt, nth, 1e300, tpass);
+    dt = now_sec() - t0;
+    if (!jobs[0].ok) { fprintf(stderr, "emonreproc: bench capture did not plan\n"); return; }
+    printf("%2d thread%s %7.3f s  %7.1f Mreadings/s  %7.1f Msamples/s  %6.1f Msamples/s/core"
+           "  %6.0fx real time  (%zu windows)\n",
+           nth, nth == 1 ? " " : "s", dt, nread / dt * 1e-6, nread * nchan / dt * 1e-6,
+           nread * nchan / dt * 1e-6 / nth, minutes * 60 / dt, jobs[0].windows.size());
+    printf("           plan %.3f s, accumulate %.3f s, calc %.3f s\n", tpass[0], tpass[1], tpass[2]);
+    if (pass == 0) {
+      // Amdahl's law: only the accumulate pass runs in parallel
+      double serial = (tpass[0] + tpass[2]) / (tpass[0] + tpass[1] + tpass[2]);
+      printf("           serial fraction %.3f: speed-up at most %.1fx on 4 cores, %.1fx on 8\n",
+             serial, 1 / (serial + (1 - serial) / 4), 1 / (serial + (1 - serial) / 8));
+    }
+  }
+}
+
+// =========================================================
+// Check against a reference
+
+// check_csv() - CSV of the --check capture, processed on nthreads threads
+static std::string check_csv(int nthreads)
+{
+  std::vector<int16_t> data;
+  std::vector<struct job> jobs(1);
+  struct emon_options opt = {240, 0};
+  std::string s;
+  char buf[4096];
+  size_t n;
+  FILE *f = tmpfile();
+
+  jobs[0].name = "check";
+  emon_synth(EMON_CHECK_MINUTES, true, data, &jobs[0].cap);
+  process(jobs, &opt, nthreads);
+  if (!f || !jobs[0].ok) return s;
+  write_csv(f, jobs, -1e300, 1e300);
+  rewind(f);
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) s.append(buf, n);
+  fclose(f);
+  return s;
+}
+
+// split() - the fields of a CSV row
+static std::vector<std::string> split(const std::string &row)
+{
+  std::vector<std::string> v;
+  size_t pos = 0, c;
+  while ((c = row.find(',', pos)) != std::string::npos) {
+    v.push_back(row.substr(pos, c - pos));
+    pos = c + 1;
+  }
+  v.push_back(row.substr(pos));
+  return v;
+}
+
+// compare_csv() - compare a CSV with the reference field by field.  The
+//   reference holds the numbers as the firmware printed them, so each is
+//   compared to its digits there: within half a unit of the last digit,
+//   and CHECK_TOL for the rounding before printing, as single precision
+//   and cos() and sin() may differ in the last place between the AVR and
+//   the host.  Text must match exactly.  A field the reference leaves
+//   empty is not compared: the device does not report the accumulation
+//   time.
+//   returns: number of fields that differ
+static int compare_csv(const std::string &a, const std::string &b, size_t *nrows)
+{
+  size_t pa = 0, pb = 0;
+  int nbad = 0;
+  *nrows = 0;
+  while (pa < a.size() || pb < b.size()) {
+    size_t ea = a.find('\n', pa), eb = b.find('\n', pb);
+    if (ea == std::string::npos) ea = a.size();
+    if (eb == std::string::npos) eb = b.size();
+    std::vector<std::string> fa = split(a.substr(pa, ea - pa)), fb = split(b.substr(pb, eb - pb));
+    if (fa.size() != fb.size()) {
+      printf("check: row %zu: %zu fields, expected %zu\n", *nrows, fa.size(), fb.size());
+      nbad ++;
+    }
+    for (size_t k = 0; k < fa.size() && k < fb.size(); k++) {
+      char *enda, *endb;
+      double va = strtod(fa[k].c_str(), &enda), vb = strtod(fb[k].c_str(), &endb);
+      bool numeric = !fa[k].empty() && !*enda && !fb[k].empty() && !*endb;
+      size_t dot = fb[k].find('.');
+      int digits = (dot == std::string::npos) ? 0 : (int) (fb[k].size() - dot - 1);
+      double tol = 0.5 * pow(10.0, -digits) + CHECK_TOL * fabs(vb);
+      if (fb[k].empty() || (numeric ? fabs(va - vb) <= tol : fa[k] == fb[k])) continue;
+      if (nbad < 10) printf("check: row %zu field %zu: %s, expected %s\n", *nrows, k,
+                            fa[k].c_str(), fb[k].c_str());
+      nbad ++;
+    }
+    pa = ea + 1;
+    pb = eb + 1;
+    (*nrows) ++;
+  }
+  return nbad;
+}
+
+static int check(const char *refpath)
+{
+  std::string ref, one = check_csv(1), four = check_csv(4);
+  char buf[4096];
+  size_t n, nrows;
+  FILE *f = fopen(refpath, "r");
+
+  if (!f) { perror(refpath); return 1; }
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) ref.append(buf, n);
+  fclose(f);
+  if (one.empty()) { printf("check: the capture did not plan\n"); return 1; }
+  if (one != four) { printf("check: 4 threads give a different result from 1\n"); return 1; }
+  int nbad = compare_csv(one, ref, &nrows);
+  printf("check: %zu rows against %s: %s\n", nrows, refpath,
+         nbad ? "FAILED" : "ok");
+  return nbad ? 1 : 0;
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: emonreproc [-j threads] [-o out.csv] [-V 120|240] [-O]\n"
+                  "                  [--from sec] [--to sec] capture ...\n"
+                  "       emonreproc --bench [minutes]\n"
+                  "       emonreproc --check reference.csv\n");
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  struct emon_options opt = {240, 0};
+  int nthreads = std::thread::hardware_concurrency();
+  const char *out = 0;
+  double from = -1e300, to = 1e300;
+  std::vector<struct job> jobs;
+  FILE *f = stdout;
+  int i, status = 0;
+
+  if (nthreads < 1) nthreads = 1;
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    const char *a = argv[i];
+    if (strcmp(a, "--bench") == 0) {
+      bench((i+1 < argc) ? atof(argv[i+1]) : 30.0, nthreads);
+      return 0;
+    }
+    if (strcmp(a, "--check") == 0 && i+1 < argc) return check(argv[i+1]);
+    if (strcmp(a, "-O") == 0) { opt.use_offsets = 1; continue; }
+    if (i+1 >= argc) usage();
+    if (strcmp(a, "-j") == 0) nthreads = atoi(argv[++i]);
+    else if (strcmp(a, "-o") == 0) out = argv[++i];
+    else if (strcmp(a, "-V") == 0) opt.vmains = atoi(argv[++i]);
+    else if (strcmp(a, "--from") == 0) from = atof(argv[++i]);
+    else if (strcmp(a, "--to") == 0) to = atof(argv[++i]);
+    else usage();
+  }
+  if (i >= argc || (opt.vmains != 120 && opt.vmains != 240)) usage();
+
+  jobs.resize(argc - i);
+  for (size_t k = 0; k < jobs.size(); k++, i++) {
+    jobs[k].name = argv[i];
+    if (emon_open(argv[i], &jobs[k].cap) < 0) {
+      fprintf(stderr, "emonreproc: %s: cannot open, or not a capture for this board\n", argv[i]);
+      return 1;
+    }
+  }
+  process(jobs, &opt, nthreads, to);
+  for (const struct job &jb : jobs) {
+    if (!jb.ok) {
+      fprintf(stderr, "emonreproc: %s: no measurement window (no inputs, or too short)\n", jb.name);
+      status = 1;
+    }
+  }
+
+  if (out && !(f = fopen(out, "w"))) { perror(out); return 1; }
+  write_csv(f, jobs, from, to);
+  if (f != stdout) fclose(f);
+  for (struct job &jb : jobs) emon_close(&jb.cap);
+  return status;
+}
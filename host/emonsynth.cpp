@@ -0,0 +1,50 @@
+//   EMONTX3-CONTINUOUS - host-side tools
+//
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   Synthetic capture (see emon_synth() in emonproc.h), shared by
+//   emonreproc and reprocsim so that both process the same readings.
+//
+
+#include <string.h>
+#include <math.h>
+#include "emonproc.h"
+
+// A 50 Hz supply with four loads, with the timing of the default sampling
+// profile.  With gaps, runs of readings are marked lost now and then, up
+// to more than the device can count.
+void emon_synth(double minutes, bool gaps, std::vector<int16_t> &data,
+                struct emon_capture *cap)
+{
+  const uint8_t nchan = 5;
+  const uint32_t usec = 260;     // 5 conversions at prescalar 64
+  const size_t nread = (size_t) (minutes * 60e6 / usec);
+  uint64_t rng = 1;
+
+  data.clear();
+  data.reserve(nread * nchan);
+  for (size_t i = 0; i < nread; i++) {
+    double t = i * usec * 1e-6;
+    if (gaps && i % 40000 == 20000) {
+      // Lose 3, 300 or 7 readings, the second more than a gap count holds
+      size_t nlost = (i / 40000) % 3 == 1 ? 300 : (i / 40000) % 3 ? 7 : 3;
+      int16_t rec[5] = {EMON_RAW_GAP, (int16_t) nlost, 0, 0, 0};
+      data.insert(data.end(), rec, rec + nchan);
+      i += nlost;
+      t = i * usec * 1e-6;
+    }
+    for (uint8_t j = 0; j < nchan; j++) {
+      double ph = 2*M_PI*50.0*(t + j*52e-6) - 0.3*j;
+      double v = (j == 0) ? 400*sin(ph) : 250/j*sin(ph) + 60/j*sin(3*ph);
+      rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+      data.push_back((int16_t) floor(512 + v + ((rng >> 33) & 3) * 0.5));
+    }
+  }
+  memset(cap, 0, sizeof(*cap));
+  memcpy(cap->hdr.magic, EMON_RAW_MAGIC, sizeof(EMON_RAW_MAGIC));
+  cap->hdr.nchan = nchan;
+  cap->hdr.reading_usec = usec;
+  cap->rec = data.data();
+  cap->nrec = data.size() / nchan;
+}
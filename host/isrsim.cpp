@@ -0,0 +1,251 @@
+//   EMONTX3-CONTINUOUS - host-side tools
+//
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   isrsim - check that the ADC interrupt handler of src/adc.cpp records
+//   the same data as the handler it replaced (isrbase.cpp).
+//
+//   Usage:
+//     isrsim [nreadings]
+//
+//   Both handlers are compiled against the host shim in shim/, and each
+//   is run over the same stream of conversions: the ADC is free running,
+//   each conversion starts as the one before completes with the pin in
+//   ADMUX at that moment, and its value is (N_ADC_CHAN*c + pin) mod 1024
+//   for conversion c, which tells the conversion and pin of every value
+//   apart over a few hundred conversions.  The readings of the two
+//   handlers are paired by the voltage sample of the first one after the
+//   start, and isrsim fails unless
+//     - every enabled channel holds the same value in both,
+//     - the reading times differ by a constant, within the 4 us step of
+//       the micros() that the old handler used,
+//     - all readings but those around the start are paired,
+//   at prescalars 128 and 64, with all channels and with channels
+//   disabled as scan_inputs() leaves them.
+//
+//   One difference is expected, and checked as such: since the
+//   interleaved sequence (ADC_INTERLEAVE) was added, a reading holds the
+//   sample of its last channel from its own round.  The old handler put
+//   that sample into the next reading, one round later, and so finished
+//   each reading (and took its time) one conversion earlier.  The plain
+//   sequence is checked; the interleaved sequence and the Mega have no
+//   counterpart in the old handler.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <vector>
+#include <Arduino.h>
+#include "../src/cont.h"
+
+#if defined(ADC_INTERLEAVE) || defined(BOARD_MEGA)
+#error "isrsim checks the plain emonTx sequence of the old handler"
+#endif
+
+// The current handler and its state
+extern "C" void ADC_vect(void);
+extern uint8_t adc_seq_len;
+
+// The old handler (isrbase.cpp)
+namespace isrbase {
+struct adc_readings_struct {
+  int16_t vals[N_ADC_CHAN];
+  uint32_t t;
+  uint8_t set;
+};
+extern volatile uint8_t cur_chan;
+extern uint8_t next_adc_chan[N_ADC_CHAN];
+void init_adc(uint8_t prescalar);
+void disable_adc_chan(uint8_t chan);
+void set_adc_offset(uint8_t chan, int16_t offset);
+uint8_t get_next_adc_reading(struct adc_readings_struct *reading);
+void ADC_vect(void);
+}
+
+#define SKIP 3              // readings of the start-up, not compared
+#define CYCLE_PHASE 37      // [cycles] Timer0 count at the first conversion
+
+// Registers of the shim
+ring_sreg SREG;
+volatile uint8_t ADMUX, ADCSRA, ADCSRB, DIDR0, DIDR2, GPIOR0;
+volatile uint16_t ADCW;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+volatile uint16_t TCNT1;
+volatile uint16_t pulse_timer_hi;
+
+// The I flag; the handlers run from the ADC model only
+static uint8_t sreg_i = 0;
+uint8_t ring_sreg_read(void) { return sreg_i ? 0x80 : 0; }
+void ring_sreg_write(uint8_t v) { sreg_i = (v & 0x80) != 0; }
+void ring_cli(void) { sreg_i = 0; }
+void ring_sei(void) { sreg_i = 1; }
+
+// ============================= ADC model
+static uint64_t now = 0;          // [cycles] since power on
+
+// micros() of the Arduino core: Timer0 ticks every 64 cycles, 4 us at
+// 16 MHz
+uint32_t isrbase_micros(void)
+{
+  return (uint32_t) (now / 64 * 4);
+}
+
+struct reading {
+  int16_t vals[N_ADC_CHAN];
+  uint32_t t;
+};
+
+// run() - free run the ADC through one of the handlers
+//   base - the old handler (1) or the current one (0)
+//   prescalar - ADC clock prescalar
+//   off - channels to disable (bit j = adc_chans[j])
+//   c0 - number of the first conversion
+//   nconv - conversions to run
+//   out - the readings, in order
+static void run(int base, uint8_t prescalar, uint16_t off, long c0, long nconv,
+                std::vector<struct reading> &out)
+{
+  uint8_t pin_next;
+  int j;
+
+  if (base) {
+    // The old handler cannot drop the channel that is converting: start
+    // it on the next channel, as it is after a reading
+    isrbase::init_adc(prescalar);
+    for (j = 1; j<N_ADC_CHAN; j++) {
+      if (off & (1 << j)) isrbase::disable_adc_chan(j);
+    }
+    if (isrbase::next_adc_chan[isrbase::cur_chan] == 0xff) {
+      for (j = isrbase::cur_chan; isrbase::next_adc_chan[j] == 0xff; j = (j+1) % N_ADC_CHAN) { }
+      isrbase::cur_chan = j;
+    }
+    for (j = 0; j<N_ADC_CHAN; j++) isrbase::set_adc_offset(j, 500 + 3*j);
+  } else {
+    init_adc(prescalar == 128 ? 0 : 1);
+    for (j = 1; j<N_ADC_CHAN; j++) {
+      if (off & (1 << j)) disable_adc_chan(j);
+    }
+    for (j = 0; j<N_ADC_CHAN; j++) set_adc_offset(j, 500 + 3*j);
+  }
+
+  now = CYCLE_PHASE + c0 * 13UL * prescalar;
+  pin_next = ADMUX & 0x07;
+  out.clear();
+  for (long c = c0; c < c0 + nconv; c++) {
+    uint8_t pin = pin_next;
+    now += 13UL * prescalar;
+    // Conversion c completes, c+1 starts on the pin selected now
+    pin_next = ADMUX & 0x07;
+    ADCW = (uint16_t) ((N_ADC_CHAN*c + pin) & 1023);
+    sreg_i = 0;
+    if (base) isrbase::ADC_vect(); else ADC_vect();
+    sreg_i = 1;
+
+    struct reading r;
+    if (base) {
+      struct isrbase::adc_readings_struct b;
+      while (isrbase::get_next_adc_reading(&b)) {
+        memcpy(r.vals, b.vals, sizeof(r.vals)); r.t = b.t;
+        out.push_back(r);
+      }
+    } else {
+      struct adc_readings_struct a;
+      while (get_next_adc_reading(&a)) {
+        memcpy(r.vals, a.vals, sizeof(r.vals)); r.t = a.t;
+        out.push_back(r);
+      }
+    }
+  }
+}
+
+// check() - compare the two handlers in one setting
+//   returns: 0 if they agree
+static int check(uint8_t prescalar, uint16_t off, long nreadings)
+{
+  std::vector<struct reading> rb, rn;
+  int nen = 0, last = 0, j;
+  long nconv, paired = 0, nbad = 0;
+  int32_t dmin = 0x7fffffff, dmax = -0x7fffffff;
+
+  for (j = 0; j<N_ADC_CHAN; j++) {
+    if (off & (1 << j)) continue;
+    nen ++; last = j;
+  }
+  nconv = nreadings * nen;
+  run(0, prescalar, off, 0, nconv, rn);
+
+  // Pair by the voltage sample, which names its conversion.  The two
+  // handlers start their rounds on different conversions, which is of no
+  // consequence: the old one is run on the stream from up to a round
+  // later until the rounds line up, and the shift at the first reading
+  // compared is held from there on.
+  long shift = 0;
+  int found = 0;
+  for (long c0 = 0; c0 < nen && !found; c0++) {
+    run(1, prescalar, off, c0, nconv, rb);
+    for (shift = -SKIP; shift <= SKIP; shift++) {
+      if (SKIP + shift < (long) rb.size() && SKIP < (long) rn.size() &&
+          rb[SKIP + shift].vals[0] == rn[SKIP].vals[0]) { found = 1; break; }
+    }
+  }
+  for (long i = SKIP; found && i + shift + 1 < (long) rb.size() && i < (long) rn.size(); i++) {
+    const struct reading &b = rb[i + shift], &bn = rb[i + shift + 1], &n = rn[i];
+    int bad = 0;
+    for (j = 0; j<N_ADC_CHAN; j++) {
+      if (off & (1 << j)) continue;
+      // The last channel of a reading was in the next one (see above)
+      if (n.vals[j] != ((j == last) ? bn.vals[j] : b.vals[j])) bad = 1;
+    }
+    if (bad && nbad++ < 5) {
+      printf("FAIL prescalar %d, off 0x%02x: reading %ld:", prescalar, off, i);
+      for (j = 0; j<N_ADC_CHAN; j++) printf(" %d/%d", n.vals[j], (j == last) ? bn.vals[j] : b.vals[j]);
+      printf(" (current/old)\n");
+    }
+    int32_t d = (int32_t) (n.t - b.t);
+    if (d < dmin) dmin = d;
+    if (d > dmax) dmax = d;
+    paired ++;
+  }
+
+  int ok = (nbad == 0 && paired >= nreadings - 2*SKIP - 2 && dmax - dmin <= 4);
+  printf("prescalar %3d  off 0x%02x  %2d conv/reading  readings %6zu/%6zu  paired %6ld  "
+         "differ %ld  time offset %d..%d us  %s\n",
+         prescalar, off, nen, rn.size(), rb.size(), paired, nbad, dmin, dmax, ok ? "ok" : "FAIL");
+  return !ok;
+}
+
+int main(int argc, char **argv)
+{
+  long nreadings = (argc > 1) ? atol(argv[1]) : 20000;
+  static const uint8_t prescalars[] = {128, 64};
+  // As scan_inputs() leaves them: any current channels missing
+  static const uint16_t offs[] = {0x00, 0x02, 0x04, 0x10, 0x0a, 0x1c};
+  int nfail = 0;
+
+  if (nreadings < 100) nreadings = 100;
+  // Each setting in a process of its own, from the power-on state
+  for (size_t p = 0; p < sizeof(prescalars); p++) {
+    for (size_t k = 0; k < sizeof(offs)/sizeof(offs[0]); k++) {
+      int status = 0;
+      fflush(stdout);
+      pid_t pid = fork();
+      if (pid == 0) {
+        int r = check(prescalars[p], offs[k], nreadings);
+        fflush(stdout);
+        _exit(r);
+      }
+      waitpid(pid, &status, 0);
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) nfail ++;
+    }
+  }
+  if (nfail) {
+    printf("FAIL %d settings\n", nfail);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
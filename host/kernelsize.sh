@@ -0,0 +1,38 @@
+#!/bin/sh
+# kernelsize.sh - flash taken by the accumulation kernels of state.cpp
+#
+#   Usage: kernelsize.sh FIRMWARE.elf
+#
+# Lists the .text size of the kernel of each presence mask
+# (accum_kernel_mask<MASK>), of the generic kernel of the Mega and of the
+# table that selects them, and their sum.  For the cost of the kernels,
+# compare the sum with the size of accum_stats() in a build of the
+# looped accumulator it replaced (the same command prints it).  The ELF
+# is found as for sramcheck.sh.
+
+ELF=$1
+NM=${AVR_NM:-avr-nm}
+
+if [ -z "$ELF" ] || [ ! -f "$ELF" ]; then
+  echo "usage: $0 FIRMWARE.elf" >&2
+  exit 2
+fi
+
+HEX='function hex(s,  i, n) {
+  n = 0; s = tolower(s)
+  for (i = 1; i <= length(s); i++) n = n*16 + index("0123456789abcdef", substr(s, i, 1)) - 1
+  return n
+}'
+
+$NM -S -C "$ELF" | awk "$HEX"'
+  NF >= 4 {
+    name = $4; for (i = 5; i <= NF; i++) name = name " " $i
+    sub(/^void /, "", name); sub(/\([^()]*\)$/, "", name); gsub(/\(unsigned char\)/, "", name)
+    if (name !~ /^accum_(kernel|stats$)/) next
+    # Code, and the table (in flash, but a data symbol to avr-nm)
+    if ($3 !~ /^[tTwW]$/ && name != "accum_kernels") next
+    n = hex($2)
+    printf "%6d  %s\n", n, name
+    if (name != "accum_stats") total += n
+  }
+  END { printf "%6d  total of the kernels and their table\n", total }'
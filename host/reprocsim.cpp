@@ -0,0 +1,228 @@
+//   EMONTX3-CONTINUOUS - host-side tools
+//
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   reprocsim - the reference of emonreproc --check, from the firmware
+//   itself.
+//
+//   Usage:
+//     reprocsim > testdata/reproc-check.csv
+//
+//   The firmware is linked in and run by devsim (see devsim.h) on the
+//   synthetic capture that emonreproc --check processes (emon_synth()).
+//   Every conversion takes its value from the record of its reading, so
+//   the firmware sees the readings of the capture, in the same order and
+//   at the same reading times.  A gap record is played as readings the
+//   firmware has to lose: once the reading before the gap has been
+//   retrieved, the main loop is held (devsim_stall()) while the readings
+//   of the gap and then a full ring complete, so that the interrupt
+//   handler drops exactly the readings of the gap and marks the one after
+//   it, as an overflow does on the device.  No other reading may be lost:
+//   the serial port sends at once (devsim_tx_instant()), since the startup
+//   messages would otherwise hold up the firmware for longer than the ring
+//   lasts, and a device capture would have a gap there that this one does
+//   not.  The report periods are set to 1 s by command, so each window is
+//   reported on its own.
+//
+//   One CSV row is written per window, in the columns of emonreproc, from
+//   the lines the firmware sends, with the digits it prints.  Two columns
+//   are not sent as such: accum is left empty, and lost, which the device
+//   reports in milliseconds, is the count of readings dropped (novr) in
+//   the window, at most 255 as the gap count of a reading holds; the
+//   capture has at most one gap per window.  reprocsim fails if a gap
+//   cannot be played because the firmware is still busy with the reading
+//   before it, or if the firmware loses any reading that is not in a gap.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <Arduino.h>
+#include "../src/cont.h"
+#include "devsim.h"
+#include "emonproc.h"
+
+#if defined(ADC_INTERLEAVE) || defined(BOARD_MEGA)
+#error "reprocsim plays the plain emonTx sequence that emonreproc models"
+#endif
+
+// Firmware state watched, as devsim does
+extern uint32_t adc_clock;
+extern uint64_t adc_time;
+
+#define STEP_SEC 20e-6  // [s] devsim_run() step while waiting for a reading
+
+// The capture, one entry per reading: its record, or -1 in a gap
+static std::vector<int16_t> data;
+static struct emon_capture cap;
+static std::vector<long> reading_rec;
+static long nconv = 0;
+
+// input() - level of an ADC pin: the value of the capture record of the
+//   reading this conversion belongs to (adc_chans[] is in pin order on the
+//   emonTx).  The sequence is built once, with every channel, so each
+//   reading takes N_ADC_CHAN conversions from the first.
+static int input(uint8_t pin, double)
+{
+  size_t k = nconv++ / N_ADC_CHAN;
+  if (k >= reading_rec.size()) k = reading_rec.size() - 1;
+  // In a gap, the last reading before it: these are dropped
+  while (reading_rec[k] < 0) k--;
+  return cap.rec[reading_rec[k] * cap.hdr.nchan + pin];
+}
+
+// A window, as the lines of its reports come in
+struct row {
+  std::string tsec;
+  std::string v[3];                       // vrms, vfrq, vcrs
+  std::string c[N_CUR_CHAN][5];           // irm, pac, pre, pow, ipk
+  int open;
+};
+static struct row cur;
+static std::vector<std::string> rows;
+static long novr_last = 0;
+static uint16_t novr_expect = 0;          // overflow count after the last gap
+static int nack = 0, nbad = 0;
+
+// check_overflow() - no reading dropped since the last gap
+static void check_overflow(void)
+{
+  if (n_overflow == novr_expect) return;
+  fprintf(stderr, "reprocsim: %u readings dropped outside the gaps\n",
+          (unsigned) (uint16_t) (n_overflow - novr_expect));
+  nbad ++;
+}
+
+// text() - value of a field of a line, as sent, or "" if not there
+static std::string text(const char *s, const char *name)
+{
+  size_t n = strlen(name);
+  for (const char *p = s; (p = strstr(p, name)); p++) {
+    if ((p == s || p[-1] == ',') && p[n] == ':') {
+      p += n + 1;
+      return std::string(p, strcspn(p, ","));
+    }
+  }
+  return "";
+}
+
+// line() - a line from the firmware
+static void line(const char *s, double)
+{
+  std::string tsec;
+  char name[8];
+
+  if (strncmp(s, "ack:", 4) == 0) nack ++;
+  if (strncmp(s, "#STATE_ZERO", 11) == 0) {
+    // The overflow count is about to be reset
+    check_overflow();
+    novr_expect = 0;
+  }
+  if (text(s, "tsec").empty()) return;
+  tsec = text(s, "tsec") + "." + std::string(6 - text(s, "tus").size(), '0') + text(s, "tus");
+
+  if (!text(s, "vrms").empty() && !text(s, "vfrq").empty()) {
+    // Voltage: the window starts
+    cur = row();
+    cur.open = 1;
+    cur.tsec = tsec;
+    cur.v[0] = text(s, "vrms");
+    cur.v[1] = text(s, "vfrq");
+    cur.v[2] = text(s, "vcrs");
+    return;
+  }
+  if (!cur.open || tsec != cur.tsec) return;
+  for (int j = 0; j < N_CUR_CHAN; j++) {
+    static const char *names[5] = {"irm", "pac", "pre", "pow", "ipk"};
+    snprintf(name, sizeof(name), "irm%d", j);
+    if (text(s, name).empty()) continue;
+    for (int m = 0; m < 5; m++) {
+      snprintf(name, sizeof(name), "%s%d", names[m], j);
+      cur.c[j][m] = text(s, name);
+    }
+  }
+  if (!text(s, "_novr").empty() && !text(s, "_enac").empty()) {
+    // Metadata: the window is complete
+    long novr = atol(text(s, "_novr").c_str());
+    long lost = novr - novr_last;
+    std::string r = "check," + cur.tsec + ",";
+    novr_last = novr;
+    for (int m = 0; m < 3; m++) r += "," + cur.v[m];
+    r += "," + std::to_string(lost > 255 ? 255 : lost);
+    for (int j = 0; j < N_CUR_CHAN; j++) {
+      for (int m = 0; m < 5; m++) r += "," + cur.c[j][m];
+    }
+    r += "," + text(s, "_enac") + "," + text(s, "_enre");
+    rows.push_back(r);
+    cur.open = 0;
+  }
+}
+
+int main(void)
+{
+  const double usec = 1e-6;
+  std::vector<std::pair<long, long> > gaps;  // (first reading, readings)
+  uint32_t reading_usec;
+
+  emon_synth(EMON_CHECK_MINUTES, true, data, &cap);
+  if (cap.hdr.nchan != N_ADC_CHAN) {
+    fprintf(stderr, "reprocsim: capture has %d channels, the board %d\n", cap.hdr.nchan, N_ADC_CHAN);
+    return 1;
+  }
+  reading_usec = cap.hdr.reading_usec;
+  for (size_t i = 0; i < cap.nrec; i++) {
+    const int16_t *r = cap.rec + i * cap.hdr.nchan;
+    if (r[0] == EMON_RAW_GAP) {
+      gaps.push_back(std::make_pair((long) reading_rec.size(), (long) (uint16_t) r[1]));
+      reading_rec.insert(reading_rec.end(), (uint16_t) r[1], -1);
+      continue;
+    }
+    reading_rec.push_back(i);
+  }
+
+  devsim_tx_instant(1);
+  devsim_start(input, line, HIGH);
+  devsim_send("vprd 1\r\npprd 1\r\neprd 1\r\n");
+  for (const auto &g : gaps) {
+    // Reading k has the time (k+1)*reading_usec
+    uint32_t t_before = g.first * reading_usec;
+    while ((uint32_t) adc_time < t_before) devsim_run(devsim_time() + STEP_SEC);
+    if (adc_clock != t_before) {
+      fprintf(stderr, "reprocsim: gap at reading %ld: the firmware was busy (%u us behind)\n",
+              g.first, (unsigned) (adc_clock - (uint32_t) adc_time));
+      return 1;
+    }
+    check_overflow();
+    devsim_stall((g.first + g.second + N_READINGS - 1 + 0.5) * reading_usec * usec);
+    if ((uint16_t) (n_overflow - novr_expect) != g.second) {
+      fprintf(stderr, "reprocsim: gap at reading %ld: %u readings dropped, expected %ld\n",
+              g.first, (unsigned) (uint16_t) (n_overflow - novr_expect), g.second);
+      nbad ++;
+    }
+    novr_expect = n_overflow;
+  }
+  // To the end of the capture, and the reports of the last window
+  devsim_run(reading_rec.size() * reading_usec * usec);
+  devsim_run(devsim_time() + 0.2);
+  check_overflow();
+
+  if (nack != 3) {
+    fprintf(stderr, "reprocsim: %d of the 3 report period commands acknowledged\n", nack);
+    nbad ++;
+  }
+  if (rows.empty()) {
+    fprintf(stderr, "reprocsim: no window reported\n");
+    nbad ++;
+  }
+  if (nbad) return 1;
+
+  printf("file,tsec,accum,vrms,vfrq,vcrs,lost");
+  for (int j = 1; j <= N_CUR_CHAN; j++) printf(",irm%d,pac%d,pre%d,pow%d,ipk%d", j, j, j, j, j);
+  printf(",enac,enre\n");
+  for (const std::string &r : rows) printf("%s\n", r.c_str());
+  return 0;
+}
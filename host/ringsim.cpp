@@ -0,0 +1,743 @@
+//   EMONTX3-CONTINUOUS - host-side tools
+//
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   ringsim - check the ring buffers between the interrupt handlers and
+//   the main loop (src/adc.cpp, src/pulse.cpp) under every interleaving,
+//   and measure their throughput.
+//
+//   Usage:
+//     ringsim [-b bound] [-r nops] [-s seed]
+//       -b     - preemption bound of the exhaustive search (default 2)
+//       -r     - consumer calls of the random search (default 1000000)
+//       -s     - seed of the random search
+//     ringsim --bench
+//       throughput of the ring code, host time per reading
+//
+//   adc.cpp and pulse.cpp themselves are linked in, compiled against the
+//   host shim in shim/ (registers are variables; SREG, cli() and sei()
+//   call back here) with gcc's -fsanitize=thread instrumentation.  The
+//   instrumentation calls __tsan_readN() and __tsan_writeN() before every
+//   memory access.  ringsim supplies these in place of the ThreadSanitizer
+//   runtime, and while the modelled I flag is set it lets an interrupt run
+//   before each access to a shared ring variable, at the entry of each
+//   function and after each SREG restore.  The instructions in between
+//   touch only registers and unshared memory, so these are all the
+//   interleavings that matter.  The host loads a 16 or 32-bit value with
+//   one instruction where the AVR takes one per byte, so a value torn
+//   within itself is not found; a reading torn across its fields is.
+//
+//   The interrupt handlers (ISR(ADC_vect), one conversion per call, and
+//   pulse_interrupt_handler()) run with interrupts disabled.  The ADC is
+//   free running: each conversion starts as the one before completes,
+//   with the pin in ADMUX (and MUX5 of ADCSRB) at that moment, and ADCW
+//   gives the pin and the number of the conversion.  The Makefile builds
+//   ringsim for the emonTx, ringsim-il with ADC_INTERLEAVE and
+//   ringsim-mega for the Mega.
+//
+//   The exhaustive search starts from index rotations, ring fills (empty
+//   to overflowed) and points in the conversion sequence next to the
+//   wraps and boundaries, runs a short script of consumer calls, and
+//   preempts it at up to `bound' points with bursts of 1 conversion, one
+//   reading, a full ring and more than a full ring.  The random search
+//   makes a long run with random bursts at random points.  The consumer
+//   checks that
+//     - every value of a reading is a conversion of its slot's pin, made
+//       during that reading (with ADC_INTERLEAVE, vals[0] is the voltage
+//       sample that closed the reading before), and that its time is the
+//       time of that reading: no reading is torn,
+//     - no reading is returned twice or out of order,
+//     - gap counts the readings dropped before it exactly,
+//     - the depths from get_adc_depth() and get_next_adc_reading() (seen
+//       in max_adc_depth) lie within the ring contents during the call,
+//       and below N_READINGS,
+//     - after a final drain, returned plus dropped equals produced.
+//   The pulse ring (get_pulse_time()) is checked for torn, repeated and
+//   reordered times and for the count of edges dropped before each, and
+//   drained the same way; edges dropped after the last one stored are
+//   counted as pending in pulse_dropped.
+//
+//   Each check is run on the firmware code and on the same code with
+//   cli() doing nothing, which must fail for the ADC ring: the harness
+//   finds the races it is meant to find.  The pulse ring must pass both,
+//   as its interrupt handler drops a new edge rather than move the read
+//   index, so each index has one writer and the ring needs no lock.
+//   A rework of the ring (lock-free indices, batched
+//   retrieval) is made in adc.cpp or pulse.cpp and must pass all three
+//   builds (make check-ring) before it goes to the firmware.
+//
+//   The benchmark host times include the instrumentation and the ADC
+//   model, and are only for comparing versions of the ring code with each
+//   other; see the cycle budget in cont.h for the AVR.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <Arduino.h>
+#include "../src/cont.h"
+
+#define T_PULSE 1000003           // [ticks] time step of the pulses
+#define CONV_HIST 4096            // conversions remembered, and ADCW count modulus
+#define SEQ_HIST 1024             // readings remembered
+#define MAX_BOUND 4
+
+// Firmware variables that cont.h does not declare
+extern volatile struct adc_readings_struct adc_readings[N_READINGS];
+extern volatile struct adc_readings_struct adc_offset;
+extern volatile uint8_t adc_write_index, adc_read_index;
+extern uint8_t adc_seq_len, max_adc_depth;
+extern uint32_t adc_clock;
+extern uint64_t adc_time;
+extern volatile uint32_t pulse_ring[N_PULSE_RING];
+extern volatile uint8_t pulse_gap[N_PULSE_RING];
+extern uint8_t pulse_dropped;
+extern volatile uint8_t pulse_write_index, pulse_read_index, pulse_count_ticks;
+extern volatile uint16_t pulse_timer_hi;
+extern uint32_t pulsetime;
+void pulse_interrupt_handler();
+extern "C" void ADC_vect(void);
+
+// Registers of the shim
+ring_sreg SREG;
+volatile uint8_t ADMUX, ADCSRA, ADCSRB, DIDR0, DIDR2, GPIOR0;
+volatile uint16_t ADCW;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+volatile uint16_t TCNT1;
+
+// The reports of pulse.cpp are not exercised
+void push_report_float_P(PGM_P, uint8_t, float, uint8_t, uint8_t) { }
+void push_report_uint32_P(PGM_P, uint8_t, uint32_t, uint8_t) { }
+void push_report_break(void) { }
+void push_report_time(uint64_t) { }
+uint8_t report_wait(uint8_t) { return 0; }
+
+// Variants of the firmware code
+#define V_FIRMWARE 0              // as the firmware
+#define V_NOLOCK   1              // cli() does nothing
+#define N_VARIANT  2
+static const char *variant_name[N_VARIANT] = {"firmware", "nolock"};
+static int variant = V_FIRMWARE;
+
+// ============================= Interrupt model
+// I flag of SREG; interrupts are let in only during the consumer call
+// under test (armed)
+static uint8_t sreg_i = 0;
+static uint8_t armed = 0;
+static void (*isr)(void) = 0;
+static void (*truth)(void) = 0;
+static const char *site_func = "";
+
+// Scheduled bursts of interrupts: at which preemption point, how many
+struct burst {
+  long point;
+  int n;
+  const char *func;          // set when it fires, for the report
+  char site[64];
+};
+static struct burst sched[MAX_BOUND];
+static int nsched = 0;
+static long npoint = 0;         // preemption points passed in this run
+static unsigned rand_p = 0;     // random search: a burst at 1 in rand_p points
+static int rand_max = 0;        // random search: largest burst
+static uint64_t rng_state = 1;
+
+static uint32_t rng(void)
+{
+  rng_state = rng_state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (uint32_t) (rng_state >> 33);
+}
+
+// Shared variables: an interrupt matters only before an access to these
+struct shared {
+  const volatile void *p;
+  size_t size, elem;
+  const char *name;
+};
+static const struct shared shared_vars[] = {
+  {adc_readings, sizeof(adc_readings), sizeof(adc_readings[0]), "adc_readings"},
+  {&adc_write_index, 1, 1, "adc_write_index"},
+  {&adc_read_index, 1, 1, "adc_read_index"},
+  {&n_overflow, 2, 2, "n_overflow"},
+  {&adc_offset, sizeof(adc_offset), sizeof(adc_offset), "adc_offset"},
+  {&GPIOR0, 1, 1, "GPIOR0"},
+  {pulse_ring, sizeof(pulse_ring), 4, "pulse_ring"},
+  {pulse_gap, sizeof(pulse_gap), 1, "pulse_gap"},
+  {&pulse_write_index, 1, 1, "pulse_write_index"},
+  {&pulse_read_index, 1, 1, "pulse_read_index"},
+  {&pulse_count_ticks, 1, 1, "pulse_count_ticks"},
+  {&pulse_timer_hi, 2, 2, "pulse_timer_hi"},
+};
+#define N_SHARED (sizeof(shared_vars)/sizeof(shared_vars[0]))
+
+// find_shared() - shared variable at address p
+//   returns: its entry, or 0 if p is not shared
+static const struct shared *find_shared(const void *p)
+{
+  for (size_t k = 0; k < N_SHARED; k++) {
+    const uint8_t *b = (const uint8_t *) shared_vars[k].p;
+    if ((const uint8_t *) p >= b && (const uint8_t *) p < b + shared_vars[k].size) return &shared_vars[k];
+  }
+  return 0;
+}
+
+// describe() - name the access an interrupt came before, for the report
+static void describe(char *buf, size_t n, const char *what, const void *p, int size)
+{
+  const struct shared *s = p ? find_shared(p) : 0;
+  size_t off;
+  if (!s) { snprintf(buf, n, "%s", what); return; }
+  off = (const uint8_t *) p - (const uint8_t *) s->p;
+  if (s->p == adc_readings) {
+    size_t idx = off / s->elem, f = off % s->elem;
+    if (f < sizeof(adc_readings[0].vals)) {
+      snprintf(buf, n, "%s%d %s[%zu].vals[%zu]", what, size, s->name, idx, f/2);
+    } else {
+      snprintf(buf, n, "%s%d %s[%zu].%s", what, size, s->name, idx,
+               f == offsetof(struct adc_readings_struct, t) ? "t" :
+               f == offsetof(struct adc_readings_struct, set) ? "set" : "gap");
+    }
+  } else if (s->elem < s->size) {
+    snprintf(buf, n, "%s%d %s[%zu]", what, size, s->name, off / s->elem);
+  } else {
+    snprintf(buf, n, "%s%d %s", what, size, s->name);
+  }
+}
+
+// preempt() - a preemption point: interrupts may run here if enabled
+//   what, p, size - what the consumer does next, for the report
+static void preempt(const char *what, const void *p, int size)
+{
+  int k, j;
+  if (!armed || !sreg_i) return;
+  npoint ++;
+  truth();
+  for (k = 0; k < nsched; k++) {
+    if (sched[k].point != npoint) continue;
+    sched[k].func = site_func;
+    describe(sched[k].site, sizeof(sched[k].site), what, p, size);
+    for (j = 0; j < sched[k].n; j++) isr();
+    truth();
+  }
+  if (rand_p && rng() % rand_p == 0) {
+    int n = 1 + rng() % rand_max;
+    for (j = 0; j < n; j++) isr();
+    truth();
+  }
+}
+
+// Callbacks of the instrumentation and of the shim
+extern "C" {
+void __tsan_init(void) { }
+void __tsan_func_entry(void *) { preempt("entry", 0, 0); }
+void __tsan_func_exit(void) { }
+#define RING_ACCESS(n) \
+  void __tsan_read##n(void *p)  { if (armed && find_shared(p)) preempt("read", p, n); } \
+  void __tsan_write##n(void *p) { if (armed && find_shared(p)) preempt("write", p, n); }
+RING_ACCESS(1) RING_ACCESS(2) RING_ACCESS(4) RING_ACCESS(8) RING_ACCESS(16)
+}
+uint8_t ring_sreg_read(void) { return sreg_i ? 0x80 : 0; }
+void ring_sreg_write(uint8_t v)
+{
+  sreg_i = (v & 0x80) != 0;
+  preempt("SREG restore", 0, 0);
+}
+void ring_cli(void) { if (variant != V_NOLOCK) sreg_i = 0; }
+void ring_sei(void)
+{
+  sreg_i = 1;
+  preempt("sei", 0, 0);
+}
+
+// ============================= ADC model
+static uint32_t conv_n;                 // conversions completed
+static uint8_t conv_pin[CONV_HIST];     // ADC pin of each conversion
+static uint16_t end_conv[SEQ_HIST];     // conversion that completed each reading
+static uint32_t adc_produced;           // readings completed
+
+// mux_pin() - ADC pin selected by the multiplexer
+static uint8_t mux_pin(void)
+{
+  uint8_t pin = ADMUX & 0x07;
+#ifdef BOARD_MEGA
+  if (ADCSRB & _BV(MUX5)) pin |= 0x08;
+#endif
+  return pin;
+}
+
+// adc_isr() - conversion conv_n completes; the next one starts with the
+//   multiplexer as it is, and the interrupt handler runs
+static void adc_isr(void)
+{
+  uint32_t c = conv_n++;
+  uint32_t clock = adc_clock;
+  uint8_t sreg = sreg_i;
+  conv_pin[(c+1) % CONV_HIST] = mux_pin();
+  ADCW = (uint16_t) ((conv_pin[c % CONV_HIST] << 12) | (c % CONV_HIST));
+  sreg_i = 0;
+  ADC_vect();
+  sreg_i = sreg;
+  if (adc_clock != clock) {
+    end_conv[adc_produced % SEQ_HIST] = c % CONV_HIST;
+    adc_produced ++;
+  }
+}
+
+// Readings in the ring, least and most during a consumer call
+static int adc_truth_min, adc_truth_max;
+static void adc_truth(void)
+{
+  int j, n = 0;
+  for (j = 0; j < N_READINGS; j++) n += adc_readings[j].set;
+  if (n < adc_truth_min) adc_truth_min = n;
+  if (n > adc_truth_max) adc_truth_max = n;
+}
+
+// ============================= Pulse model
+static uint32_t pulse_seq = 0;    // pulses handled by the ISR
+
+static uint32_t pulse_time(uint32_t seq) { return 7 + seq * T_PULSE; }
+
+// pulse_isr() - an edge at the next pulse time
+static void pulse_isr(void)
+{
+  uint32_t t = pulse_time(pulse_seq++);
+  uint8_t sreg = sreg_i;
+  pulse_timer_hi = t >> 16;
+  TCNT1 = t & 0xffff;
+  TIFR1 = 0;
+  sreg_i = 0;
+  pulse_interrupt_handler();
+  sreg_i = sreg;
+}
+
+static void pulse_truth(void) { }
+
+// ============================= Checks
+static const char *fail = 0;      // first failure of this run
+static char fail_buf[160];
+static long last_seq;             // last sequence number returned
+static long n_taken;
+
+static void reset_check(long last)
+{
+  fail = 0;
+  last_seq = last;
+  n_taken = 0;
+}
+
+// seq_of() - sequence number of an item time, counted from a little
+//   before the last one returned, so that 32-bit times may wrap
+//   returns: -1 if no item produced so far has this time
+static long seq_of(uint32_t t, uint32_t t0, uint32_t step, uint32_t produced)
+{
+  long base = (last_seq > 2*N_READINGS) ? last_seq - 2*N_READINGS : 0;
+  uint32_t d = t - (t0 + (uint32_t) base * step);
+  long seq = base + d / step;
+  if (d % step || seq >= (long) produced) return -1;
+  return seq;
+}
+
+// check_seq() - check the order and gap of a returned item
+static void check_seq(long seq, long gap, int has_gap)
+{
+  if (fail) return;
+  if (seq <= last_seq) {
+    snprintf(fail_buf, sizeof(fail_buf), "item %ld returned after item %ld", seq, last_seq);
+    fail = fail_buf;
+    return;
+  }
+  if (has_gap) {
+    long want = seq - last_seq - 1;
+    if (want > 255) want = 255;
+    if (gap != want) {
+      snprintf(fail_buf, sizeof(fail_buf), "reading %ld has gap %ld, %ld dropped", seq, gap, want);
+      fail = fail_buf;
+      return;
+    }
+  }
+  n_taken ++;
+  last_seq = seq;
+}
+
+// check_vals() - check that the values of reading seq are its own
+static void check_vals(const struct adc_readings_struct *r, long seq)
+{
+  uint16_t end = end_conv[seq % SEQ_HIST];
+  for (int j = 0; j < ADC_NVALS; j++) {
+    uint16_t v = (uint16_t) r->vals[j];
+    uint8_t pin = v >> 12, want = pgm_read_byte(&adc_chans[j < N_ADC_CHAN ? j : 0]);
+    uint16_t back = (end - v) & (CONV_HIST-1);
+#ifdef ADC_INTERLEAVE
+    int ok = (j == 0) ? (back == adc_seq_len) : (back < adc_seq_len);
+#else
+    int ok = (back < adc_seq_len);
+#endif
+    if (pin != want || !ok) {
+      snprintf(fail_buf, sizeof(fail_buf),
+               "torn reading %ld: vals[%d] is conversion %u of pin %u, the reading ends at conversion %u",
+               seq, j, v & (CONV_HIST-1), pin, end);
+      fail = fail_buf;
+      return;
+    }
+  }
+}
+
+// check_depth() - check a ring depth against the truth
+static void check_depth(const char *func, uint8_t depth)
+{
+  if (fail) return;
+  if (depth >= N_READINGS || depth < adc_truth_min || depth > adc_truth_max) {
+    snprintf(fail_buf, sizeof(fail_buf), "%s() depth %d, ring held %d to %d",
+             func, depth, adc_truth_min, adc_truth_max);
+    fail = fail_buf;
+  }
+}
+
+// take_reading() - get_next_adc_reading() and check what it returns
+static void take_reading(void)
+{
+  struct adc_readings_struct r;
+  uint8_t got;
+  long seq;
+
+  adc_truth_min = 255; adc_truth_max = 0;
+  adc_truth();
+  max_adc_depth = 0;
+  site_func = "get_next_adc_reading";
+  armed = 1;
+  got = get_next_adc_reading(&r);
+  armed = 0;
+  adc_truth();
+  if (!got || fail) return;
+  seq = seq_of(r.t, adc_reading_usec, adc_reading_usec, adc_produced);
+  if (seq < 0 || seq < (long) adc_produced - SEQ_HIST) {
+    snprintf(fail_buf, sizeof(fail_buf), "torn reading: time %lu", (unsigned long) r.t);
+    fail = fail_buf;
+    return;
+  }
+  check_vals(&r, seq);
+  check_depth("get_next_adc_reading", max_adc_depth);
+  check_seq(seq, r.gap, 1);
+}
+
+// take_depth() - get_adc_depth() and check it
+static void take_depth(void)
+{
+  uint8_t depth;
+  adc_truth_min = 255; adc_truth_max = 0;
+  adc_truth();
+  site_func = "get_adc_depth";
+  armed = 1;
+  depth = get_adc_depth();
+  armed = 0;
+  adc_truth();
+  check_depth("get_adc_depth", depth);
+}
+
+// take_pulse() - get_pulse_time() and check what it returns
+static void take_pulse(void)
+{
+  uint32_t t;
+  uint8_t got, gap;
+  long seq;
+  site_func = "get_pulse_time";
+  armed = 1;
+  got = get_pulse_time(&t, &gap);
+  armed = 0;
+  if (!got || fail) return;
+  seq = seq_of(t, pulse_time(0), T_PULSE, pulse_seq);
+  if (seq < 0) {
+    snprintf(fail_buf, sizeof(fail_buf), "torn pulse time %lu", (unsigned long) t);
+    fail = fail_buf;
+    return;
+  }
+  check_seq(seq, gap, 1);
+}
+
+// drain() - retrieve the rest without interrupts, and balance the books
+static void drain(int adc)
+{
+  uint8_t sreg = sreg_i;
+  long produced = adc ? (long) adc_produced : (long) pulse_seq;
+  long pending = adc ? 0 : (long) pulse_dropped;
+  sreg_i = 0;
+  while (!fail) {
+    long n = n_taken;
+    if (adc) take_reading(); else take_pulse();
+    if (n_taken == n) break;
+  }
+  sreg_i = sreg;
+  // The order was checked on the way, so nothing is returned twice, and
+  // the gaps add up to the items not returned
+  if (!fail && last_seq + pending != produced - 1) {
+    snprintf(fail_buf, sizeof(fail_buf), "drained to item %ld of %ld", last_seq, produced);
+    fail = fail_buf;
+  }
+}
+
+// ============================= Scenarios
+// reset_ring() - start the ADC as init_adc() does, or empty the pulse
+//   ring; then, without preemption, rotate the indices by rot, fill
+//   readings (or edges) and phase conversions of the next reading
+static void reset_ring(int adc, int rot, int fill, int phase)
+{
+  int j;
+  armed = 0;
+  sreg_i = 0;
+  isr = adc ? adc_isr : pulse_isr;
+  truth = adc ? adc_truth : pulse_truth;
+  if (adc) {
+    struct adc_readings_struct r;
+    memset((void *) adc_readings, 0, sizeof(adc_readings));
+    memset((void *) &adc_offset, 0, sizeof(adc_offset));
+    adc_write_index = adc_read_index = 0; n_overflow = 0;
+    adc_clock = 0; adc_time = 0;
+    init_adc(1);
+    sreg_i = 0;
+    conv_n = 0; adc_produced = 0;
+    conv_pin[0] = mux_pin();   // the first conversion starts now
+    // The first reading takes a conversion of the pin before the sequence
+    // was set up; it is retrieved unchecked
+    for (j = 0; j < 2*adc_seq_len; j++) isr();
+    while (get_next_adc_reading(&r)) ;
+    reset_check((long) adc_produced - 1);
+  } else {
+    memset((void *) pulse_ring, 0, sizeof(pulse_ring));
+    memset((void *) pulse_gap, 0, sizeof(pulse_gap));
+    pulse_write_index = pulse_read_index = 0; pulse_count_ticks = 0;
+    pulse_dropped = 0;
+    pulse_seq = 0;
+    pulsetime = pulse_time(0) - T_PULSE;
+    reset_check(-1);
+  }
+
+  for (j = 0; j < rot; j++) {
+    if (adc) { for (int k = 0; k < adc_seq_len; k++) isr(); take_reading(); }
+    else { isr(); take_pulse(); }
+  }
+  for (j = 0; j < (adc ? fill*adc_seq_len + phase : fill); j++) isr();
+  sreg_i = 1;
+}
+
+// run_script() - consumer calls: d get_adc_depth(), n get_next_adc_reading(),
+//   p get_pulse_time()
+static void run_script(const char *script)
+{
+  for (; *script && !fail; script++) {
+    if (*script == 'd') take_depth();
+    else if (*script == 'n') take_reading();
+    else take_pulse();
+  }
+}
+
+// one_run() - one scenario under the schedule in sched[]
+static void one_run(int adc, int rot, int fill, int phase)
+{
+  reset_ring(adc, rot, fill, phase);
+  npoint = 0;
+  run_script(adc ? "dnndn" : "ppp");
+  drain(adc);
+}
+
+static void report_fail(int adc, int rot, int fill, int phase)
+{
+  int k;
+  printf("  FAIL %s ring, rotation %d, fill %d, phase %d:\n", adc ? "ADC" : "pulse", rot, fill, phase);
+  for (k = 0; k < nsched; k++) {
+    if (!sched[k].func) continue;
+    printf("    %d interrupts at point %ld, in %s() before %s\n", sched[k].n, sched[k].point,
+           sched[k].func, sched[k].site);
+  }
+  printf("    %s\n", fail);
+}
+
+// search() - every schedule of bursts at increasing points from from,
+//   up to bound bursts, depth first; stops at the first failure
+//   returns: 0 if all pass
+static long runs;
+static int search(int adc, int rot, int fill, int phase, int depth, int bound, long from)
+{
+  int bursts[4], b;
+  long p;
+
+  bursts[0] = 1;
+  bursts[1] = adc ? adc_seq_len : 2;
+  bursts[2] = adc ? N_READINGS*adc_seq_len : N_PULSE_RING - 1;
+  bursts[3] = adc ? (N_READINGS+1)*adc_seq_len : N_PULSE_RING + 1;
+
+  for (p = from; ; p++) {
+    for (b = 0; b < 4; b++) {
+      nsched = depth+1;
+      sched[depth].point = p; sched[depth].n = bursts[b]; sched[depth].func = 0;
+      one_run(adc, rot, fill, phase);
+      runs ++;
+      if (fail) { report_fail(adc, rot, fill, phase); return 1; }
+      if (!sched[depth].func) break;   // the run ended before point p
+      if (depth+1 < bound && search(adc, rot, fill, phase, depth+1, bound, p+1)) return 1;
+    }
+    if (!sched[depth].func) break;
+  }
+  nsched = depth;
+  return 0;
+}
+
+// exhaustive() - search from each starting state: for the ADC ring the
+//   rotations and fills next to the wrap and overflow of the indices, and
+//   the points of the conversion sequence next to a reading boundary; for
+//   the small pulse ring all of them
+//   returns: 0 if all pass
+static int exhaustive(int adc, int bound)
+{
+  const int n = adc ? N_READINGS : N_PULSE_RING;
+  int rots[N_PULSE_RING], fills[N_PULSE_RING+2], phases[3];
+  int nrot = 0, nfill = 0, nphase = 0, j;
+  int ir, iff, ip;
+
+  if (adc) {
+    rots[nrot++] = 0; rots[nrot++] = 1; rots[nrot++] = n-1;
+    fills[nfill++] = 0; fills[nfill++] = 1; fills[nfill++] = n-2;
+    fills[nfill++] = n-1; fills[nfill++] = n; fills[nfill++] = n+1;
+    phases[nphase++] = 0; phases[nphase++] = 1; phases[nphase++] = adc_seq_len-1;
+  } else {
+    for (j = 0; j < n; j++) rots[nrot++] = j;
+    for (j = 0; j <= n+1; j++) fills[nfill++] = j;
+    phases[nphase++] = 0;
+  }
+  runs = 0;
+  for (ir = 0; ir < nrot; ir++) {
+    for (iff = 0; iff < nfill; iff++) {
+      for (ip = 0; ip < nphase; ip++) {
+        nsched = 0;
+        one_run(adc, rots[ir], fills[iff], phases[ip]);
+        runs ++;
+        if (fail) { report_fail(adc, rots[ir], fills[iff], phases[ip]); return 1; }
+        if (bound > 0 && search(adc, rots[ir], fills[iff], phases[ip], 0, bound, 1)) return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// random_search() - a long run with random bursts at random points
+//   returns: 0 if all pass
+static int random_search(int adc, long nops)
+{
+  long i;
+  nsched = 0;
+  reset_ring(adc, 0, 0, 0);
+  rand_p = adc ? 4*adc_seq_len : 6;
+  rand_max = adc ? (N_READINGS+2)*adc_seq_len : N_PULSE_RING + 2;
+  for (i = 0; i < nops && !fail; i++) {
+    if (!adc) take_pulse();
+    else if (rng() % 4 == 0) take_depth();
+    else take_reading();
+  }
+  rand_p = 0;
+  drain(adc);
+  if (fail) {
+    printf("  FAIL %s ring, random run, after %ld calls:\n    %s\n", adc ? "ADC" : "pulse", i, fail);
+    return 1;
+  }
+  return 0;
+}
+
+// ============================= Benchmark
+static int64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// bench() - host time per reading through the ADC ring: produced by the
+//   ISR and retrieved, in lockstep (depth 1), in bursts of a full ring,
+//   and overflowing by half a ring.  Best of five trials, as the host
+//   is not quiet.
+static void bench(void)
+{
+  static const char *pattern[3] = {"lockstep", "full ring", "overflow"};
+  int v, m, trial;
+  for (v = 0; v < N_VARIANT; v++) {
+    variant = v;
+    for (m = 0; m < 3; m++) {
+      int burst = (m == 0) ? 1 : ((m == 1) ? N_READINGS-1 : N_READINGS + N_READINGS/2);
+      double best = 1e30, dropped = 0;
+      for (trial = 0; trial < 5; trial++) {
+        long n = 0, nover = 0;
+        int64_t t0, t1;
+        reset_ring(1, 0, 0, 0);
+        sreg_i = 0;   // no preemption: time the code, not the search
+        t0 = now_ns();
+        do {
+          for (int rep = 0; rep < 1000; rep++) {
+            struct adc_readings_struct r;
+            for (int k = 0; k < burst*adc_seq_len; k++) adc_isr();
+            while (get_next_adc_reading(&r)) ;
+            n += burst;
+            nover += n_overflow; n_overflow = 0;   // 16 bits, as the firmware
+          }
+          t1 = now_ns();
+        } while (t1 - t0 < 100000000LL);
+        if ((double) (t1 - t0) / n < best) best = (double) (t1 - t0) / n;
+        dropped = 100.0 * nover / n;
+      }
+      printf("%-9s %-10s %8.1f ns/reading, %5.1f%% dropped\n", variant_name[v], pattern[m],
+             best, dropped);
+    }
+  }
+}
+
+// ============================= Main
+static void usage(void)
+{
+  fprintf(stderr,
+          "usage: ringsim [-b bound] [-r nops] [-s seed]\n"
+          "       ringsim --bench\n");
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  int bound = 2, dobench = 0, bad = 0;
+  long nops = 1000000;
+  int i, v;
+
+  for (i = 1; i < argc; i++) {
+    const char *a = argv[i];
+    if (strcmp(a, "--bench") == 0) dobench = 1;
+    else if (strcmp(a, "-b") == 0 && i+1 < argc) bound = atoi(argv[++i]);
+    else if (strcmp(a, "-r") == 0 && i+1 < argc) nops = atol(argv[++i]);
+    else if (strcmp(a, "-s") == 0 && i+1 < argc) rng_state = strtoull(argv[++i], 0, 10);
+    else usage();
+  }
+  if (bound < 0 || bound > MAX_BOUND) {
+    fprintf(stderr, "ringsim: bound must be 0-%d\n", MAX_BOUND);
+    return 2;
+  }
+  if (dobench) { bench(); return 0; }
+
+  reset_ring(1, 0, 0, 0);
+  printf("# ADC ring %d readings of %d conversions (%d values), pulse ring %d, preemption bound %d\n",
+         N_READINGS, adc_seq_len, ADC_NVALS, N_PULSE_RING, bound);
+  for (v = 0; v < N_VARIANT; v++) {
+    int expect, adc, f;
+    variant = v;
+    for (adc = 1; adc >= 0; adc--) {
+      const char *ring = adc ? "ADC" : "pulse";
+      expect = (v == V_NOLOCK && adc);   // must fail
+      f = exhaustive(adc, bound);
+      printf("%-9s %-5s exhaustive %10ld runs  %s\n", variant_name[v], ring, runs, f ? "FAIL" : "pass");
+      bad |= (f != expect);
+      f = random_search(adc, nops);
+      printf("%-9s %-5s random     %10ld calls %s\n", variant_name[v], ring, nops, f ? "FAIL" : "pass");
+      bad |= (f && !expect);
+    }
+  }
+  if (bad) printf("ringsim: a result differs from the expected (firmware passes, nolock fails for the ADC)\n");
+  return bad;
+}
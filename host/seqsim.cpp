@@ -0,0 +1,204 @@
+//   EMONTX3-CONTINUOUS - host-side tools
+//
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   seqsim - compare the plain and the interleaved ADC sampling sequence
+//   (ADC_INTERLEAVE in cont.h) on simulated mains waveforms.
+//
+//   Usage:
+//     seqsim [prescalar [freq]]
+//       prescalar - ADC clock prescalar, 128, 64 or 32 (default 64)
+//       freq      - mains frequency [Hz] (default 50)
+//
+//   Voltage and current waveforms made of harmonics are sampled with the
+//   timing of each sequence, quantized like the 10-bit ADC, and reduced to
+//   active power with the arithmetic of accum_stats() and calc_stats():
+//     plain       - V,I1,I2,I3,I4; the power is rotated by the phase angle
+//                   of each current sample's offset from the voltage sample
+//     interleaved - V,I1,V,I2,V,I3,V,I4; each current is paired with the
+//                   mean of the voltage samples around it
+//   The error against the exact power is reported for each load and each
+//   current channel, together with the readings per mains cycle and the
+//   CPU load estimated from the cycle budget in cont.h (estimates, not
+//   measured cycle counts).
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+// Firmware configuration, for the emonTx; the cycle budget per reading
+// of both sequences comes from cont.h
+#define F_CPU 16000000UL
+#define PGM_P const char *  // flash strings are plain strings on the host
+#include "../src/cont.h"
+
+#define ACCUM_SECS ((double) ACCUM_PERIOD / SECS)  // accumulation window [sec]
+
+// One harmonic of a waveform
+struct harmonic {
+  int n;          // harmonic number
+  double amp;     // amplitude [ADU]
+  double ph;      // phase [deg]
+};
+// Simulated load: its current waveform
+struct load {
+  const char *name;
+  struct harmonic h[8];
+};
+
+// Mains voltage with a little flat-topping, as found on most networks
+static const struct harmonic vmains[] = {
+  {1, 400.0, 0.0}, {3, 12.0, 180.0}, {5, 8.0, 0.0}, {7, 4.0, 180.0}, {0, 0, 0}
+};
+
+static const struct load loads[] = {
+  {"resistive", {{1, 300.0, 0.0}, {3, 9.0, 180.0}, {5, 6.0, 0.0}, {7, 3.0, 180.0}, {0, 0, 0}}},
+  {"motor pf 0.7", {{1, 300.0, -45.6}, {3, 6.0, 150.0}, {0, 0, 0}}},
+  {"rectifier/SMPS", {{1, 200.0, -5.0}, {3, 170.0, 165.0}, {5, 130.0, -25.0},
+                      {7, 90.0, 145.0}, {9, 55.0, -45.0}, {11, 30.0, 125.0},
+                      {13, 15.0, -65.0}, {0, 0, 0}}},
+  {"light dimmer", {{1, 180.0, -32.0}, {3, 95.0, 110.0}, {5, 60.0, -120.0},
+                    {7, 40.0, 20.0}, {9, 28.0, -160.0}, {11, 20.0, 0.0}, {0, 0, 0}}}
+};
+#define N_LOADS (sizeof(loads)/sizeof(loads[0]))
+
+// wave() - value of a waveform at time t [s]
+static double wave(const struct harmonic *h, double f, double t)
+{
+  double v = 0;
+  for (; h->n; h++) v += h->amp * cos(2*M_PI*h->n*f*t + h->ph*M_PI/180.0);
+  return v;
+}
+
+// adc() - quantize like the 10-bit ADC, after offset subtraction
+static int adc(double v)
+{
+  int x = (int) floor(v + 512.0 + 0.5);
+  if (x < 0) x = 0;
+  if (x > 1023) x = 1023;
+  return x - 512;
+}
+
+// true_power() - exact mean power of voltage and current [ADU^2]
+static double true_power(const struct harmonic *v, const struct harmonic *i)
+{
+  double p = 0;
+  for (; v->n; v++) {
+    for (const struct harmonic *k = i; k->n; k++) {
+      if (k->n == v->n) p += 0.5 * v->amp * k->amp * cos((v->ph - k->ph)*M_PI/180.0);
+    }
+  }
+  return p;
+}
+
+// simulate() - active power of each channel, as the firmware computes it
+//   il - load on every channel
+//   interleave - 1 for the interleaved sequence
+//   tconv - time of one conversion [s]
+//   f - mains frequency [Hz]
+//   pow - active power of each channel [ADU^2], returned
+static void simulate(const struct load *il, int interleave, double tconv, double f,
+                     double pow[N_CUR_CHAN])
+{
+  int nconv = interleave ? 2*N_CUR_CHAN : N_CUR_CHAN+1;
+  double tread = nconv * tconv;        // sample period
+  double tmains = 1.0/f;
+  long nread = (long) (ACCUM_SECS / tread);
+  // History lookback of a quarter cycle: whole samples for the plain
+  // sequence, 1/256 of a sample for the interleaved one
+  int lookback = (int) floor(tmains/4/tread + 0.5);
+  double vhist[256];
+  double v2 = 0, vd = 0, pac[N_CUR_CHAN] = {0}, pre[N_CUR_CHAN] = {0};
+  int j;
+
+  for (long r = 0; r < nread + 256; r++) {
+    double t0 = r * tread;
+    int vs[N_CUR_CHAN+1], is[N_CUR_CHAN];
+    // Sample times follow the sequence (see build_adc_seq())
+    for (j = 0; j<N_CUR_CHAN; j++) {
+      double ti = interleave ? t0 + (2*j+1)*tconv : t0 + (j+1)*tconv;
+      is[j] = adc(wave(il->h, f, ti));
+    }
+    if (interleave) {
+      for (j = 0; j<=N_CUR_CHAN; j++) vs[j] = adc(wave(vmains, f, t0 + 2*j*tconv));
+    } else {
+      vs[0] = adc(wave(vmains, f, t0));
+    }
+    vhist[r & 255] = vs[0];
+    if (r < 256) continue;             // fill the history first
+
+    // Interpolated history lookback of time t [s] from t0
+    auto hist = [&](double t) {
+      double look = floor(t / tread * 256.0 + 0.5) / 256.0;
+      int k = (int) floor(look);
+      double w = look - k;
+      int v0 = (int) vhist[(r - k) & 255], v1 = (int) vhist[(r - k - 1) & 255];
+      return (double) (v0 + (int) floor((v1 - v0) * w));
+    };
+    double vdel = interleave ? hist(tmains/4) : vhist[(r - lookback) & 255];
+    v2 += (double) vs[0]*vs[0];
+    vd += vs[0]*vdel;
+    for (j = 0; j<N_CUR_CHAN; j++) {
+      double vv, vq;
+      if (interleave) {
+        vv = (vs[j] + vs[j+1]) >> 1;
+        vq = hist(tmains/4 - (2*j+1)*tconv);
+      } else {
+        vv = vs[0];
+        vq = vdel;
+      }
+      pac[j] += is[j]*vv;
+      pre[j] += is[j]*vq;
+    }
+  }
+
+  // calc_stats(): quadrature correction, then phase rotation
+  double fprod = vd / v2;
+  for (j = 0; j<N_CUR_CHAN; j++) {
+    double pac0 = pac[j]/nread, pre0 = pre[j]/nread;
+    double pre1 = pre0 - fprod*pac0;
+    double ph = 0, gain = 1.0;
+    if (interleave) gain = 1.0/cos(M_PI * 2*tconv / tmains);
+    else ph = 2*M_PI*(j+1)*tconv / tmains;
+    pow[j] = gain * (cos(ph)*pac0 - sin(ph)*pre1);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int prescalar = (argc > 1) ? atoi(argv[1]) : 64;
+  double f = (argc > 2) ? atof(argv[2]) : 50.0;
+  double tconv = 13.0 * prescalar / (double) F_CPU;
+  int interleave;
+
+  if (prescalar != 128 && prescalar != 64 && prescalar != 32) {
+    fprintf(stderr, "seqsim: prescalar must be 128, 64 or 32\n");
+    return 1;
+  }
+  printf("# prescalar %d, mains %.1f Hz, conversion %.0f us\n", prescalar, f, tconv*1e6);
+  for (interleave = 0; interleave <= 1; interleave++) {
+    int nconv = interleave ? 2*N_CUR_CHAN : N_CUR_CHAN+1;
+    double rate = 1.0/(nconv*tconv);
+    int chan_cycles = interleave ? ACCUM_CHAN_CYCLES_INTERLEAVE : ACCUM_CHAN_CYCLES_PLAIN;
+    int reading_cycles = interleave ? ISR_READING_CYCLES_INTERLEAVE : ISR_READING_CYCLES_PLAIN;
+    double load = (ISR_CONV_CYCLES*nconv + reading_cycles + ACCUM_BASE_CYCLES +
+                   chan_cycles*N_CUR_CHAN) * rate / (double) F_CPU;
+    printf("# %-11s  %d conversions/reading  %5.1f readings/cycle  CPU %2.0f%%\n",
+           interleave ? "interleaved" : "plain", nconv, rate/f, 100*load);
+  }
+  printf("%-16s %-11s   active power error [%%] chan 1..4\n", "# load", "sequence");
+  for (size_t k = 0; k<N_LOADS; k++) {
+    double ptrue = true_power(vmains, loads[k].h);
+    for (interleave = 0; interleave <= 1; interleave++) {
+      double pow[N_CUR_CHAN];
+      simulate(&loads[k], interleave, tconv, f, pow);
+      printf("%-16s %-11s", loads[k].name, interleave ? "interleaved" : "plain");
+      for (int j = 0; j<N_CUR_CHAN; j++) printf(" %+8.3f", 100*(pow[j]-ptrue)/ptrue);
+      printf("\n");
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,103 @@
+//   EMONTX3-CONTINUOUS - host-side tools
+//
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   Host shim of the Arduino core and AVR registers, enough to compile
+//   the firmware for the simulators: src/adc.cpp and src/pulse.cpp for
+//   ringsim, and all of it for alarmsim (devsim.cpp).  The registers are
+//   plain variables that the simulator sets and reads.  The I flag of
+//   SREG, cli() and sei() are handed to the simulator, which models the
+//   interrupts.
+//
+
+#ifndef RING_SHIM_ARDUINO_H
+#define RING_SHIM_ARDUINO_H
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+// Flash is plain memory
+#define PROGMEM
+#define PGM_P const char *
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t *) (p))
+#define pgm_read_float(p) (*(const float *) (p))
+#define pgm_read_ptr(p) (*(void * const *) (p))
+#define memcpy_P memcpy
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define strlen_P strlen
+
+// Interrupt flag, in the simulator
+uint8_t ring_sreg_read(void);
+void ring_sreg_write(uint8_t v);
+void ring_cli(void);
+void ring_sei(void);
+struct ring_sreg {
+  operator uint8_t() const { return ring_sreg_read(); }
+  ring_sreg &operator=(uint8_t v) { ring_sreg_write(v); return *this; }
+};
+extern ring_sreg SREG;
+static inline void cli(void) { ring_cli(); }
+static inline void sei(void) { ring_sei(); }
+
+// Interrupt handlers are plain functions that the simulator calls
+#define ISR(v) extern "C" void v(void)
+
+// ADC
+extern volatile uint8_t ADMUX, ADCSRA, ADCSRB, DIDR0, DIDR2, GPIOR0;
+extern volatile uint16_t ADCW;
+#define REFS0 6
+#define MUX5  3
+#define ADEN  7
+#define ADSC  6
+#define ADATE 5
+#define ADIF  4
+#define ADIE  3
+#define ADPS2 2
+#define ADPS1 1
+#define ADPS0 0
+
+// Timer1 and the pulse input
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+extern volatile uint16_t TCNT1;
+#define CS11  1
+#define TOIE1 0
+#define TOV1  0
+#define INPUT_PULLUP 2
+#define FALLING 2
+static inline void pinMode(uint8_t, uint8_t) { }
+static inline void attachInterrupt(uint8_t, void (*)(void), int) { }
+
+// Digital pins: the simulator sets the levels that digitalRead() returns
+#define INPUT 0
+#define OUTPUT 1
+#define LOW 0
+#define HIGH 1
+int digitalRead(uint8_t pin);
+static inline void digitalWrite(uint8_t, uint8_t) { }
+
+// Serial port.  The simulator takes the bytes written to UDR0 and
+// supplies those read from it.
+uint8_t devsim_udr_read(void);
+void devsim_udr_write(uint8_t v);
+struct devsim_udr {
+  operator uint8_t() const { return devsim_udr_read(); }
+  devsim_udr &operator=(uint8_t v) { devsim_udr_write(v); return *this; }
+};
+extern devsim_udr UDR0;
+extern volatile uint8_t UCSR0A, UCSR0B, UCSR0C;
+extern volatile uint16_t UBRR0;
+#define RXEN0  4
+#define TXEN0  3
+#define UDRIE0 5
+#define RXCIE0 7
+#define U2X0   1
+#define UCSZ00 1
+#define UCSZ01 2
+
+#define _BV(b) (1 << (b))
+
+#endif
@@ -0,0 +1,2 @@
+// Host shim: the Arduino Math.h is the C library math.h
+#include <math.h>
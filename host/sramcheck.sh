@@ -0,0 +1,58 @@
+#!/bin/sh
+# sramcheck.sh - check the SRAM budget in cont.h against a firmware build
+#
+#   Usage: sramcheck.sh FIRMWARE.elf [cont.h]
+#
+# Sums the static data (.data and .bss) of the linked firmware, less the
+# ring buffers and the fast alarm (SRAM_ALARM) that mem.cpp counts
+# separately, and compares it with SRAM_OTHER in cont.h.  The Arduino IDE leaves the ELF in its build
+# directory (File > Preferences > "Show verbose output during
+# compilation" prints the path); avr-nm and avr-size come with it.
+# Exits nonzero if SRAM_OTHER is too small.
+
+ELF=$1
+CONT=${2:-$(dirname "$0")/../src/cont.h}
+NM=${AVR_NM:-avr-nm}
+SIZE=${AVR_SIZE:-avr-size}
+
+if [ -z "$ELF" ] || [ ! -f "$ELF" ]; then
+  echo "usage: $0 FIRMWARE.elf [cont.h]" >&2
+  exit 2
+fi
+
+$SIZE -A "$ELF" | grep -E '^\.(data|bss|noinit) '
+
+# The rings are sized in cont.h and counted by mem.cpp
+RINGS='^(adc_readings|vhist_ring|report_buffer|uart_tx_buf|uart_rx_buf)$'
+# and so are the variables of alarm.cpp (SRAM_ALARM)
+ALARM='^alarm_'
+
+HEX='function hex(s,  i, n) {
+  n = 0; s = tolower(s)
+  for (i = 1; i <= length(s); i++) n = n*16 + index("0123456789abcdef", substr(s, i, 1)) - 1
+  return n
+}'
+
+other=$($NM -S "$ELF" | awk -v rings="$RINGS" -v alarm="$ALARM" "$HEX"'
+  NF == 4 && $3 ~ /^[bBdD]$/ {
+    n = hex($2)
+    if ($4 ~ rings) ring += n; else if ($4 ~ alarm) al += n; else other += n
+  }
+  END { printf "%d %d %d\n", ring, al, other }')
+ring=${other%% *}
+alarm=${other#* }; alarm=${alarm% *}
+other=${other##* }
+
+# SRAM_OTHER for the board the ELF was built for: the emonTx unless it
+# has more than 2 KB of RAM (the Mega's stack top is above 0x8ff)
+if $NM "$ELF" | awk "$HEX"'$3 == "__stack" { f = 1; exit (hex($1) > hex("8008ff")) ? 0 : 1 } END { if (!f) exit 1 }'; then
+  budget=$(sed -n '/^#else/,/^#endif/s/^#define SRAM_OTHER *\([0-9]*\).*/\1/p' "$CONT" | head -1)
+else
+  budget=$(sed -n 's/^#define SRAM_OTHER *\([0-9]*\).*/\1/p' "$CONT" | head -1)
+fi
+
+echo "rings $ring bytes, fast alarm $alarm bytes, other variables $other bytes, SRAM_OTHER $budget"
+if [ "$other" -gt "$budget" ]; then
+  echo "SRAM_OTHER in $CONT is too small: raise it to at least $other" >&2
+  exit 1
+fi
@@ -0,0 +1,99 @@
+//   EMONTX3-CONTINUOUS - host-side tools
+//
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   streamcheck - check that the per-cycle stream (STREAM_CYCLE_CHAN in
+//   cont.h) fits the serial line at full rate.
+//
+//   Usage:
+//     streamcheck [baud]
+//       baud - serial rate (default UART_BAUD)
+//
+//   The longest stream line is built as send_report() formats it, with
+//   the largest values the ADC can give: power of a full-scale voltage
+//   and current in phase, and a full-scale RMS current, for the 240 V
+//   calibration.  It is compared with the bytes the line carries per
+//   mains cycle at 50 and 60 Hz, less the regular reports of a window
+//   spread over its cycles (every line of the report ring, each entry
+//   at its longest).  For 1 up to N_CUR_CHAN channels, with and without
+//   STREAM_CYCLE_IRMS, the bytes per cycle and the margin are printed.
+//   Exits nonzero if all N_CUR_CHAN channels with current do not fit.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+// Firmware configuration and calibration
+#define F_CPU 16000000UL
+#define PGM_P const char *  // flash strings are plain strings on the host
+#include "../src/cont.h"
+#include "../src/cal.h"
+
+const float ical[N_CUR_CHAN] = ICAL_CHANS;
+
+#define ITEM_MAX 21  // [bytes] longest entry: "_name" + 2 digits + ":" + 11 + ","
+
+// item() - length of one entry as send_report() writes it
+static int item(const char *name, int chan, long value)
+{
+  char buf[32];
+  if (chan >= 0) return snprintf(buf, sizeof(buf), "%s%d:%ld,", name, chan, value);
+  return snprintf(buf, sizeof(buf), "%s:%ld,", name, value);
+}
+
+// stream_line() - longest stream line for channels 0..nchan-1
+static int stream_line(int nchan, int irms)
+{
+  double vcal = VCAL_240VAC*VCAL_ADC;
+  int n = item("cs", -1, 255) + 2;  // and the line break
+  for (int j = 0; j < nchan; j++) {
+    n += item("cp", j, -lround(512.0*512.0*vcal*ical[j]));
+    if (irms) n += item("ci", j, lround(1000.0*512.0*ical[j]));
+  }
+  return n;
+}
+
+// window_bytes() - most bytes of regular reports in one window
+static int window_bytes(void)
+{
+  int items = REPORT_VOLTAGE + N_CUR_CHAN*REPORT_CHAN + REPORT_META +
+              REPORT_DEMAND + REPORT_PULSE;
+#ifdef CYCLE_ANALYSIS
+  items += N_CUR_CHAN*REPORT_DIST;
+#endif
+  return items*ITEM_MAX;
+}
+
+int main(int argc, char **argv)
+{
+  long baud = (argc > 1) ? atol(argv[1]) : UART_BAUD;
+  double window = (double) ACCUM_PERIOD / SECS;
+  int status = 0;
+
+  if (baud <= 0) {
+    fprintf(stderr, "streamcheck: baud must be positive\n");
+    return 1;
+  }
+  printf("# %ld baud, %d current channels, regular reports at most %d bytes per %.0f s window\n",
+         baud, N_CUR_CHAN, window_bytes(), window);
+  printf("# %5s %4s %5s  %6s %6s  %6s %6s\n", "chans", "irms", "line",
+         "50 Hz", "margin", "60 Hz", "margin");
+  for (int irms = 0; irms <= 1; irms++) {
+    for (int nchan = 1; nchan <= N_CUR_CHAN; nchan++) {
+      int line = stream_line(nchan, irms);
+      printf("  %5d %4d %5d", nchan, irms, line);
+      for (int f = 50; f <= 60; f += 10) {
+        double budget = baud / 10.0 / f - window_bytes() / (window * f);
+        printf("  %6.1f %6.1f", budget, budget - line);
+        if (irms && nchan == N_CUR_CHAN && line > budget) status = 1;
+      }
+      printf("\n");
+    }
+  }
+  if (status) printf("streamcheck: all %d channels with current do not fit at %ld baud\n",
+                     N_CUR_CHAN, baud);
+  return status;
+}
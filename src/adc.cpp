@@ -8,21 +8,117 @@
 
 #include <Arduino.h>
 #include "cont.h"
+#include "cal.h"
 
 // ADC pin for each input channel.  These are AVR ADC MUX channel numbers
 // If you are using different ADC channels to a CPU than the standard emonTx
 // channels, then you will modify these numbers.  Up to five channels, with
 // the "voltage" signal assumed to be the first channel.
-const uint8_t adc_chans[N_ADC_CHAN] = {0, 1, 2, 3, 4};
-
-// Linked list pointers that point forward and backward.  These are indices
-// to adc_chans[].  This will be filled in by init_adc().
-uint8_t next_adc_chan[N_ADC_CHAN]   = {};
-uint8_t prev_adc_chan[N_ADC_CHAN]   = {};
+#ifndef BOARD_MEGA
+const uint8_t adc_chans[N_ADC_CHAN] PROGMEM = {0, 1, 2, 3, 4};
+#else
+const uint8_t adc_chans[N_ADC_CHAN] PROGMEM = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+#endif
+
+// Multiplexer settings for an ADC pin.  On the ATmega2560, pins 8-15 are
+// selected with the MUX5 bit, which lives in ADCSRB.
+#define ADC_ADMUX(pin) (_BV(REFS0) | ((pin) & 0x07))
+#ifdef BOARD_MEGA
+#define ADC_ADCSRB(pin) (((pin) & 0x08) ? _BV(MUX5) : 0)
+#endif
+
+// ADC sampling sequence.  Position p of the sequence describes the ADC
+// interrupt which occurs while conversion p is in progress.  At that time
+// the ADC is reporting the sample of conversion p-1, and the multiplexer
+// can be programmed for conversion p+1 (the ADC latches ADMUX at the start
+// of each free-running conversion).  Pre-computing all of this keeps the
+// interrupt handler free of lookups.  The table is filled in by
+// build_adc_seq().
+//
+// The plain sequence converts each enabled channel once per reading,
+// V,I1,I2,I3,I4.  With ADC_INTERLEAVE (see cont.h) it is V,I1,V,I2,V,I3,V,I4:
+// the voltage sample after current j goes to vals[VAFTER_SLOT(j)], and the
+// one that closes the reading is also vals[0] of the next reading.
+struct adc_seq_struct {
+  uint8_t slot;   // vals[] index of the sample being reported
+  uint8_t admux;  // ADMUX value for the conversion after the one in progress
+  uint8_t next;   // next sequence position
+  uint8_t last;   // 1 if this sample completes a reading
+#ifdef BOARD_MEGA
+  uint8_t adcsrb; // ADCSRB value (MUX5) to go with admux
+#endif
+};
+struct adc_seq_struct adc_seq[ADC_NCONV];
+uint8_t adc_seq_len = 0;
+// Conversions from the voltage sample vals[0] to the sample of each
+// current channel, for time alignment (see derive_rate_constants())
+uint8_t adc_chan_offset[N_CUR_CHAN];
+// Channels currently in the sampling sequence (bit j = adc_chans[j])
+chanmask_t adc_chan_enabled = 0;
+#define ADC_ALL_CHANS ((chanmask_t) (((uint32_t) 1 << N_ADC_CHAN) - 1))
+
+// Current sequence position.  This lives in general purpose I/O register
+// GPIOR0 (unused by the Arduino core), which the interrupt handler can read
+// and write with single-cycle IN/OUT instructions.  Internal state, do not
+// modify.
+#define ADC_SEQ_POS GPIOR0
+
+// Sampling profiles (see cont.h): prescalar, and ADCSRA prescalar bits
+struct adc_profile_struct {
+  uint8_t prescalar;
+  uint8_t adps;
+};
+const struct adc_profile_struct adc_profiles[N_ADC_PROFILE] PROGMEM = {
+  {128, _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0)}, // 125 kHz / 13 =  9615 Hz
+  { 64, _BV(ADPS2) | _BV(ADPS1)             }, // 250 kHz / 13 = 19231 Hz
+  { 32, _BV(ADPS2) | _BV(ADPS0)             }  // 500 kHz / 13 = 38462 Hz
+};
+uint8_t adc_profile = 0;
+
+// Reading timestamps are counted from the ADC conversion clock instead of
+// micros().  Each conversion takes exactly 13 ADC clocks, so the time per
+// reading is an exact number of microseconds for the supported clocks
+// (the slower profiles are multiples of the fastest).
+#if ((13UL*ADC_PRESCALAR_MIN*1000000UL) % F_CPU) != 0
+#error "ADC conversion time is not a whole number of microseconds"
+#endif
+uint16_t adc_conv_usec = 0;     // [us] duration of one conversion
+uint16_t adc_reading_usec = 0;  // [us] duration of one full reading
+uint32_t adc_clock = 0;         // [us] time of last reading; interrupt handler only
+
+// Device time: the 64-bit time [us] of the last reading retrieved, since
+// the ADC was started.  This is the timebase for all timing and energy.
+// The 32-bit reading times are extended as the readings are retrieved,
+// which is exact as long as the ring never holds 71 minutes of readings.
+uint64_t adc_time = 0;
+// The same time as whole seconds and the microseconds within the second,
+// counted up as the readings are retrieved, so that reports need no
+// 64-bit division
+uint32_t adc_time_sec = 0;      // [s]
+uint32_t adc_time_usec = 0;     // [us] 0 to SECS-1
+
+// Clock calibration.  The seconds and microseconds above, which are what
+// reports carry, are corrected by adc_time_ppm: the reading period as
+// measured against Timer1 (see calibrate_clock()), less the crystal error
+// XTAL_PPM of cal.h.  The 64-bit device time stays in nominal reading
+// periods, as the reading times and accumulation windows are.
+int32_t adc_time_ppm = -(XTAL_PPM);   // [ppm] correction of device time
+int32_t adc_time_frac = 0;      // [us/1e6] correction not yet applied
+// The interrupt handler takes the Timer1 time of the next reading when
+// adc_cal_req is set
+volatile uint8_t adc_cal_req = 0;
+volatile uint32_t adc_cal_ticks;  // [ticks] Timer1 time of that reading
+volatile uint32_t adc_cal_clock;  // [us] and its reading time
+#define CLOCK_CAL_IDLE  0
+#define CLOCK_CAL_START 1       // request the start
+#define CLOCK_CAL_FIRST 2       // start requested
+#define CLOCK_CAL_RUN   3       // wait CLOCK_CAL_PERIOD, then request the end
+#define CLOCK_CAL_END   4       // end requested
+// The first measurement starts with the first reading after setup(), once
+// Timer1 has been set up by init_pulse()
+uint8_t adc_cal_state = CLOCK_CAL_START;
+uint32_t adc_cal_ticks0, adc_cal_clock0;  // start of the measurement
 
-// Current ADC channel number.  These are indices to adc_chans[].  This is an
-// internal state variable, do not modify.
-volatile uint8_t cur_chan = 1;
 // Maximum depth we have gone into the ADC ring buffer.  Used for
 // diagnostics (have we overflowed the buffer?)
 uint8_t max_adc_depth = 0;
@@ -40,52 +136,145 @@ volatile uint16_t n_overflow = 0;
 
 // ============================= ADC setup and interrupt reading
 // init_adc - initialize the ADC
-//   prescalar - Atmel ADC prescalar (see cont.h)
-void init_adc(uint8_t prescalar) 
+//   profile - sampling profile (see cont.h)
+void init_adc(uint8_t profile) 
 {
   uint8_t adcsra;
 
   ADCSRA = ADCSRB = 0; // Disable ADC temporarily
+  adc_profile = profile;
+  adc_conv_usec = 13UL * pgm_read_byte(&adc_profiles[profile].prescalar) / (F_CPU/1000000UL);
+  adc_chan_enabled = 0;
   init_adc_chans();
 
   // For eMonTx3, use AVCC as reference (=REFS0)
-  // Select first ADC channel
-  ADMUX  = _BV(REFS0) | ((cur_chan-1+N_ADC_CHAN)%N_ADC_CHAN);
+  // Select first ADC channel; the next interrupt reports it
+  ADMUX  = ADC_ADMUX(pgm_read_byte(&adc_chans[0]));
+  ADC_SEQ_POS = adc_seq[0].next;
 
   // Init ADC free-run mode; f = ( 16MHz/prescaler ) / 13 cycles/conversion 
   DIDR0 = 0;
+#ifdef BOARD_MEGA
+  DIDR2 = 0;
+#endif
   for (uint8_t ich = 0; ich < N_ADC_CHAN; ich++) {
-    DIDR0 |= 1 << adc_chans[ich]; // Turn off digital input for ADC pin
+    // Turn off digital input for ADC pin
+    uint8_t pin = pgm_read_byte(&adc_chans[ich]);
+#ifdef BOARD_MEGA
+    if (pin >= 8) { DIDR2 |= 1 << (pin - 8); continue; }
+#endif
+    DIDR0 |= 1 << pin;
   }
 
-  ADCSRB = 0;           // Free run mode, no high MUX bit
+  ADCSRB = 0;           // Free run mode, high MUX bit of channel 0
   adcsra = _BV(ADEN)  | // ADC enable
            _BV(ADSC)  | // ADC start
            _BV(ADATE) | // Auto trigger
            _BV(ADIE); // Interrupt enable
-  switch (prescalar) {
-    case 128: 
-      adcsra |= _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0); // 128:1; 125 kHz / 13 =  9615 Hz         
-      break;
-    case 64:
-      adcsra |= _BV(ADPS2) | _BV(ADPS1) ;             // 64:1;  250 kHz / 13 = 19231 Hz
-      break;
-  }
+  adcsra |= pgm_read_byte(&adc_profiles[profile].adps);
   ADCSRA = adcsra;
 
   sei(); // Enable interrupts
 }
 
+// set_adc_profile() - switch the sampling profile while sampling continues
+//   profile - sampling profile (see cont.h)
+// The conversion in progress may be spoiled, and readings already in the
+// ring buffer were taken at the old rate; the caller is responsible for
+// discarding them (see accum_stats()).
+void set_adc_profile(uint8_t profile)
+{
+  uint8_t sreg;
+  if (profile >= N_ADC_PROFILE) return;
+
+  sreg = SREG; cli();
+  {
+    adc_profile = profile;
+    // A measurement across the switch would include the spoiled
+    // conversion; settle_rate() starts a new one
+    adc_cal_req = 0;
+    adc_cal_state = CLOCK_CAL_IDLE;
+    adc_conv_usec = 13UL * pgm_read_byte(&adc_profiles[profile].prescalar) / (F_CPU/1000000UL);
+    adc_reading_usec = adc_seq_len * adc_conv_usec;
+    // Change only the prescalar bits.  ADIF is masked so that writing the
+    // register back does not clear a pending interrupt.
+    ADCSRA = (ADCSRA & ~(_BV(ADIF) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0)))
+             | pgm_read_byte(&adc_profiles[profile].adps);
+  }
+  SREG = sreg; // Restore interrupts
+}
+
+// get_adc_profile() - current sampling profile
+uint8_t get_adc_profile(void)
+{
+  return adc_profile;
+}
+
+// build_adc_seq() - rebuild the sampling sequence from adc_chan_enabled
+// Must be called with interrupts disabled.
+static void build_adc_seq(void)
+{
+  uint8_t ch[ADC_NCONV];  // channel of each conversion
+  uint8_t sl[ADC_NCONV];  // vals[] slot of each conversion
+  uint8_t j, p, pn, plast, len = 0;
+
+#ifdef ADC_INTERLEAVE
+  // Every current channel is converted, preceded by a voltage sample that
+  // closes the channel before it.  The reading completes with the first
+  // voltage sample, which the interrupt handler reports at position 1.
+  for (j = 0; j<N_CUR_CHAN; j++) {
+    ch[len] = 0;   sl[len++] = VAFTER_SLOT(j == 0 ? N_CUR_CHAN-1 : j-1);
+    adc_chan_offset[j] = len;
+    ch[len] = j+1; sl[len++] = j+1;
+  }
+  plast = 1;
+#else
+  for (j = 0; j<N_ADC_CHAN; j++) {
+    if (!(adc_chan_enabled & ((chanmask_t) 1 << j))) continue;
+    if (j > 0) adc_chan_offset[j-1] = len;
+    ch[len] = j;   sl[len++] = j;
+  }
+  // The reading completes with the sample of its last conversion, which
+  // is reported at position 0 of the next round
+  plast = 0;
+#endif
+  for (p = 0; p<len; p++) {
+    pn = (p+1 == len) ? 0 : p+1;
+    adc_seq[p].slot  = sl[p == 0 ? len-1 : p-1];
+    adc_seq[p].admux = ADC_ADMUX(pgm_read_byte(&adc_chans[ch[pn]]));
+    adc_seq[p].next  = pn;
+    adc_seq[p].last  = (p == plast);
+#ifdef BOARD_MEGA
+    adc_seq[p].adcsrb = ADC_ADCSRB(pgm_read_byte(&adc_chans[ch[pn]]));
+#endif
+  }
+  adc_seq_len = len;
+  adc_reading_usec = len * adc_conv_usec;
+
+  // Start over with a new reading, and make sure the multiplexer agrees
+  // with the new sequence.  The reading in progress may receive one sample
+  // of the wrong channel; channels only change while inputs are scanned.
+  ADC_SEQ_POS = 0;
+  ADMUX = ADC_ADMUX(pgm_read_byte(&adc_chans[ch[0]]));
+#ifdef BOARD_MEGA
+  ADCSRB = ADC_ADCSRB(pgm_read_byte(&adc_chans[ch[0]]));
+#endif
+}
+
 // Initialize ADC channels to original state
 //  init_adc_chans()
 void init_adc_chans(void)
 {
-  uint8_t j;
+  uint8_t sreg;
   // Reset channels that were potentially disabled
-  for (j = 0; j<N_ADC_CHAN; j++) {
-    next_adc_chan[j] = (j+1)%(N_ADC_CHAN);
-    prev_adc_chan[j] = (j+N_ADC_CHAN-1)%(N_ADC_CHAN);
+  if (adc_chan_enabled == ADC_ALL_CHANS) return;
+
+  sreg = SREG; cli();
+  {
+    adc_chan_enabled = ADC_ALL_CHANS;
+    build_adc_seq();
   }
+  SREG = sreg; // Restore interrupts
   return;
 }
 
@@ -93,40 +282,87 @@ void init_adc_chans(void)
 //  disable_adc_chan()
 void disable_adc_chan(uint8_t chan)
 {
-  uint8_t next, prev;
   uint8_t sreg;
   
   // Do not allow disabling channel 0
-  if (chan == 0) return;
+  if (chan == 0 || chan >= N_ADC_CHAN) return;
+#ifdef ADC_INTERLEAVE
+  // The interleaved sequence always converts every channel
+  return;
+#endif
   // Already disable???
-  if (next_adc_chan[chan] == 0xff || prev_adc_chan[chan] == 0xff) return;
-
-  // Heal the linked list
-  next = next_adc_chan[chan];
-  prev = prev_adc_chan[chan];
+  if (!(adc_chan_enabled & ((chanmask_t) 1 << chan))) return;
 
-  // Disable interrupts while we twizzle these pointers
+  // Disable interrupts while we rebuild the sequence
   sreg = SREG; cli();
   {
-    next_adc_chan[prev] = next;
-    prev_adc_chan[next] = prev;
-  
-    // Mark this channel as dead
-    next_adc_chan[chan] = prev_adc_chan[chan] = 0xff;
+    adc_chan_enabled &= ~((chanmask_t) 1 << chan);
+    build_adc_seq();
   }
   SREG = sreg; // Restore interrupts
 
   return;
 }
 
-// set_adc_offset() - set the zero-point of ADC channel
+// get_adc_offset() - get the zero-point of ADC channel
+//   chan - ADC input number (0-4)
+//   returns: zero-point of this channel
+int16_t get_adc_offset(uint8_t chan)
+{
+  int16_t offset;
+  uint8_t sreg;
+  if (chan >= N_ADC_CHAN) return 0;
+
+  sreg = SREG; cli();
+  {
+    offset = adc_offset.vals[chan];
+  }
+  SREG = sreg; // Restore interrupts
+  return offset;
+}
+
+// put_adc_offset() - store the zero-point of ADC channel, including the
+//   extra voltage slots of the interleaved sequence
+//   Must be called with interrupts disabled.
+static void put_adc_offset(uint8_t chan, int16_t offset)
+{
+  adc_offset.vals[chan] = offset;
+#ifdef ADC_INTERLEAVE
+  if (chan == 0) {
+    for (uint8_t j = 0; j<N_CUR_CHAN; j++) adc_offset.vals[VAFTER_SLOT(j)] = offset;
+  }
+#endif
+}
+
+// set_adc_offset() - set the zero-point of ADC channel, unless it has
+//   already been set
 //   chan - ADC input number (0-4)
 //   offset - zero-point of this channel
 void set_adc_offset(uint8_t chan, int16_t offset)
 {
-  if (chan >= 0 && chan < N_ADC_CHAN && adc_offset.vals[chan] == 0) {
-    adc_offset.vals[chan] = offset;
+  uint8_t sreg;
+  if (chan >= N_ADC_CHAN) return;
+
+  sreg = SREG; cli();
+  { // The ISR reads this 16-bit value, so change it atomically
+    if (adc_offset.vals[chan] == 0) put_adc_offset(chan, offset);
   }
+  SREG = sreg; // Restore interrupts
+}
+
+// reset_adc_offset() - clear the zero-point of ADC channel so that it
+//   can be set again with set_adc_offset()
+//   chan - ADC input number (0-4)
+void reset_adc_offset(uint8_t chan)
+{
+  uint8_t sreg;
+  if (chan >= N_ADC_CHAN) return;
+
+  sreg = SREG; cli();
+  { // The ISR reads this 16-bit value, so change it atomically
+    put_adc_offset(chan, 0);
+  }
+  SREG = sreg; // Restore interrupts
 }
 
 // get_adc_depth() - get the current ADC ring buffer depth
@@ -151,6 +387,88 @@ void reset_overflow(void)
   n_overflow = 0;
 }
 
+// get_time_us() - device time
+//   returns: [us] time of the last ADC reading retrieved
+uint64_t get_time_us(void)
+{
+  return adc_time;
+}
+
+// get_time_sec() - device time in whole seconds
+//   returns: [s] time of the last ADC reading retrieved
+uint32_t get_time_sec(void)
+{
+  return adc_time_sec;
+}
+
+// split_time() - split a device time into whole seconds and microseconds,
+//   counting back from the time of the last reading retrieved
+//   t - [us] device time less than 71 minutes ago
+//   sec, usec - [s] and [us] of t upon return
+void split_time(uint64_t t, uint32_t *sec, uint32_t *usec)
+{
+  uint32_t d = (uint32_t) adc_time - (uint32_t) t;
+  uint32_t s = adc_time_sec, u = adc_time_usec;
+  // Reported times are rarely more than a second old, so this borrows
+  // once or not at all
+  while (d > u) { s--; u += SECS; }
+  *sec = s;
+  *usec = u - d;
+}
+
+// calibrate_clock() - measure the reading period against Timer1
+// Timer1 counts the CPU clock (F_CPU/8, see pulse.cpp).  The interrupt
+// handler takes its time at two readings CLOCK_CAL_PERIOD apart, and the
+// ticks between them give the true reading period in CPU clocks, which
+// corrects the nominal adc_reading_usec that device time is counted in.
+// Timer1 runs from the same crystal, so this cannot see the crystal's own
+// error; that is XTAL_PPM.  A result off by more than CLOCK_CAL_LIMIT is
+// taken to be a fault (Timer1 not running) and ignored.
+void calibrate_clock(void)
+{
+  adc_cal_state = CLOCK_CAL_START;
+}
+
+// clock_cal_step() - advance the clock measurement after each reading
+static void clock_cal_step(void)
+{
+  if (adc_cal_req) return;  // waiting for the interrupt handler
+  switch (adc_cal_state) {
+    case CLOCK_CAL_START:
+      adc_cal_req = 1;
+      adc_cal_state = CLOCK_CAL_FIRST;
+      break;
+    case CLOCK_CAL_FIRST:
+      adc_cal_ticks0 = adc_cal_ticks;
+      adc_cal_clock0 = adc_cal_clock;
+      adc_cal_state = CLOCK_CAL_RUN;
+      break;
+    case CLOCK_CAL_RUN:
+      if ((uint32_t) adc_time - adc_cal_clock0 < CLOCK_CAL_PERIOD) break;
+      adc_cal_req = 1;
+      adc_cal_state = CLOCK_CAL_END;
+      break;
+    case CLOCK_CAL_END: {
+      uint32_t usec = adc_cal_clock - adc_cal_clock0;
+      int32_t err = (int32_t) ((adc_cal_ticks - adc_cal_ticks0) - usec * PULSE_TICKS_PER_US);
+      float ppm = (float) err * 1e6 / ((float) usec * PULSE_TICKS_PER_US);
+      if (fabs(ppm) < CLOCK_CAL_LIMIT) {
+        adc_time_ppm = (int32_t) (ppm + (ppm < 0 ? -0.5 : 0.5)) - (XTAL_PPM);
+      }
+      adc_cal_state = CLOCK_CAL_IDLE;
+      break;
+    }
+  }
+}
+
+// time64() - extend a reading time to the 64-bit device time
+//   t - [us] time of a reading retrieved less than 71 minutes ago
+//   returns: [us] device time of that reading
+uint64_t time64(uint32_t t)
+{
+  return adc_time - (uint32_t) ((uint32_t) adc_time - t);
+}
+
 // get_next_adc_reading() - retrieve the next available ADC ring buffer sample
 //  reading - ADC reading structure to be filled upon return
 //  returns: 0 if no reading is available; 1 if reading returned in *reading
@@ -159,6 +477,7 @@ uint8_t get_next_adc_reading(struct adc_readings_struct *reading)
   uint8_t sreg, j;
   volatile struct adc_readings_struct *datap = reading;
   uint8_t depth;
+  uint32_t dt;
 
   sreg = SREG; cli();
   { // Inside interrupt disabled block
@@ -171,7 +490,8 @@ uint8_t get_next_adc_reading(struct adc_readings_struct *reading)
 
     adc_readings[cr].set = 0; // Indicate we've processed this
     datap->t = adc_readings[cr].t;
-    for (j=0; j<N_ADC_CHAN; j++)  datap->vals[j] = adc_readings[cr].vals[j];
+    datap->gap = adc_readings[cr].gap;
+    for (j=0; j<ADC_NVALS; j++)  datap->vals[j] = adc_readings[cr].vals[j];
     // This does not work.  Why?  
     // *datap = adc_readings[cr];
 
@@ -181,6 +501,17 @@ uint8_t get_next_adc_reading(struct adc_readings_struct *reading)
   }
   SREG = sreg; // Re-enable interrupts
 
+  dt = reading->t - (uint32_t) adc_time;
+  adc_time += dt;
+  adc_time_usec += dt;
+  // Calibrated seconds: carry the correction a microsecond at a time
+  if (adc_time_ppm) {
+    adc_time_frac += (int32_t) dt * adc_time_ppm;
+    while (adc_time_frac >= 500000L) { adc_time_frac -= 1000000L; adc_time_usec++; }
+    while (adc_time_frac < -500000L) { adc_time_frac += 1000000L; adc_time_usec--; }
+  }
+  while (adc_time_usec >= SECS) { adc_time_usec -= SECS; adc_time_sec++; }
+  if (adc_cal_state) clock_cal_step();
   while (depth > 0x80) depth += N_READINGS;
   if (depth > max_adc_depth) max_adc_depth = depth;
   // max_adc_depth = depth;
@@ -191,41 +522,80 @@ uint8_t get_next_adc_reading(struct adc_readings_struct *reading)
 // ============================= ADC Interrupt handler
 // The handler retrieves the ADC data from the ADC registers and
 // saves it in the ring buffer.
+//
+// A reading is completed by the sample of its last conversion, so
+// vals[] of each reading are taken in sequence order, and
+// adc_chan_offset[] gives the time of each current sample.
+//
+// host/isrsim checks that it records the same data as the handler it
+// replaced.
+//
+// Cycle budget (estimated from the instruction sequence, not measured;
+// check with avr-objdump -d): about 110 cycles for an ordinary
+// conversion, including interrupt entry and register save/restore, and
+// about 175 cycles for the conversion that completes a reading.  At
+// ADC_PRESCALAR=64 (19231 conversions/sec) this is about 15% of the CPU,
+// and 30% with the diagnostic prescalar 32 profile.  The previous handler
+// called micros(), which alone cost about 60 cycles and disabled
+// interrupts, once per reading and walked the channel linked lists on
+// every conversion.  The Mega board profile adds two cycles per conversion
+// for the MUX5 bit; in free-running mode the rest of ADCSRB is zero.
+// ADC_INTERLEAVE adds about 10 cycles to the conversion completing a
+// reading, to carry its voltage sample over.  Testing adc_cal_req adds a
+// few cycles to it as well, and its registers to the save/restore.
 ISR(ADC_vect) { // ADC-sampling interrupt
   uint16_t sample = ADCW; // ADC sample (full 10-bit word)
-  uint8_t ich = cur_chan; // Ring buffer write pointer
-  uint8_t ichr = prev_adc_chan[ich]; // ADC is reporting previous sample
-  uint8_t ichn = next_adc_chan[ich]; // ... and we will advance to next sample
-  uint8_t cr = adc_write_index; 
+  const struct adc_seq_struct *s = &(adc_seq[ADC_SEQ_POS]);
+  uint8_t slot = s->slot; // ADC is reporting this channel
+  uint8_t cr = adc_write_index; // Ring buffer write pointer
+  volatile struct adc_readings_struct *r = &(adc_readings[cr]);
+
+  // Advance ADC pointer to next input channel
+  ADMUX = s->admux;
+#ifdef BOARD_MEGA
+  ADCSRB = s->adcsrb;
+#endif
+  ADC_SEQ_POS = s->next;
 
   // Record sample, after subtracting offset
-  adc_readings[cr].vals[ichr] = sample - adc_offset.vals[ichr];
+  int16_t val = sample - adc_offset.vals[slot];
+  r->vals[slot] = val;
 
-  // Finish the reading if we have completed the round-robin and next
-  // channel will be back to zero.
-  if (ichn == 0) {
+  // Finish the reading if we have completed the round-robin
+  if (s->last) {
     // Finalize this reading
-    adc_readings[cr].t = micros();
-    adc_readings[cr].set = 1;
+    adc_clock += adc_reading_usec;
+    r->t = adc_clock;
+    r->set = 1;
+    // Timer1 time of this reading, for calibrate_clock()
+    if (adc_cal_req) {
+      uint16_t lo = TCNT1, hi = pulse_timer_hi;
+      if ((TIFR1 & _BV(TOV1)) && lo < 0x8000) hi++;
+      adc_cal_ticks = ((uint32_t) hi << 16) | lo;
+      adc_cal_clock = adc_clock;
+      adc_cal_req = 0;
+    }
 
     // Advance to next reading
     cr ++; if (cr == N_READINGS) cr = 0;
 
-    // Overflow occurred.  We must manually advance the read index and
-    // record the overflow
+    // Overflow occurred.  We must manually advance the read index, drop
+    // the oldest reading, and mark the reading after it with the gap
     if (adc_readings[cr].set) {
-      adc_read_index = cr+1;
-      if (adc_read_index == N_READINGS) adc_read_index = 0;
+      uint8_t cn = cr+1; if (cn == N_READINGS) cn = 0;
+      uint16_t lost = 1 + adc_readings[cr].gap + adc_readings[cn].gap;
+      adc_readings[cn].gap = (lost > 255) ? 255 : lost;
+      adc_read_index = cn;
       n_overflow++; // Check for overflow
     }
     
     // Initialize next reading
     adc_readings[cr].set = 0;
+    adc_readings[cr].gap = 0;
+#ifdef ADC_INTERLEAVE
+    // This voltage sample also opens the next reading
+    adc_readings[cr].vals[0] = val;
+#endif
     adc_write_index = cr;
   }
-
-  // Advance ADC pointer to next
-  ADMUX = (ADMUX & 0xf0) | (adc_chans[ichn]); // Point to next input channel
-  cur_chan = ichn;
 }
-
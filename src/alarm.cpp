@@ -0,0 +1,287 @@
+//   EMONTX3-CONTINUOUS - continuous sampling Arduino firmware
+//
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   Half-cycle overcurrent and residual current alarm
+//
+//   At every voltage zero crossing, either direction, accum_stats() calls
+//   check_alarm() before the per-cycle partial sums are folded.  The sum
+//   of squares of each present channel over the half cycle is the growth
+//   of its val2_sum since the previous call, so the accumulation kernels
+//   are not touched.  It is compared with an integer threshold, derived
+//   from ALARM_IMAX and ical[] when the present channels change, times
+//   the number of readings: no floating point in the reading path.
+//
+//   The residual current is the sum of the ALARM_RESID_CHAN channels, each
+//   scaled to the first one with an 8.8 fixed point gain, and it and its
+//   square are accumulated for every reading by accum_resid().  The check
+//   takes the sum of squares about the offset of the residual, followed
+//   over full cycles, so that the error of the zero points does not
+//   count; this takes a few floating point operations per half cycle.  A
+//   metering CT cannot resolve the 30 mA of a residual current device;
+//   this is meant for gross leakage or a wrongly wired neutral.  The
+//   channels are converted one after the other, and the skew gives a
+//   false residual of a few percent of the load current; keep them on
+//   adjacent inputs.  The residual of a half cycle is also within the
+//   quantization of a few readings: below about 10 ADU, a leakage of 0.9
+//   times the threshold may raise the alarm (host/alarmsim-res).
+//
+//   Each change of alarm state is queued as an event, and send_report()
+//   sends it on a line of its own ahead of the queued reports, as soon as
+//   the line in progress is complete:
+//     alrm:1,alch:3,alir:41.28,tsec:1234,tus:567890,   overcurrent on CT 3
+//     alrm:2,alir:0.912,tsec:1234,tus:587890,          residual current
+//     alrm:0,tsec:1235,tus:7890,                       all clear
+//   alir is the RMS current [A] of the half cycle, and tsec/tus the device
+//   time of the reading that completed it.  ALARM_PIN, if defined, is
+//   driven high while any alarm lasts.
+//
+//   Detection is bounded by the zero crossings: a fault is seen at the
+//   end of the half cycle it starts in, or of the next one if it starts
+//   late, so up to about 16 ms at 50 Hz.  The line may then wait for a
+//   full transmit buffer and for the readings queued behind calc_stats();
+//   host/alarmsim gives the worst case for the build (about 80 ms on the
+//   Mega at prescalar 64).
+//
+//   Built only with FAST_ALARM (see cont.h).
+//
+
+#include <Arduino.h>
+#include <Math.h>
+#include "inlineAVR201def.h"
+#include "cont.h"
+#include "cal.h"
+
+#ifdef FAST_ALARM
+
+// Largest sum of squares per reading, for offset-subtracted readings.  The
+// thresholds are capped to it, so that threshold times readings (at most
+// FOLD_READINGS) fits 32 bits.
+#define ALARM_MAX_SQ (1023UL*1023UL)
+
+// Overcurrent thresholds [ADU^2 per reading], and the partial sums and
+// readings at the start of the half cycle
+uint32_t alarm_thr[N_CUR_CHAN];
+uint32_t alarm_mark[N_CUR_CHAN];
+uint16_t alarm_nmark = 0;
+
+// Residual current: channels summed and their gains w.r.t. the first one
+uint8_t alarm_rlist[N_CUR_CHAN];
+int16_t alarm_rgain[N_CUR_CHAN];
+uint8_t alarm_nres = 0;
+uint32_t alarm_rthr = 0;   // [ADU^2 per reading] of the first channel
+int32_t alarm_rsum = 0;    // sum in this half cycle
+uint32_t alarm_rsum2 = 0;  // sum of squares in this half cycle
+int32_t alarm_rprev = 0;   // sum and readings in the half cycle before
+uint16_t alarm_rprevn = 0;
+// Offset of the residual [ADU].  The zero points are known to about an
+// ADU, and over half a cycle an offset that small adds a large part of a
+// residual threshold of a few ADU.  ALARM_DC_GAIN of the mean of each
+// full cycle is taken in.
+#define ALARM_DC_GAIN (1.0/16)
+float alarm_rdc = 0;
+uint16_t alarm_rn = 0;
+
+// Alarm state: channels in overcurrent, and residual current
+chanmask_t alarm_over = 0;
+uint8_t alarm_resid = 0;
+
+// Events waiting to be sent
+#define ALARM_CLEAR 0
+#define ALARM_OVER  1
+#define ALARM_RESID 2
+#define N_ALARM_EVENT 4
+struct alarm_event_struct {
+  uint8_t type;
+  uint8_t chan;     // current channel, for ALARM_OVER
+  uint16_t n;       // readings in the half cycle
+  uint32_t sum2;    // sum of squares in the half cycle
+  uint32_t t;       // [us] time of the reading that completed it
+};
+struct alarm_event_struct alarm_events[N_ALARM_EVENT];
+uint8_t alarm_read_index = 0;
+uint8_t alarm_write_index = 0;
+
+// init_alarm() - set up the alarm output pin
+void init_alarm(void)
+{
+#ifdef ALARM_PIN
+  pinMode(ALARM_PIN, OUTPUT);
+  digitalWrite(ALARM_PIN, LOW);
+#endif
+}
+
+// alarm_limit() - squared threshold in ADU of a channel
+//   amps - [A] RMS threshold
+//   cal - [A/ADU] calibration of the channel
+static uint32_t alarm_limit(float amps, float cal)
+{
+  float adu = amps / cal;
+  if (adu*adu >= ALARM_MAX_SQ) return ALARM_MAX_SQ;
+  return (uint32_t) (adu*adu);
+}
+
+// update_alarm_chans() - derive the thresholds and the residual channel
+//   list for the present channels
+//   mask - present current channels (bit j = current channel j)
+// The residual is checked only if all of its channels are present, as a
+// missing CT would look like a residual current.
+void update_alarm_chans(chanmask_t mask)
+{
+  uint8_t j;
+  float ref = 0;
+
+  for (j = 0; j<N_CUR_CHAN; j++) {
+    alarm_thr[j] = alarm_limit(ALARM_IMAX, pgm_read_float(&ical[j]));
+  }
+
+  alarm_nres = 0;
+  alarm_rsum = 0; alarm_rsum2 = 0; alarm_rn = 0;
+  alarm_rprev = 0; alarm_rprevn = 0; alarm_rdc = 0;
+  if (ALARM_RESID_CHAN == 0 || (mask & ALARM_RESID_CHAN) != ALARM_RESID_CHAN) return;
+  for (j = 0; j<N_CUR_CHAN; j++) {
+    if (!(ALARM_RESID_CHAN & ((chanmask_t) 1 << j))) continue;
+    if (alarm_nres == 0) ref = pgm_read_float(&ical[j]);
+    alarm_rlist[alarm_nres] = j;
+    alarm_rgain[alarm_nres] = lround(256.0 * pgm_read_float(&ical[j]) / ref);
+    alarm_nres ++;
+  }
+  alarm_rthr = alarm_limit(ALARM_IRES, ref);
+}
+
+// accum_resid() - accumulate the residual current of one reading
+//   vals - offset-subtracted values of the reading
+void accum_resid(const int16_t *vals)
+{
+  int32_t sum = 0;
+  int16_t r;
+  uint8_t k;
+  for (k = 0; k<alarm_nres; k++) {
+    sum += (int32_t) alarm_rgain[k] * vals[alarm_rlist[k]+1];
+  }
+  sum >>= 8;
+  r = (sum > 1023) ? 1023 : ((sum < -1023) ? -1023 : sum);
+  alarm_rsum += r;
+  mac16x16_32(alarm_rsum2, r, r);
+  alarm_rn ++;
+}
+
+// push_alarm() - queue an alarm event; dropped if the queue is full
+static void push_alarm(uint8_t type, uint8_t chan, uint16_t n, uint32_t sum2, uint32_t t)
+{
+  uint8_t next = (alarm_write_index + 1) % N_ALARM_EVENT;
+  struct alarm_event_struct *e = &(alarm_events[alarm_write_index]);
+  if (next == alarm_read_index) return;
+  e->type = type; e->chan = chan; e->n = n; e->sum2 = sum2; e->t = t;
+  alarm_write_index = next;
+}
+
+// check_alarm() - compare the half cycle that just ended with the
+//   thresholds, and start the next one
+//   t - [us] time of the reading that completed it
+//   nfold - readings in the partial sums
+// Called from accum_stats() at every zero crossing, before the partial
+// sums are folded (fold_alarm() follows a fold).
+void check_alarm(uint32_t t, uint16_t nfold)
+{
+  uint8_t j, resid;
+  uint16_t n = nfold - alarm_nmark;
+  chanmask_t over = 0;
+
+  for (j = 0; j<N_CUR_CHAN; j++) {
+    struct reading_stats *s = &(istats[j]);
+    if (!s->present) continue;
+    // A channel restarted in the middle of the half cycle has a smaller sum
+    if (s->val2_sum >= alarm_mark[j] &&
+        s->val2_sum - alarm_mark[j] > alarm_thr[j] * n) {
+      over |= (chanmask_t) 1 << j;
+      if (!(alarm_over & ((chanmask_t) 1 << j))) {
+        push_alarm(ALARM_OVER, j, n, s->val2_sum - alarm_mark[j], t);
+      }
+    }
+    alarm_mark[j] = s->val2_sum;
+  }
+  alarm_nmark = nfold;
+
+  if (alarm_nres && alarm_rn) {
+    // Sum of squares about the offset of the residual
+    float dc = alarm_rdc;
+    float sum2 = alarm_rsum2 - dc * (2*alarm_rsum - dc*alarm_rn);
+    resid = (sum2 > (float) alarm_rthr * alarm_rn);
+    if (resid && !alarm_resid) push_alarm(ALARM_RESID, 0, alarm_rn, (uint32_t) sum2, t);
+    // The offset follows the mean of the last full cycle, where the mains
+    // frequency cancels
+    dc = (float) (alarm_rsum + alarm_rprev) / (alarm_rn + alarm_rprevn);
+    alarm_rdc += (dc - alarm_rdc) * ALARM_DC_GAIN;
+    alarm_rprev = alarm_rsum; alarm_rprevn = alarm_rn;
+    alarm_rsum = 0; alarm_rsum2 = 0; alarm_rn = 0;
+  } else if (alarm_nres) {
+    resid = alarm_resid;
+  } else {
+    resid = 0;
+  }
+
+  if ((alarm_over || alarm_resid) && !(over || resid)) {
+    push_alarm(ALARM_CLEAR, 0, 0, 0, t);
+  }
+#ifdef ALARM_PIN
+  if ((over || resid) != (alarm_over || alarm_resid)) {
+    digitalWrite(ALARM_PIN, (over || resid) ? HIGH : LOW);
+  }
+#endif
+  alarm_over = over;
+  alarm_resid = resid;
+}
+
+// fold_alarm() - the partial sums were folded and start again from zero
+void fold_alarm(void)
+{
+  memset(alarm_mark,0,sizeof(alarm_mark));
+  alarm_nmark = 0;
+}
+
+// alarm_waiting() - is an alarm event waiting to be sent?
+uint8_t alarm_waiting(void)
+{
+  return alarm_read_index != alarm_write_index;
+}
+
+// send_alarm() - send the oldest alarm event, as a line of its own
+//   returns: 1 if an event is waiting (sent or not), 0 if none
+// Called by send_report() between two report lines.
+uint8_t send_alarm(void)
+{
+  struct alarm_event_struct *e = &(alarm_events[alarm_read_index]);
+  char buf[64];
+  uint8_t n = 0;
+  uint32_t sec, usec;
+
+  if (alarm_read_index == alarm_write_index) return 0;
+
+  memcpy_P(buf, PSTR("alrm:"), 5); n += 5;
+  n += fmt_uint32(buf+n, e->type);
+  if (e->type == ALARM_OVER) {
+    memcpy_P(buf+n, PSTR(",alch:"), 6); n += 6;
+    n += fmt_uint32(buf+n, e->chan);
+  }
+  if (e->type != ALARM_CLEAR) {
+    float cal = pgm_read_float(&ical[(e->type == ALARM_OVER) ? e->chan : alarm_rlist[0]]);
+    memcpy_P(buf+n, PSTR(",alir:"), 6); n += 6;
+    n += fmt_float(buf+n, cal * sqrt((float) e->sum2 / e->n), 3);
+  }
+  split_time(time64(e->t), &sec, &usec);
+  memcpy_P(buf+n, PSTR(",tsec:"), 6); n += 6;
+  n += fmt_uint32(buf+n, sec);
+  memcpy_P(buf+n, PSTR(",tus:"), 5); n += 5;
+  n += fmt_uint32(buf+n, usec);
+  memcpy_P(buf+n, PSTR(",\r\n"), 3); n += 3;
+
+  // Try again later if the serial port is busy
+  if (uart_room() < n) return 1;
+  uart_write(buf, n);
+  alarm_read_index = (alarm_read_index + 1) % N_ALARM_EVENT;
+  return 1;
+}
+
+#endif // FAST_ALARM
@@ -33,10 +33,23 @@
 // 22 is the default burden resistor in the emonTx3
 // ~1 is the correction factor with in-circuit usage
 #define ICAL (ICALFUDGE*2000.0*3.3/1024.0) // (2000 turns 3.3 Volt range over 1024 ADU) 
+#ifndef BOARD_MEGA
 #define ICAL0 (ICAL/22 *1.00000)   // [A/ADU] chan 0 in-circuit burden resistor 22 Ohm + cal factor
 #define ICAL1 (ICAL/22 *1.00000)   // chan 1
 #define ICAL2 (ICAL/22 *1.00000)   // chan 2
 #define ICAL3 (ICAL/120*1.00000)   // chan 3 has 120 Ohm burden resistor
+#define ICAL_CHANS {ICAL0, ICAL1, ICAL2, ICAL3}
+#else
+// Arduino Mega: burden resistor [Ohm] and cal factor of each input
+#define ICAL_MEGA(burden,cal) (ICAL/(burden)*(cal))
+#define ICAL_CHANS { \
+  ICAL_MEGA(22,1.00000), ICAL_MEGA(22,1.00000), ICAL_MEGA(22,1.00000), /* chan 0-2 */   \
+  ICAL_MEGA(22,1.00000), ICAL_MEGA(22,1.00000), ICAL_MEGA(22,1.00000), /* chan 3-5 */   \
+  ICAL_MEGA(22,1.00000), ICAL_MEGA(22,1.00000), ICAL_MEGA(22,1.00000), /* chan 6-8 */   \
+  ICAL_MEGA(22,1.00000), ICAL_MEGA(22,1.00000), ICAL_MEGA(22,1.00000), /* chan 9-11 */  \
+  ICAL_MEGA(22,1.00000), ICAL_MEGA(22,1.00000), ICAL_MEGA(22,1.00000)  /* chan 12-14 */ \
+}
+#endif
 
 // ======================================
 // Phase offset of the current [deg] w.r.t. voltage sample
@@ -47,6 +60,23 @@
 #define IPH1  (+0.00)  // [deg] chan 1
 #define IPH2  (+0.00)  // [deg] chan 2
 #define IPH3  (+0.00)  // [deg] chan 3
+#ifndef BOARD_MEGA
+#define IPH_CHANS {IPH0, IPH1, IPH2, IPH3}
+#else
+// Arduino Mega: [deg] chan 0-14
+#define IPH_CHANS { 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, \
+                    0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00 }
+#endif
 
+// ======================================
+// Utility meter pulse energy [Wh per pulse].  1.0 for a 1000 imp/kWh meter
+#define PULSE_WH (1.0)
 
-
+// ======================================
+// Crystal frequency error [ppm]: how much faster device time (tsec, tus)
+// runs than true time, before this correction.  Measure it against an
+// accurate clock, for example the NTP-synchronized host, over a day or
+// more: XTAL_PPM = 1e6 * (device seconds - host seconds) / host seconds.
+// The crystal of the emonTx is typically within +-50 ppm (4 sec/day); the
+// resonator of some Arduino boards is within +-0.5%.
+#define XTAL_PPM (0)
@@ -0,0 +1,146 @@
+//   EMONTX3-CONTINUOUS - continuous sampling Arduino firmware
+// 
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   Serial command interface
+//
+//   Commands are short text lines sent to the emonTx, terminated by a
+//   carriage return or line feed.  The parser is incremental: it is polled
+//   from loop() only when the ADC ring buffer is nearly empty, and
+//   consumes at most a few received characters on each call, so it never
+//   holds up sampling.  Received characters are buffered by the serial
+//   receive interrupt until then (see uart.cpp).
+//
+//   Commands (N is decimal, or hexadecimal with a 0x prefix):
+//     ?        report the current registers immediately
+//     vprd N   voltage report period [sec]
+//     pprd N   power report period [sec]
+//     eprd N   energy report period [sec]
+//     lprd N   pulse report period [sec]
+//     chan N   channels to notice, bit mask (bit 0 = CT channel 0)
+//     strm N   channels in the per-cycle stream, bit mask (0 = off)
+//     prof N   sampling profile (see cont.h), from the next window
+//     rawc N   channels in the raw reading stream, bit mask (bit 0 =
+//              voltage; 0 = off)
+//     rawd N   raw reading stream decimation: one reading sent per N
+//     dmdr 0   reset the peak demand register
+//   The periods are 1 to PERIOD_MAX (4294) seconds.
+//   Each command is answered with ack:N (the value set) or nak:0, once
+//   the report ring has room for the reply.  strm
+//   needs CYCLE_ANALYSIS, and rawc and rawd need RAW_STREAM (see cont.h).
+//
+
+#include <Arduino.h>
+#include <Math.h>
+#include "cont.h"
+#include "cal.h"
+
+// Maximum command length, and characters consumed per poll
+#define N_COMMAND 12
+#define COMMAND_CHARS_PER_POLL 4
+// Longest report period [sec] that fits in microseconds
+#define PERIOD_MAX (UINT32_MAX/SECS)
+
+char command_buf[N_COMMAND+1];
+uint8_t command_len = 0;
+uint8_t command_overrun = 0;
+uint8_t command_ready = 0;   // command_buf holds a command to execute
+
+// parse_number() - parse an unsigned decimal or 0x hexadecimal number
+//   s - string
+//   value - number upon return
+//   returns: 1 if a number was parsed; 0 otherwise
+static uint8_t parse_number(const char *s, uint32_t *value)
+{
+  uint8_t base = 10, ndigits = 0;
+  uint32_t v = 0;
+  while (*s == ' ') s++;
+  if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) { base = 16; s += 2; }
+  for (; *s; s++, ndigits++) {
+    uint8_t d;
+    if      (*s >= '0' && *s <= '9') d = *s - '0';
+    else if (base == 16 && *s >= 'a' && *s <= 'f') d = *s - 'a' + 10;
+    else if (base == 16 && *s >= 'A' && *s <= 'F') d = *s - 'A' + 10;
+    else return 0;
+    v = v*base + d;
+  }
+  *value = v;
+  return ndigits > 0;
+}
+
+// execute_command() - execute one complete command line
+static void execute_command(const char *cmd)
+{
+  uint32_t value = 0;
+  uint8_t ok = 0;
+
+  if (strcmp_P(cmd, PSTR("?")) == 0) {
+    query_registers();
+    return;
+  }
+  if (strlen(cmd) < 5 || cmd[4] != ' ' || !parse_number(cmd+5, &value)) {
+    push_report_int32("nak", 0, 0);
+    push_report_break();
+    return;
+  }
+
+  if (strncmp_P(cmd, PSTR("vprd"), 4) == 0 && value > 0 && value <= PERIOD_MAX) {
+    report_vrms_period = value * SECS; ok = 1;
+  } else if (strncmp_P(cmd, PSTR("pprd"), 4) == 0 && value > 0 && value <= PERIOD_MAX) {
+    report_pow_period = value * SECS; ok = 1;
+  } else if (strncmp_P(cmd, PSTR("eprd"), 4) == 0 && value > 0 && value <= PERIOD_MAX) {
+    report_energy_period = value * SECS; ok = 1;
+  } else if (strncmp_P(cmd, PSTR("lprd"), 4) == 0 && value > 0 && value <= PERIOD_MAX) {
+    report_pulse_period = value * SECS; ok = 1;
+  } else if (strncmp_P(cmd, PSTR("chan"), 4) == 0 && value < ((uint32_t) 1 << N_CUR_CHAN)) {
+    // Takes effect at the next window boundary, in update_inputs()
+    for (uint8_t j = 0; j<N_CUR_CHAN; j++) adc_notice_chan[j] = (value >> j) & 1;
+    ok = 1;
+  } else if (strncmp_P(cmd, PSTR("prof"), 4) == 0 && value < N_ADC_PROFILE) {
+    sample_profile_req = value; ok = 1;
+  } else if (strncmp_P(cmd, PSTR("dmdr"), 4) == 0 && value == 0) {
+    reset_demand_peak(); ok = 1;
+#ifdef CYCLE_ANALYSIS
+  } else if (strncmp_P(cmd, PSTR("strm"), 4) == 0 && value < ((uint32_t) 1 << N_CUR_CHAN)) {
+    stream_cycle_mask = value; ok = 1;
+#endif
+#ifdef RAW_STREAM
+  } else if (strncmp_P(cmd, PSTR("rawc"), 4) == 0 && value <= 0xffff) {
+    ok = set_raw_stream(value, raw_dec);
+  } else if (strncmp_P(cmd, PSTR("rawd"), 4) == 0 && value <= 0xff) {
+    ok = set_raw_stream(raw_mask, value);
+#endif
+  }
+
+  if (ok) push_report_uint32("ack", value, 0);
+  else    push_report_int32("nak", 0, 0);
+  push_report_break();
+}
+
+// poll_command() - consume received characters, and execute a command
+//   when a full line has arrived
+void poll_command(void)
+{
+  uint8_t i;
+  int16_t c;
+
+  // A complete command waits until the report ring has room for its reply
+  if (command_ready) {
+    if (!report_wait(REPORT_COMMAND)) return;
+    execute_command(command_buf);
+    command_ready = 0;
+    return;
+  }
+  for (i = 0; i<COMMAND_CHARS_PER_POLL && (c = uart_read()) >= 0; i++) {
+    if (c == '\r' || c == '\n') {
+      command_buf[command_len] = 0;
+      command_ready = (command_len > 0 && !command_overrun);
+      command_len = 0;
+      command_overrun = 0;
+      return; // At most one command per poll
+    }
+    if (command_len < N_COMMAND) command_buf[command_len++] = c;
+    else command_overrun = 1;  // Discard over-long lines
+  }
+}
@@ -14,12 +14,54 @@
 // environment (see cal.h)
 // #define DEBUG_CONT
 
+// ======================================
+// Board profile.  The standard emonTx3 (ATmega328p) has one voltage input
+// and four current transformer inputs.  On an ATmega2560 (Arduino Mega),
+// all 16 analog inputs are used: A0 is voltage and A1-A15 are current
+// transformers.  That profile is not selected from the target CPU: its
+// cycle budget rests on unmeasured estimates (see "Cycle budget" below),
+// so it is only built when BOARD_MEGA is defined here or on the compiler
+// command line.  Without it, a Mega runs the emonTx profile on A0-A4.
+// #define BOARD_MEGA
+
 // ======================================
 // ADC_NOTICE_CHAN: notice individual current transformer channels
 // If some channels are disconnected or meant to be ignored, then set
 // the corresponding value to zero in this array.
+#ifndef BOARD_MEGA
 //      Notice ADC Channel 0   1   2   3
 #define ADC_NOTICE_CHAN {  1,  1,  1,  1}  // 1=notice; 0=ignore
+#else
+//      Notice ADC Channel 0  1  2  3  4  5  6  7  8  9 10 11 12 13 14
+#define ADC_NOTICE_CHAN { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1}
+#endif
+
+// ======================================
+// THREE_PHASE: three-phase mode.  The voltage transformer measures leg 1;
+// each current transformer is assigned the leg it is clamped on, and its
+// power is computed against that leg's voltage, reconstructed from the
+// voltage history 1/3 cycle (leg 2) or 2/3 cycle (leg 3) back.  This
+// assumes a balanced supply with phase sequence 1-2-3.  The longer voltage
+// history does not fit the emonTx SRAM budget (see below), so this is for
+// the Mega.
+// #define THREE_PHASE
+#ifndef BOARD_MEGA
+//     Leg of CT channel 0  1  2  3
+#define CT_LEG            { 1, 2, 3, 1}  // 1, 2 or 3
+#else
+//     Leg of CT channel 0  1  2  3  4  5  6  7  8  9 10 11 12 13 14
+#define CT_LEG            { 1, 2, 3, 1, 2, 3, 1, 2, 3, 1, 2, 3, 1, 2, 3}
+#endif
+
+// ======================================
+// Current transformer hot-plug detection.  Noticed channels that are absent
+// at startup are watched in idle time; once a CT is plugged in, its zero
+// point is estimated and the channel is enabled at the next accumulation
+// window.  Present channels whose input collapses to the pull-down level
+// (unplugged CT) are retired the same way.
+#define HOTPLUG_NREADINGS 2000 // raw readings needed before enabling a channel
+#define HOTPLUG_MIN_ADU   64   // [ADU] raw level separating a connected CT from pull-down
+#define HOTPLUG_MAX_VAR   4.0  // [ADU^2] variance below which a channel is considered quiet
 
 // ======================================
 // ADC_PRESCALAR: This is the ADC clock prescalar.  For the emonTX which operates
@@ -40,11 +82,153 @@
 #define ADC_PRESCALAR 64      // 64 samples @ 60 Hz : 77   samples @ 50 Hz
 
 // Now you may ask, what if I go to even faster prescalars?  The answer is, 
-// probably not worth it.  First of all, we need more memory for ring buffer
-// samples.  Also, with an ADC clock of 500 kHz or higher, now we are getting
+// probably not worth it for continuous use.  The ring buffer covers less
+// time, and with an ADC clock of 500 kHz or higher, now we are getting
 // close to the really-not-recommended clock of 1000 kHz where the signal can
-// be distorted.  Also, WARNING, setting faster may lead to overflow in
-// stabilize_inputs().
+// be distorted.
+//
+// Sampling profiles.  The prescalar can also be switched at runtime with
+// the serial command "prof N"; the switch takes place at the next
+// accumulation window boundary, and every rate-dependent constant is then
+// derived again from the nominal reading period.  ADC_PRESCALAR above
+// selects the profile used at startup.
+//   Profile 0: prescalar 128 - lowest CPU load
+//   Profile 1: prescalar  64 - standard
+//   Profile 2: prescalar  32 - high-rate diagnostic captures, 500 kHz ADC
+//              clock.  Expect some ring buffer overflow while reports are
+//              computed (see _lost).
+#define N_ADC_PROFILE 3
+#define ADC_PRESCALAR_MIN 32  // fastest profile, which sizes buffers and budgets
+#if ADC_PRESCALAR == 128
+#define ADC_PROFILE 0
+#elif ADC_PRESCALAR == 64
+#define ADC_PROFILE 1
+#elif ADC_PRESCALAR == 32
+#define ADC_PROFILE 2
+#else
+#error "ADC_PRESCALAR must be 128, 64 or 32"
+#endif
+
+// ======================================
+// ADC_INTERLEAVE: interleaved sampling sequence.  Normally each reading
+// converts V,I1,I2,I3,I4 in turn, and the time offset of each current
+// sample from the voltage sample is corrected by rotating the power by the
+// phase angle it represents at the mains frequency.  That is exact only for
+// the fundamental; the power in the harmonics of a distorted load is
+// rotated by the wrong angle.  With ADC_INTERLEAVE the sequence is
+// V,I1,V,I2,V,I3,V,I4 and each current is multiplied by the mean of the
+// two voltage samples around it, which is aligned in time at every
+// frequency.  The cost is 2*N_CUR_CHAN conversions per reading instead of
+// N_ADC_CHAN (48 instead of 77 readings per 50 Hz cycle at prescalar 64).
+// Run host/seqsim to compare the two for a given load.
+// #define ADC_INTERLEAVE
+
+// ======================================
+// Utility meter pulse input.  Edges closer together than the debounce
+// time are ignored.  A pulse interval longer than PULSE_MAX_INTERVAL is
+// not used for a power estimate (15 minutes).
+#define PULSE_DEBOUNCE_US  110000UL  // [us] minimum time between pulses
+#define PULSE_MAX_INTERVAL 900       // [sec] longest usable pulse interval
+#define N_PULSE_RING 8               // edges buffered for record_pulse_count()
+#define PULSE_TICKS_PER_US (F_CPU/8000000UL)  // Timer1 ticks, see pulse.cpp
+
+// Device time calibration (see calibrate_clock() in adc.cpp): the reading
+// period is measured against Timer1 over CLOCK_CAL_PERIOD at startup and
+// after each profile switch.  A measured error above CLOCK_CAL_LIMIT is
+// ignored.  The crystal's own error is XTAL_PPM in cal.h.
+#define CLOCK_CAL_PERIOD (60*SECS)   // [us] length of the measurement
+#define CLOCK_CAL_LIMIT  1000        // [ppm] largest believable correction
+
+// ======================================
+// Serial port (uart.cpp).  Output is queued in a transmit buffer of
+// UART_TX_SIZE bytes and sent by interrupts, so reporting never waits for
+// the line.  Besides 115200, the baud rates 250000, 500000 and 1000000
+// divide the 16 MHz clock exactly and are supported by most USB serial
+// adapters; they let more be reported (see the per-cycle and raw streams).
+#define UART_BAUD 115200
+#ifndef BOARD_MEGA
+#define UART_TX_SIZE 128  // [bytes] transmit buffer, a power of 2 up to 256
+#else
+#define UART_TX_SIZE 256
+#endif
+#define UART_RX_SIZE 16   // [bytes] receive buffer, a power of 2
+
+// ======================================
+// Raw reading stream (raw.cpp).  For diagnosis, the ADC readings
+// themselves are streamed as compact binary frames, alongside the normal
+// processing.  The frames are built in the serial transmit buffer, so the
+// stream needs little SRAM.  RAW_STREAM_CHAN is a bit mask of the channels to stream,
+// bit 0 = voltage, bit j = CT channel j-1; 0 disables the stream.  Every
+// RAW_STREAM_DEC'th reading is sent.  Both can be changed with the serial
+// commands "rawc N" and "rawd N".  All five channels at prescalar 64 take
+// about 28 kB/s, so set UART_BAUD to 1000000 (see README for the rates).
+#define RAW_STREAM
+#define RAW_STREAM_CHAN 0x00
+#define RAW_STREAM_DEC  1
+#define RAW_FRAME_SIZE  64  // [bytes] largest frame; at most UART_TX_SIZE/2
+
+// ======================================
+// Fast alarm (alarm.cpp).  The RMS current of every present channel is
+// checked over each half mains cycle against ALARM_IMAX, and the sum of
+// the ALARM_RESID_CHAN channels (phase and neutral CTs, bit j = CT channel
+// j; 0 disables it) against ALARM_IRES.  A change of alarm state is sent
+// at once on a line of its own, ahead of the queued reports, and
+// ALARM_PIN (if defined) is driven high while an alarm lasts.  A fault
+// is detected up to 16 ms after it starts (50 Hz), and the line goes out
+// up to about 80 ms after it on the Mega (host/alarmsim).
+// The emonTx is deliberately left out: the alarm needs SRAM_ALARM, about
+// 120 bytes there, and the budget below leaves about 80, so defining
+// FAST_ALARM for the emonTx stops the build in mem.cpp.  Use a Mega to
+// watch a subpanel.
+#ifdef BOARD_MEGA
+#define FAST_ALARM
+#endif
+#define ALARM_IMAX (32.0)      // [A] half-cycle RMS overcurrent threshold
+#ifndef ALARM_RESID_CHAN       // (host/alarmsim-res sets it)
+#define ALARM_RESID_CHAN 0x00  // CT channels whose currents sum to zero
+#endif
+#define ALARM_IRES (3.0)       // [A] half-cycle RMS residual current threshold,
+                               // at least 10 ADU (3 A with a 22 Ohm burden)
+//#define ALARM_PIN 5          // digital pin driven high during an alarm
+#ifdef FAST_ALARM
+// [bytes] variables of alarm.cpp: 11 per channel, the alarm mask, and the
+// event ring and residual sums
+#define SRAM_ALARM (11*N_CUR_CHAN + (N_CUR_CHAN > 8 ? 2 : 1) + 78)
+#else
+#define SRAM_ALARM 0
+#endif
+
+// ======================================
+// SRAM budget (mem.cpp).  mem.cpp checks at compile time that the ring
+// buffers (ADC readings, voltage history, reports and serial), plus
+// SRAM_ALARM for the fast alarm, plus SRAM_OTHER for all other variables
+// including the Arduino core, plus SRAM_STACK for the stack and
+// interrupts, fit in SRAM_BYTES.  Any margin left can go into deeper
+// rings.  The stack actually used and the SRAM never touched are
+// reported as _stkh and _memf; if _memf falls near zero, SRAM_STACK is
+// too small.
+//   emonTx: rings 608 bytes, other variables ~1137 estimated (THREE_PHASE:
+//           rings 836, which does not fit; use the Mega)
+//   Mega:   rings 2234 bytes, fast alarm 245, other variables ~2900 estimated
+// The ring sizes are derived from the sampling rate further below.
+// SRAM_OTHER covers the other features enabled below.
+// ESTIMATE: both values are added up by hand from the declared sizes of
+// the variables, not taken from a link, as no avr-gcc was at hand to
+// build the firmware.  The Arduino core's variables and anything else the
+// linker adds are guessed, not counted.  To replace them with measured values: build each board
+// (Arduino IDE or arduino-cli, with BOARD_MEGA for the Mega), run
+// "make -C host sramcheck ELF=..." on the ELF, and set SRAM_OTHER to the
+// "other variables" it prints, which are .data+.bss less the rings and
+// SRAM_ALARM; then drop this note.  Check again whenever variables are
+// added.
+#ifndef BOARD_MEGA
+#define SRAM_BYTES 2048
+#define SRAM_OTHER 1139  // [bytes] ESTIMATE, see above
+#else
+#define SRAM_BYTES 8192
+#define SRAM_OTHER 2916  // [bytes] ESTIMATE, see above
+#endif
+#define SRAM_STACK 256   // [bytes] reserve for the stack
 
 // ======================================
 // DIP switch that selects mains voltage
@@ -52,6 +236,8 @@
 
 // ==============================================
 // Reporting frequency.  Normally we report less frequently...
+// These are the defaults; the periods can be changed at runtime with
+// serial commands (see command.cpp).
 #define SECS (1000000)
 #ifndef DEBUG_CONT
 #define REPORT_VRMS_PERIOD (10*SECS)    // [us] report voltage every 10 sec
@@ -65,9 +251,37 @@
 #define REPORT_ENERGY_PERIOD (1*SECS)  // [us] 
 #define REPORT_PULSE_PERIOD (1*SECS)   // [us] 
 #endif
+// Accumulation window.  Statistics are accumulated over this duration
+// before calc_stats() runs.  The wide accumulators allow up to 60 sec.
+#ifndef DEBUG_CONT
+#define ACCUM_PERIOD (10*SECS)          // [us] accumulate for 10 sec
+#else
+#define ACCUM_PERIOD (1*SECS)           // [us] accumulate for 1 sec
+#endif
+// Demand intervals, such as used by a demand tariff.  Energy per interval
+// and the peak rolling demand are reported at the close of each interval.
+#define DEMAND_INTERVAL (15*60)         // [sec] demand interval
+#define DEMAND_NBLOCK   15              // blocks per interval, dividing DEMAND_INTERVAL
+// Per-mains-cycle analysis (cycle.cpp): appliance events, the per-cycle
+// power distribution (pmn/pmx/pme) and the per-cycle stream.
+#define CYCLE_ANALYSIS
+// Appliance step change events, detected per channel on every mains cycle
+#define EVENT_DP      (30.0)  // [W] minimum active power step
+#define EVENT_DQ      (30.0)  // [VAR] minimum reactive power step
+#define EVENT_SETTLE  (10.0)  // [W] cycle-to-cycle change regarded as settled
+#define EVENT_NSETTLE 6       // consecutive settled cycles to end a step
+#define EVENT_MAXCYC  300     // [cycles] end a step that never settles
+#define EVENT_TRACK   (0.02)  // fraction of drift followed per steady cycle
+// Per-mains-cycle stream.  For short-term studies, active power (and
+// optionally RMS current) is reported for every mains cycle of the
+// selected channels, one line per cycle.  Bit mask, bit 0 = CT channel 0;
+// 0 disables the stream.  Example: 0x0f streams all four channels.
+#define STREAM_CYCLE_CHAN 0x00
+#define STREAM_CYCLE_IRMS 0           // 1 = also stream RMS current per cycle
 #define REPORT_POW_ILIMIT  (1.1)        // [Amp] report power/current when current changes by this much
 #define MIN_POWER 30.0                  // [Watt] Minimum power needed to computer power factor
 #define STABILIZE_DURATION (10*SECS)    // [us] time to wait for mains voltages to stabilize (10 sec)
+#define SCAN_DURATION (1*SECS)          // [us] time to scan for inputs present (1 sec)
 
 // State machine definitions
 #define STATE_STAB 0 // Stabilize inputs
@@ -78,67 +292,299 @@
 #define STATE_STAT 5 // Accumulate stats
 #define STATE_CALS 6 // Calculate statistics
 
-// ADC Input channels to process.  Can't just change this because it appears
-// in other places such as adc.cpp.
+// ADC Input channels to process.  Set by the board profile; the ADC pin
+// of each channel is listed in adc_chans[] in adc.cpp.
 //   Channel 0 is voltage (required)
-//   Channel 1-4 are current transformer (optional)
+//   Channel 1-4 (Mega: 1-15) are current transformer (optional)
+#ifndef BOARD_MEGA
 #define N_ADC_CHAN 5
+#else
+#define N_ADC_CHAN 16
+#endif
 #define N_CUR_CHAN (N_ADC_CHAN-1)
-extern const uint8_t adc_chans[N_ADC_CHAN];
+// Bit mask with one bit per channel
+#if N_ADC_CHAN > 8
+typedef uint16_t chanmask_t;
+#else
+typedef uint8_t chanmask_t;
+#endif
+extern const uint8_t adc_chans[N_ADC_CHAN];  // PROGMEM
+extern uint8_t adc_chan_offset[N_CUR_CHAN];
+extern uint8_t adc_notice_chan[N_CUR_CHAN];
 extern volatile uint16_t n_overflow;
 
-// Size of ADC readings ring buffer
-// This buffer must be able to accomodate all ADC readings stored by the 
-// ISR for the worst case processing load.  This value of 16 can accomodate 
-// an ADC prescalar of 64 ("overclocking" the ADC clock).
-//   Max usage at prescalar 128 ~  8
-//   Max usage at prescalar  64 ~ 12
-#define N_READINGS 16
-// ADC readings consist of the N_ADC_CHAN values read, plus the time
+// Conversions per reading, and values per reading.  The interleaved
+// sequence stores the voltage sample that follows current channel j in
+// vals[VAFTER_SLOT(j)]; vals[0] is the one preceding current channel 0.
+#ifdef ADC_INTERLEAVE
+#define ADC_NCONV (2*N_CUR_CHAN)
+#define ADC_NVALS (N_ADC_CHAN+N_CUR_CHAN)
+#else
+#define ADC_NCONV N_ADC_CHAN
+#define ADC_NVALS N_ADC_CHAN
+#endif
+#define VAFTER_SLOT(j) (N_ADC_CHAN+(j))
+// ADC readings consist of the ADC_NVALS values read, plus the time
+// (microseconds, counted from the ADC conversion clock).  When the ring
+// buffer overflows, the oldest readings are dropped and the reading that
+// follows them records how many were lost in gap (saturates at 255).
 struct adc_readings_struct {
-  int16_t vals[N_ADC_CHAN];
+  int16_t vals[ADC_NVALS];
   uint32_t t;
   uint8_t set;
+  uint8_t gap;
+};
+
+// 40-bit signed accumulator: 32-bit low part plus 8-bit high part
+struct sum40 {
+  uint32_t lo;
+  int8_t   hi;
 };
+// add40() - add a 32-bit value to a 40-bit accumulator
+static inline void add40(struct sum40 *a, int32_t x)
+{
+  uint32_t lo = a->lo + (uint32_t) x;
+  a->hi += (x < 0 ? -1 : 0) + (lo < a->lo ? 1 : 0);
+  a->lo = lo;
+}
+// float40() - value of a 40-bit accumulator
+static inline float float40(const struct sum40 *a)
+{
+  return (float) a->hi * 4294967296.0 + (float) a->lo;
+}
 
 // Where we store and accumulate all the interesting readings for each
 // ADC input channel.
+//
+// The products are accumulated per mains cycle in the 32-bit *_sum
+// fields (fast mac16x16_32), and folded at every zero crossing into the
+// 40-bit *_acc fields which cover the whole accumulation window.
+// Overflow bounds, for offset-subtracted readings |val| <= 1023:
+//   one product        |val*val| < 2^20
+//   per-cycle sums     at most FOLD_READINGS = 2^11 readings  -> < 2^31
+//   window sums        at most 2^19 readings                  -> < 2^39
+//   val_sum            2^19 readings * 1023                   -> < 2^29
+// For the current channels, accum_stats() counts readings only in vstats.n.
 struct reading_stats {
   uint8_t present;
-  uint16_t n;
+  uint32_t n;
   int16_t  val, oldval;
-  int32_t  wt_sum;
   int32_t  val_sum;
   uint32_t val2_sum;
   int16_t  val_min, val_max;
   int32_t  prod_sum, proddel_sum;
+  struct sum40 val2_acc, prod_acc, proddel_acc;
   float val_rms, pow_ac, pow_re;
 };
+// Maximum readings in a per-cycle partial sum before it must be folded
+#define FOLD_READINGS 2048
 // Accumulated stats for voltage and current channels
 extern struct reading_stats vstats, istats[N_CUR_CHAN];
+extern float iavg_ra[N_CUR_CHAN];
+extern float vavg_ra;
+extern float VCAL;
+extern const float ical[N_CUR_CHAN];  // PROGMEM
+extern float cosph[N_CUR_CHAN], sinph[N_CUR_CHAN];
+
+// ======================================
+// Derived configuration.  Everything that depends on the sampling rate is
+// computed here from F_CPU, the ADC prescalars and the channel count, and
+// the build stops when a combination cannot keep up or does not fit.
+
+// adc_reading_rate() - [readings/sec] for a prescalar
+constexpr uint32_t adc_reading_rate(uint32_t prescalar)
+{
+  return F_CPU/(13UL*prescalar*ADC_NCONV);
+}
+// Readings per second, for the fastest sampling profile
+constexpr uint32_t ADC_READING_RATE = adc_reading_rate(ADC_PRESCALAR_MIN);
+// Fastest profile meant for continuous use: the standard profile, or
+// ADC_PRESCALAR if that is faster.  The diagnostic profile is allowed to
+// overflow the ring while reports are computed.
+#define ADC_PRESCALAR_CONT (ADC_PRESCALAR < 64 ? ADC_PRESCALAR : 64)
+
+static_assert(ACCUM_PERIOD/SECS * ADC_READING_RATE < 524288UL,
+              "ACCUM_PERIOD is too long for the 40-bit accumulators");
+
+// Cycle budget per reading: the interrupt handler for every conversion,
+// plus accum_stats() for the voltage and each current channel.  At least
+// a quarter of the CPU must be left over for calc_stats(), reporting and
+// idle-time work.  The interleaved sequence also interpolates the voltage
+// and its quadrature for every channel.
+//
+// UNMEASURED: all of the cycle counts below are estimates read off the C
+// code (the ISR in adc.cpp, the accumulation kernels in state.cpp), not
+// counted from avr-objdump output or a simulator, as no AVR toolchain was
+// at hand.  The emonTx profile is well inside the budget either way; the
+// Mega profile, with three times the channels per reading, is not, and
+// stays opt-in (BOARD_MEGA above) until they are counted.  To count them,
+// disassemble a build with avr-objdump -d and add up the cycles of the
+// ADC_vect path per conversion and per completed reading, and of
+// accum_stats() with the kernel for one and for all channels; or time
+// the same with a spare pin and an oscilloscope.  host/seqsim uses them
+// too.
+#define ISR_CONV_CYCLES    110  // per conversion
+#define ACCUM_BASE_CYCLES  250  // voltage, history and zero crossing
+#define ISR_READING_CYCLES_PLAIN       65  // extra, for the conversion completing a reading
+#define ISR_READING_CYCLES_INTERLEAVE  75
+#define ACCUM_CHAN_CYCLES_PLAIN       110  // per present current channel
+#define ACCUM_CHAN_CYCLES_INTERLEAVE  210
+#ifdef ADC_INTERLEAVE
+#define ISR_READING_CYCLES ISR_READING_CYCLES_INTERLEAVE
+#define ACCUM_CHAN_CYCLES  ACCUM_CHAN_CYCLES_INTERLEAVE
+#else
+#define ISR_READING_CYCLES ISR_READING_CYCLES_PLAIN
+#define ACCUM_CHAN_CYCLES  ACCUM_CHAN_CYCLES_PLAIN
+#endif
+// The residual current of the fast alarm, per channel summed
+#define ALARM_RESID_CYCLES  35
+// Longest stretch without taking readings from the ring: calc_stats() and
+// the reports it queues at the end of a window.  These two are guesses,
+// UNMEASURED like the rest: with four channels they give a ring depth of 14
+// readings at prescalar 64, above the 12 that the original firmware was
+// seen to reach (see README).  calc_stats() has grown since; check them
+// against the _adcd diagnostic, which reports the deepest the ring got.
+#define CALC_BASE_CYCLES 10000
+#define CALC_CHAN_CYCLES  8000  // per current channel
+
+constexpr uint32_t READING_CYCLES = F_CPU/ADC_READING_RATE;
+constexpr uint32_t ISR_CYCLES = ISR_CONV_CYCLES*ADC_NCONV + ISR_READING_CYCLES;
+// chan_count() - number of channels in a bit mask
+constexpr uint8_t chan_count(uint32_t mask)
+{
+  return mask ? (mask & 1) + chan_count(mask >> 1) : 0;
+}
+#ifdef FAST_ALARM
+constexpr uint32_t ALARM_CYCLES = ALARM_RESID_CYCLES*chan_count(ALARM_RESID_CHAN);
+#else
+constexpr uint32_t ALARM_CYCLES = 0;
+#endif
+constexpr uint32_t READING_LOAD_CYCLES = ISR_CYCLES + ACCUM_BASE_CYCLES +
+                                         ACCUM_CHAN_CYCLES*N_CUR_CHAN + ALARM_CYCLES;
+static_assert(4*READING_LOAD_CYCLES <= 3*READING_CYCLES,
+              "ADC sampling rate is too high for the number of channels");
+
+// Margin on the estimated processing stall, in percent.  CALC_BASE_CYCLES
+// and CALC_CHAN_CYCLES are unmeasured (see above), so the ring is sized for
+// a stall this much longer than they give.  The figure is a margin, chosen
+// rather than derived: it gives the depths the original firmware had, 16
+// readings on the emonTx and 48 on the Mega, where SRAM is to spare.
+// Measure calc_stats() (or watch _adcd) before lowering it.
+#ifndef BOARD_MEGA
+#define ADC_RING_MARGIN 15   // [%]
+#else
+#define ADC_RING_MARGIN 300  // [%]
+#endif
 
-// Size of voltage history ring buffer.
-//   For ADC prescalar of 128, this needs to be at least  9 for 60 Hz, 11 for 50 Hz
-//   For ADC prescalar of  64, this needs to be at least 18 for 60 Hz, 21 for 50 Hz
-#define N_VHIST_RING 24
-
-// Size of ring buffer for data reports.  These are the actual voltage, power current, 
-// and metadata reports that go out via Serial.  Maximum number of reports per second
-// are Voltage: vrms, vcrs, vfrq
-//     Power  : 4x(pac_, pre_, pow_, irm_)
-//     Pulse samples: pulse
-//     Metadata: _evers, _adcd, _novr, _uptm, <break>
-// Total of 26
-#define N_REPORT 31
+// adc_ring_depth() - readings that pile up in the ring while calc_stats()
+//   runs at a prescalar, with the interrupt handler taking its share of
+//   the CPU, plus the reading being converted and the one being processed
+constexpr uint32_t adc_ring_depth(uint32_t prescalar)
+{
+  return ((CALC_BASE_CYCLES + CALC_CHAN_CYCLES*N_CUR_CHAN)*(100 + ADC_RING_MARGIN)/100 +
+          13*prescalar*ADC_NCONV - ISR_CYCLES - 1) /
+         (13*prescalar*ADC_NCONV - ISR_CYCLES) + 2;
+}
+
+// Size of ADC readings ring buffer.  It must hold all readings stored by
+// the ISR during the longest processing stall, with ADC_RING_MARGIN, at the
+// fastest profile meant for continuous use.
+static_assert(adc_ring_depth(ADC_PRESCALAR_CONT) < 128,
+              "ADC ring depth must stay below 128 (see get_adc_depth()); "
+              "it is derived from the unmeasured CALC_BASE_CYCLES and CALC_CHAN_CYCLES");
+constexpr uint8_t N_READINGS = adc_ring_depth(ADC_PRESCALAR_CONT);
+
+// Size of voltage history ring buffer.  It must reach back the longest
+// lookback at the lowest mains frequency and the fastest sampling profile:
+// a quarter cycle, or in THREE_PHASE mode 2/3+1/4 = 11/12 cycle, plus one
+// entry to interpolate and the newest one.  None of this rests on the
+// cycle estimates; the reading rate is exact for a given F_CPU.  The
+// margin is in MAINS_FREQ_MIN: 45 Hz is 10% below the lowest nominal
+// frequency, which covers the mains deviating (a few tenths of a Hz) and
+// the crystal running fast (well under 1%).
+#define MAINS_FREQ_MIN 45  // [Hz] lowest supported mains frequency, with margin
+#ifdef THREE_PHASE
+#define VHIST_TWELFTHS 11  // longest lookback [1/12 cycle]
+#else
+#define VHIST_TWELFTHS 3
+#endif
+constexpr uint8_t N_VHIST_RING = ADC_READING_RATE*VHIST_TWELFTHS/(12*MAINS_FREQ_MIN) + 2;
+static_assert(ADC_READING_RATE*VHIST_TWELFTHS/(12*MAINS_FREQ_MIN) + 2 <= 255,
+              "voltage history too long for its 8-bit index");
+// The ring of readings is drained and the voltage history refilled after
+// a profile switch or at startup, counted in 8 bits (rate_settle, nclear)
+static_assert(N_READINGS + N_VHIST_RING <= 255,
+              "N_READINGS + N_VHIST_RING must fit the 8-bit settle counters");
+
+// Input scan at startup: readings are counted in 16 bits, and summed per
+// channel in 32 bits
+static_assert(ADC_READING_RATE * (SCAN_DURATION/SECS) < 65536UL &&
+              ADC_READING_RATE * (SCAN_DURATION/SECS) * 1023 < 2147483648UL,
+              "SCAN_DURATION holds too many readings");
+
+// Size of ring buffer for data reports.  Each line of reports is queued
+// only when the ring has room for all of it (report_wait()); until then
+// it waits and is tried again from loop(), and the per-cycle stream is
+// held back.  So the ring needs to hold only the longest line, and the
+// window's results go out as a voltage line and then one line per channel:
+//   Voltage: vrms, vfrq, vcrs; three-phase 3x vlgN, p3ac, p3re, p3ap;
+//     tsec, tus, <break>
+//   Power, per channel: irmN, pacN, preN, powN, ipkN, icfN, tsec, tus, <break>
+//   Metadata: _vdel (once), _imsk and _prof (when changed), _enac, _enre,
+//     _adcd, _novr, _lost, _uptm, _stkh, _memf, tsec, tus, <break>
+//   Demand (at interval close): dmtm, dmeN, dmet, _dmpk, _dmpt, tsec, tus, <break>
+//   Pulse: pulse, plav, plsp, plmn, plmx, tsec, tus, <break>
+//   CYCLE_ANALYSIS distribution, per channel: pmnN, pmxN, pmeN, tsec, tus, <break>
+//   CYCLE_ANALYSIS event: evch, evdp, evdq, evst, tsec, tus, <break>
+//   CYCLE_ANALYSIS stream: cs, per channel cpN (and ciN), <break>
+//   Query reply: vrms, _enac, _enre, _uptm, tsec, tus, <break>; then per
+//     channel irmN, pacN, preN, tsec, tus, <break>
+//   Command reply: ack or nak, <break>
+// One entry of the ring always stays empty.
+#ifdef THREE_PHASE
+#define REPORT_THREE_PHASE 6
+#else
+#define REPORT_THREE_PHASE 0
+#endif
+#define REPORT_VOLTAGE (3 + REPORT_THREE_PHASE + 3)
+#define REPORT_CHAN    9
+#define REPORT_META    14
+#define REPORT_DEMAND  (7 + N_CUR_CHAN)
+#define REPORT_PULSE   8
+#define REPORT_DIST    6
+#define REPORT_EVENT   7
+#define REPORT_STREAM  (2 + (1 + STREAM_CYCLE_IRMS)*N_CUR_CHAN)
+#define REPORT_QUERY   7
+#define REPORT_COMMAND 2
+constexpr uint16_t report_max(uint16_t a, uint16_t b) { return (a > b) ? a : b; }
+constexpr uint16_t REPORT_LINE =
+  report_max(report_max(report_max(REPORT_VOLTAGE, REPORT_CHAN), REPORT_META),
+             report_max(report_max(REPORT_DEMAND, REPORT_PULSE),
+                        report_max(REPORT_DIST, REPORT_EVENT)));
+static_assert(REPORT_LINE < 255, "report line too long for the 8-bit ring index");
+#ifdef CYCLE_ANALYSIS
+constexpr uint8_t N_REPORT = report_max(REPORT_LINE, REPORT_STREAM) + 1;
+#else
+constexpr uint8_t N_REPORT = REPORT_LINE + 1;
+#endif
+
+// Report entry types
 #define VOID_TYPE 0
 #define BREAK_TYPE 1
 #define FLOAT_TYPE 2
 #define INT32_TYPE 3
 #define UINT32_TYPE 4
+// A report entry is 8 bytes: the name stays in flash, and a channel number
+// is stored rather than spelled out.  format holds the type (bits 0-2),
+// the float digits (bits 3-6) and the retained flag (bit 7).
+#define REPORT_NOCHAN 0xff
+#define REPORT_TYPE_MASK 0x07
+#define REPORT_DIGITS_SHIFT 3
+#define REPORT_RETAINED 0x80
 struct report_struct {
-  char name[6];
-  uint8_t type;
-  uint8_t digits;
+  const char *name;  // name in flash, or the prefix of a channel's name
+  uint8_t chan;      // channel number appended to the name, or REPORT_NOCHAN
+  uint8_t format;
   union {
     float floatval;
     int32_t int32val;
@@ -150,12 +596,22 @@ struct report_struct {
 // Forward function definitions ======================
 // adc.cc
 void set_adc_offset(uint8_t chan, int16_t offset);
+void reset_adc_offset(uint8_t chan);
+int16_t get_adc_offset(uint8_t chan);
 extern uint8_t get_adc_depth(void);
-extern void init_adc(uint8_t prescalar);
+extern void init_adc(uint8_t profile);
+extern void set_adc_profile(uint8_t profile);
+extern uint8_t get_adc_profile(void);
 extern void init_adc_chans(void);
 extern void disable_adc_chan(uint8_t chan);
 extern uint8_t get_next_adc_reading(struct adc_readings_struct *data);
+extern uint64_t get_time_us(void);
+extern uint64_t time64(uint32_t t);
+extern uint32_t get_time_sec(void);
+extern void split_time(uint64_t t, uint32_t *sec, uint32_t *usec);
+extern uint16_t adc_reading_usec;
 extern void reset_overflow(void);
+extern void calibrate_clock(void);
 
 // state.cc
 extern void init_cal(void);
@@ -173,13 +629,77 @@ extern uint8_t accum_stats(struct adc_readings_struct *reading, uint32_t tdur,
                       uint8_t curstate, uint8_t nextstate);
 uint8_t calc_stats(struct adc_readings_struct *reading,
                    uint8_t curstate, uint8_t nextstate);
+extern chanmask_t update_present_chans(void);
+extern void query_registers(void);
+extern void queue_reports(void);
+extern uint8_t sample_profile_req;
+
+// cycle
+void snap_cycle(uint32_t t, uint16_t n);
+void process_cycle(void);
+void report_cycle_dist(uint64_t t);
+extern uint8_t cycle_dist_chan;
+
+// command
+void poll_command(void);
+extern uint32_t report_vrms_period, report_pow_period, report_energy_period;
+extern uint32_t report_pulse_period;
+extern chanmask_t stream_cycle_mask;
+uint8_t set_raw_stream(uint16_t mask, uint8_t dec);
+
+// demand
+void record_demand(uint64_t t, uint32_t dur, const float *pow_en);
+void reset_demand_peak(void);
+void report_demand(void);
+
+// monitor
+void monitor_inputs(struct adc_readings_struct *reading);
+uint8_t update_inputs(void);
                    
+// raw
+extern uint16_t raw_mask;
+extern uint8_t raw_dec;
+void stream_raw(const struct adc_readings_struct *reading);
+void raw_flush(void);
+
+// alarm
+void init_alarm(void);
+void update_alarm_chans(chanmask_t mask);
+void accum_resid(const int16_t *vals);
+void check_alarm(uint32_t t, uint16_t nfold);
+void fold_alarm(void);
+uint8_t alarm_waiting(void);
+uint8_t send_alarm(void);
+extern uint8_t alarm_nres;
+
+// mem
+uint16_t stack_high_water(void);
+uint16_t stack_free(void);
+
 // report
-extern void push_report_float(const char name[5], float value, uint8_t digits, uint8_t retained);
-extern void push_report_int32(const char name[5], int32_t value, uint8_t retained);
-extern void push_report_uint32(const char name[5], uint32_t value, uint8_t retained);
+extern void push_report_float_P(PGM_P name, uint8_t chan, float value, uint8_t digits, uint8_t retained);
+extern void push_report_int32_P(PGM_P name, uint8_t chan, int32_t value, uint8_t retained);
+extern void push_report_uint32_P(PGM_P name, uint8_t chan, uint32_t value, uint8_t retained);
 extern void push_report_break(void);
+extern void push_report_time(uint64_t t);
+extern uint8_t report_room(void);
+extern uint8_t report_wait(uint8_t n);
+extern uint8_t report_waiting(void);
+extern uint8_t report_held;
 extern void send_report(void);
+// Report names are string literals, placed in flash by these macros: up
+// to 5 characters, or for the chan forms a prefix of up to 3 characters
+// followed by the channel number j (0-99)
+#define push_report_float(name, value, digits, retained) \
+  push_report_float_P(PSTR(name), REPORT_NOCHAN, value, digits, retained)
+#define push_report_int32(name, value, retained) \
+  push_report_int32_P(PSTR(name), REPORT_NOCHAN, value, retained)
+#define push_report_uint32(name, value, retained) \
+  push_report_uint32_P(PSTR(name), REPORT_NOCHAN, value, retained)
+#define push_chan_float(prefix, j, value, digits, retained) \
+  push_report_float_P(PSTR(prefix), j, value, digits, retained)
+#define push_chan_int32(prefix, j, value, retained) \
+  push_report_int32_P(PSTR(prefix), j, value, retained)
                       
 // main
 extern uint8_t max_adc_depth;
@@ -188,10 +708,31 @@ extern uint32_t vmains_period;
 extern float vmains_fprod;
 
 // pulse
+extern volatile uint16_t pulse_timer_hi;
 void init_pulse(void);
+uint8_t get_pulse_time(uint32_t *t, uint8_t *gap);
 void record_pulse_count(void);
 void report_pulse_count(void);
 
+// uart
+void init_uart(void);
+uint8_t uart_room(void);
+uint8_t uart_write(const char *buf, uint8_t n);
+uint8_t uart_hold(uint8_t n);
+void uart_release(uint8_t n);
+extern uint8_t uart_tx_buf[UART_TX_SIZE];
+extern volatile uint8_t uart_tx_head;
+int16_t uart_read(void);
+uint8_t fmt_uint32(char *buf, uint32_t value);
+uint8_t fmt_int32(char *buf, int32_t value);
+uint8_t fmt_float(char *buf, float value, uint8_t digits);
+void uart_print_P(PGM_P s);
+void uart_println_P(PGM_P s);
+#define uart_print(s) uart_print_P(PSTR(s))
+#define uart_println(s) uart_println_P(PSTR(s))
+void uart_print_int(int32_t value);
+void uart_print_uint(uint32_t value);
+
 // ======================================
 // If we are not using the external library definition of mac16x16_32 for
 // fast multiply+accumulate, we define it here as a slower version
@@ -201,8 +742,8 @@ void report_pulse_count(void);
   
                       
 // ======================================
-// Running average constants.  Since averages are done every second, this
-// is equivalent to 1/RA_CUR [seconds] ~ 100 sec time constant.
-#define RA_PAST (0.99)
-#define RA_CUR  (1.0 - RA_PAST)
+// Running average constants.  Averages are updated once per accumulation
+// window, so this is equivalent to a ~100 sec time constant.
+#define RA_CUR  ((float) ACCUM_PERIOD / (100.0*SECS))
+#define RA_PAST (1.0 - RA_CUR)
 
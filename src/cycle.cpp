@@ -0,0 +1,273 @@
+//   EMONTX3-CONTINUOUS - continuous sampling Arduino firmware
+// 
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   Per-mains-cycle processing
+//
+//   At every voltage zero crossing accum_stats() takes a snapshot of the
+//   per-cycle partial sums (before they are folded into the window sums).
+//   The floating point work is deferred to idle time: process_cycle()
+//   turns the snapshot into active and reactive power for each channel,
+//   and runs the step-change event detector on it.  If a snapshot is
+//   still pending at the next zero crossing, that cycle is lost and the
+//   detectors treat it as a gap.
+//
+//   Optionally the per-cycle results are streamed as one short line per
+//   mains cycle (see STREAM_CYCLE_CHAN in cont.h).
+//
+//   Built only with CYCLE_ANALYSIS (see cont.h).
+//
+
+#include <Arduino.h>
+#include <Math.h>
+#include "cont.h"
+#include "cal.h"
+
+#ifdef CYCLE_ANALYSIS
+
+// Snapshot of one mains cycle's partial sums
+struct cycle_snap_struct {
+  int32_t prod_sum[N_CUR_CHAN], proddel_sum[N_CUR_CHAN];
+#if STREAM_CYCLE_IRMS
+  uint32_t val2_sum[N_CUR_CHAN];
+#endif
+  uint16_t n;      // readings in this cycle
+  uint32_t t;      // [us] time of the closing zero crossing
+  uint8_t pending; // snapshot is waiting for process_cycle()
+  uint8_t lost;    // cycles lost since the last processed one
+};
+struct cycle_snap_struct cycle_snap;
+
+// Results of the last processed cycle.  Cycle times are reading times,
+// the low word of device time, and are extended with time64() when sent.
+float cycle_pac[N_CUR_CHAN], cycle_pre[N_CUR_CHAN]; // [W], [VAR]
+uint32_t cycle_t = 0;        // [us] time of the last processed cycle
+uint32_t cycle_prev_t = 0;   // [us] time of the cycle before
+// A cycle has been processed since the detectors were last reset; until
+// then cycle_pac[] and cycle_pre[] hold nothing to compare with
+uint8_t cycle_started = 0;
+
+// Per-cycle stream: channels to stream (bit j = current channel j), and
+// sequence number of the cycle, which counts lost cycles too
+chanmask_t stream_cycle_mask = STREAM_CYCLE_CHAN;
+uint8_t cycle_seq = 0;
+
+// Distribution of per-cycle active power over the reporting period, kept
+// until its lines are queued: cycle_dist_chan is the next channel to
+// report, and N_CUR_CHAN when no report is due
+struct cycle_dist_struct {
+  float pmin, pmax, psum; // [W]
+  uint16_t n;
+};
+struct cycle_dist_struct cycle_dist[N_CUR_CHAN];
+uint8_t cycle_dist_chan = N_CUR_CHAN;
+
+// Step change event detector state, per channel.  The previous cycle's
+// powers are still in cycle_pac[] and cycle_pre[] when it runs.
+#define EVENT_OFF  0    // channel was not present in the previous cycle
+#define EVENT_IDLE 1
+#define EVENT_STEP 2
+struct event_struct {
+  uint8_t mode;
+  uint8_t nstable;      // consecutive settled cycles
+  uint16_t ncyc;        // cycles since the step started
+  float pac0, pre0;     // baseline before the step
+  uint32_t tstart;      // [us] reading time the step started
+};
+struct event_struct events[N_CUR_CHAN];
+
+// snap_cycle() - record the partial sums of a completed mains cycle
+//   t - [us] time of the zero crossing
+//   n - number of readings in the cycle
+// Called from accum_stats(), so this must stay short.
+void snap_cycle(uint32_t t, uint16_t n)
+{
+  uint8_t j;
+  if (cycle_snap.pending) cycle_snap.lost ++;
+  for (j = 0; j<N_CUR_CHAN; j++) {
+    cycle_snap.prod_sum[j]    = istats[j].prod_sum;
+    cycle_snap.proddel_sum[j] = istats[j].proddel_sum;
+#if STREAM_CYCLE_IRMS
+    cycle_snap.val2_sum[j]    = istats[j].val2_sum;
+#endif
+  }
+  cycle_snap.n = n;
+  cycle_snap.t = t;
+  cycle_snap.pending = 1;
+}
+
+// detect_event() - step change detector for one channel
+//   j - current channel
+//   pac, pre - [W], [VAR] powers of this cycle
+//   gap - 1 if cycles were lost before this one
+static void detect_event(uint8_t j, float pac, float pre, uint8_t gap)
+{
+  struct event_struct *e = &(events[j]);
+
+  if (gap && e->mode == EVENT_STEP) e->nstable = 0;
+
+  switch (e->mode) {
+    case EVENT_OFF:
+      // Start the detector from the present load
+      e->mode = EVENT_IDLE;
+      e->pac0 = pac; e->pre0 = pre;
+      break;
+
+    case EVENT_IDLE:
+      if (fabs(pac - e->pac0) > EVENT_DP || fabs(pre - e->pre0) > EVENT_DQ) {
+        e->mode = EVENT_STEP;
+        e->ncyc = 0;
+        e->nstable = 0;
+        e->tstart = cycle_prev_t;  // step began after the previous, steady, cycle
+      } else {
+        // Follow slow drifts of the steady load
+        e->pac0 += (pac - e->pac0) * EVENT_TRACK;
+        e->pre0 += (pre - e->pre0) * EVENT_TRACK;
+      }
+      break;
+
+    case EVENT_STEP:
+      e->ncyc ++;
+      if (fabs(pac - cycle_pac[j]) < EVENT_SETTLE && fabs(pre - cycle_pre[j]) < EVENT_SETTLE) {
+        e->nstable ++;
+      } else {
+        e->nstable = 0;
+      }
+      if (e->nstable >= EVENT_NSETTLE || e->ncyc >= EVENT_MAXCYC) {
+        float dpac = pac - e->pac0, dpre = pre - e->pre0;
+        // Report only steps that persist once settled.  Without room in
+        // the report ring the step stays open, and ends at a later cycle.
+        if (fabs(dpac) > EVENT_DP || fabs(dpre) > EVENT_DQ) {
+          if (!report_wait(REPORT_EVENT)) break;
+          push_report_int32("evch", j, 0);
+          push_report_float("evdp", dpac, 1, 0);
+          push_report_float("evdq", dpre, 1, 0);
+          push_report_uint32("evst", (cycle_t - e->tstart) / 1000, 0); // [ms] settling time incl. stable cycles
+          push_report_time(time64(e->tstart));  // the step began
+          push_report_break();
+        }
+        e->mode = EVENT_IDLE;
+        e->pac0 = pac; e->pre0 = pre;
+      }
+      break;
+  }
+}
+
+// report_cycle_dist() - report and reset the per-cycle active power
+//   distribution, one line per channel, once it is due and the report
+//   ring has room
+//   t - [us] device time of the power report
+void report_cycle_dist(uint64_t t)
+{
+  while (cycle_dist_chan < N_CUR_CHAN) {
+    uint8_t j = cycle_dist_chan;
+    struct cycle_dist_struct *d = &(cycle_dist[j]);
+    if (istats[j].present && d->n > 0) {
+      if (!report_wait(REPORT_DIST)) return;
+      push_chan_float("pmn", j, d->pmin, 1, 0);
+      push_chan_float("pmx", j, d->pmax, 1, 0);
+      push_chan_float("pme", j, d->psum / d->n, 1, 0);
+      push_report_time(t);
+      push_report_break();
+    }
+    memset(d,0,sizeof(*d));
+    cycle_dist_chan ++;
+  }
+}
+
+// stream_cycle() - stream the results of one cycle
+// The record is only queued if the report ring buffer has room for all of
+// it, and no other line is waiting for room, so the stream is paced by
+// the serial output.  Dropped records show up as gaps in the sequence number.
+static void stream_cycle(void)
+{
+  uint8_t j, nrep = 2;
+#if STREAM_CYCLE_IRMS
+  float invn = 1.0 / cycle_snap.n;
+#endif
+
+  for (j = 0; j<N_CUR_CHAN; j++) {
+    if ((stream_cycle_mask & ((chanmask_t) 1 << j)) && istats[j].present) {
+      nrep += (STREAM_CYCLE_IRMS ? 2 : 1);
+    }
+  }
+  if (nrep == 2 || report_held || report_room() < nrep) return;
+
+  push_report_int32("cs", cycle_seq, 0);
+  for (j = 0; j<N_CUR_CHAN; j++) {
+    if ((stream_cycle_mask & ((chanmask_t) 1 << j)) && istats[j].present) {
+      // Integer Watts are much quicker to print than floats
+      push_chan_int32("cp", j, lround(cycle_pac[j]), 0);
+#if STREAM_CYCLE_IRMS
+      float icalj = pgm_read_float(&ical[j]);
+      float irms2 = (float) cycle_snap.val2_sum[j] * invn * icalj * icalj
+                    - iavg_ra[j]*iavg_ra[j];
+      if (irms2 < 0) irms2 = 0;
+      push_chan_int32("ci", j, lround(1000.0*sqrt(irms2)), 0); // [mA]
+#endif
+    }
+  }
+  push_report_break();
+}
+
+// process_cycle() - compute per-cycle powers from a pending snapshot
+// Called from loop() when the ADC ring buffer is nearly empty.
+void process_cycle(void)
+{
+  uint8_t j, lost, first;
+  float invn;
+
+  if (!cycle_snap.pending) return;
+  // Need the voltage quadrature correction from the first window.  It is
+  // measured again after a profile switch; the detectors then start over.
+  if (vmains_fprod == 0) {
+    cycle_snap.pending = 0;
+    cycle_started = 0;
+    return;
+  }
+
+  first = !cycle_started;
+  cycle_started = 1;
+  cycle_prev_t = cycle_t;
+  cycle_t = cycle_snap.t;
+  lost = cycle_snap.lost;
+  cycle_snap.lost = 0;
+  cycle_seq += lost + 1;
+
+  invn = VCAL / cycle_snap.n;
+  for (j = 0; j<N_CUR_CHAN; j++) {
+    if (istats[j].present) {
+      float ivcal = pgm_read_float(&ical[j]) * invn;
+      float p_offset = vavg_ra * iavg_ra[j];
+      float pac0, pre0, pre1, pac, pre;
+
+      // Same corrections as calc_stats(), applied to one cycle
+      pac0 = (float) cycle_snap.prod_sum[j]    * ivcal - p_offset;
+      pre0 = (float) cycle_snap.proddel_sum[j] * ivcal - p_offset;
+      pre1 = pre0 - vmains_fprod*pac0;
+      pac =  cosph[j]*pac0 - sinph[j]*pre1;
+      pre = +sinph[j]*pac0 + cosph[j]*pre1;
+
+      // Per-cycle active power distribution
+      {
+        struct cycle_dist_struct *d = &(cycle_dist[j]);
+        if (d->n == 0 || pac < d->pmin) d->pmin = pac;
+        if (d->n == 0 || pac > d->pmax) d->pmax = pac;
+        d->psum += pac;
+        d->n ++;
+      }
+
+      if (first) events[j].mode = EVENT_OFF;
+      detect_event(j, pac, pre, lost > 0);
+      cycle_pac[j] = pac;
+      cycle_pre[j] = pre;
+    } else {
+      events[j].mode = EVENT_OFF;
+    }
+  }
+  if (stream_cycle_mask) stream_cycle();
+  cycle_snap.pending = 0;
+}
+
+#endif // CYCLE_ANALYSIS
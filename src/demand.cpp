@@ -0,0 +1,145 @@
+//   EMONTX3-CONTINUOUS - continuous sampling Arduino firmware
+// 
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   Demand interval energy and peak demand registers
+//
+//   Device time is divided into demand intervals of DEMAND_INTERVAL
+//   seconds, aligned to multiples of the interval since the ADC was
+//   started.  Each interval is made of DEMAND_NBLOCK blocks.  The energy
+//   of each accumulation window is split across block boundaries in
+//   proportion to time.  The rolling demand is the average power over the
+//   last DEMAND_NBLOCK blocks, evaluated at every block boundary, so the
+//   peak is found with a resolution of one block.
+//
+//   The energy of a closed interval is kept until report_demand() finds
+//   room for its line in the report ring.
+//
+
+#include <Arduino.h>
+#include <Math.h>
+#include "cont.h"
+#include "cal.h"
+
+// Blocks are counted in whole seconds and the block boundaries in device
+// time, so that neither drifts over months of running
+#if (DEMAND_INTERVAL % DEMAND_NBLOCK) != 0
+#error "DEMAND_INTERVAL must be a whole number of blocks"
+#endif
+#define DEMAND_BLOCK_SECS (DEMAND_INTERVAL / DEMAND_NBLOCK)     // [sec] block length
+#define DEMAND_BLOCK_US ((uint32_t) DEMAND_BLOCK_SECS * SECS)  // [us] block length
+
+float demand_energy[N_CUR_CHAN];     // [W-sec] energy per channel in this interval
+float demand_closed[N_CUR_CHAN];     // [W-sec] energy per channel in the closed interval
+uint32_t demand_closed_time = 0;     // [sec] device time the interval closed
+uint8_t demand_due = 0;              // closed interval waits to be reported
+float demand_block[DEMAND_NBLOCK];   // [W-sec] total energy per block, ring buffer
+uint8_t demand_iblock = 0;           // current block in demand_block[]
+uint8_t demand_nfull = 0;            // number of completed blocks in ring
+uint32_t demand_nblocks = 0;         // number of blocks since start of device time
+uint64_t demand_block_end = 0;       // [us] device time the current block ends; 0 before start
+float demand_peak = 0.0;             // [W] peak rolling demand since startup or reset
+uint32_t demand_peak_time = 0;       // [sec] device time of peak; 0 if none
+
+// close_demand_block() - finish the current block, and perhaps interval
+static void close_demand_block(void)
+{
+  uint8_t j;
+  float total = 0.0;
+
+  demand_nblocks ++;
+  if (demand_nfull < DEMAND_NBLOCK) demand_nfull ++;
+
+  // Rolling demand over the last full interval
+  if (demand_nfull == DEMAND_NBLOCK) {
+    float demand;
+    for (j = 0; j<DEMAND_NBLOCK; j++) total += demand_block[j];
+    demand = total / DEMAND_INTERVAL;
+    if (demand > demand_peak) {
+      demand_peak = demand;
+      demand_peak_time = demand_nblocks * DEMAND_BLOCK_SECS;
+    }
+  }
+
+  // Interval close: keep the energy for the report, and restart the
+  // interval registers
+  if (demand_nblocks % DEMAND_NBLOCK == 0) {
+    for (j = 0; j<N_CUR_CHAN; j++) {
+      demand_closed[j] = demand_energy[j];
+      demand_energy[j] = 0.0;
+    }
+    demand_closed_time = demand_nblocks * DEMAND_BLOCK_SECS;
+    demand_due = 1;
+  }
+
+  demand_iblock = (demand_iblock + 1) % DEMAND_NBLOCK;
+  demand_block[demand_iblock] = 0.0;
+  demand_block_end += DEMAND_BLOCK_US;
+}
+
+// record_demand() - add the results of one accumulation window
+//   t - [us] device time at end of window
+//   dur - [us] duration of window
+//   pow_en - [W] active power of each present channel over the window,
+//            including the estimate for lost readings (see calc_stats())
+void record_demand(uint64_t t, uint32_t dur, const float *pow_en)
+{
+  uint8_t j;
+  uint64_t t0 = t - dur;  // [us] device time at start of window
+  uint64_t t1;
+  float dt;
+
+  // First window: align the block to device time
+  if (demand_block_end == 0) {
+    demand_nblocks = t0 / DEMAND_BLOCK_US;
+    demand_block_end = (uint64_t) (demand_nblocks + 1) * DEMAND_BLOCK_US;
+  }
+
+  while (t0 < t) {
+    // Blocks that ended before this window began are closed empty
+    while (demand_block_end <= t0) close_demand_block();
+    t1 = (t < demand_block_end) ? t : demand_block_end;
+    dt = 1.0e-6 * (uint32_t) (t1 - t0);  // [sec]
+    for (j = 0; j<N_CUR_CHAN; j++) {
+      if (istats[j].present) {
+        float energy = dt * pow_en[j];
+        demand_energy[j] += energy;
+        demand_block[demand_iblock] += energy;
+      }
+    }
+    t0 = t1;
+    if (t0 == demand_block_end) close_demand_block();
+  }
+}
+
+// reset_demand_peak() - start a new peak demand register, such as at the
+//   start of a billing period (command dmdr)
+void reset_demand_peak(void)
+{
+  demand_peak = 0.0;
+  demand_peak_time = 0;
+}
+
+// report_demand() - report the last closed interval, once the report ring
+//   has room for it
+void report_demand(void)
+{
+  uint8_t j;
+  float total = 0.0;
+
+  if (!demand_due || !report_wait(REPORT_DEMAND)) return;
+  push_report_uint32("dmtm", demand_closed_time, 0);
+  for (j = 0; j<N_CUR_CHAN; j++) {
+    if (istats[j].present || demand_closed[j] != 0) {
+      push_chan_float("dme", j, demand_closed[j] / 3600.0, 2, 0);
+    }
+    total += demand_closed[j];
+  }
+  push_report_float("dmet", total / 3600.0, 2, 0);
+  push_report_float("dmpk", demand_peak / 1000.0, 3, 1);
+  push_report_uint32("dmpt", demand_peak_time, 1);
+  push_report_time(get_time_us());
+  push_report_break();
+  demand_due = 0;
+}
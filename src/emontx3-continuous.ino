@@ -42,13 +42,21 @@
 //     adc.cpp - functions used to manage the ADC
 //     pulse.cpp - functions used to manage the pulse counter
 //     inlineAVR201def.h - high speed math routines for sum-and-multiply
+//     monitor.cpp - current transformer hot-plug monitor
+//     demand.cpp - demand interval energy and peak demand
+//     cycle.cpp - per-mains-cycle power and appliance events
+//     raw.cpp - raw reading stream
+//     alarm.cpp - half-cycle overcurrent and residual current alarm
+//     mem.cpp - stack high-water mark and SRAM budget check
+//     command.cpp - serial command interface
+//     uart.cpp - serial port driver
 //     report.cpp - functions to store and send data
 //     state.cpp - main state machine functions
 //  
 
 // Version number of this firmware.  Update after changes
 // This version number is reported to emonCMS with tag "ever"
-#define VERSIONTAG  1006
+#define VERSIONTAG  1007
 
 // Standard includes
 #include <Arduino.h>
@@ -64,18 +72,28 @@
 void setup() {
 
   // Initialize serial
-  Serial.begin(115200);
-  Serial.println("");
-  Serial.print("#EMONTX3-continuous=v");Serial.println(VERSIONTAG);
+  init_uart();
+  uart_println("");
+  uart_print("#EMONTX3-continuous=v");uart_print_int(VERSIONTAG);uart_println("");
   push_report_int32("ever", VERSIONTAG, 1);
   init_cal();
   push_report_break();
 
   // Initialize ADC
-  init_adc(ADC_PRESCALAR);
+  init_adc(ADC_PROFILE);
 
   // Initialize pulse counter
   init_pulse();
+
+#ifdef FAST_ALARM
+  // Alarm output pin, if configured
+  init_alarm();
+#endif
+
+#ifdef RAW_STREAM
+  // Raw reading stream, if configured
+  set_raw_stream(RAW_STREAM_CHAN, RAW_STREAM_DEC);
+#endif
 }
 
 // 
@@ -87,9 +105,14 @@ void setup() {
 void loop() {
   struct adc_readings_struct reading; // current ADC readings
   static uint8_t state = STATE_STAB;  // initial state is the "stabilization" state
+  uint8_t have_reading = 0;
 
   // Retrieve the next ADC reading, if it is available
   if (get_next_adc_reading(&reading)) {
+    have_reading = 1;
+#ifdef RAW_STREAM
+    if (raw_mask) stream_raw(&reading);
+#endif
 
     // Send this reading to its associated state
     switch(state) {
@@ -98,7 +121,7 @@ void loop() {
       case STATE_ZER1: state = zero_crossing(&reading, (N_READINGS+N_VHIST_RING),
                                              STATE_ZER1, STATE_FREQ); break;
       case STATE_FREQ: state = accum_freq(&reading, STATE_FREQ, STATE_STAT); break;
-      case STATE_STAT: state = accum_stats(&reading, 1000000, STATE_STAT, STATE_STAT); break;
+      case STATE_STAT: state = accum_stats(&reading, ACCUM_PERIOD, STATE_STAT, STATE_STAT); break;
     }
 
     // Follow-up states for reporting
@@ -109,13 +132,18 @@ void loop() {
   }
 
   // When the input ADC buffer is quite idle, then stuff more reports into
-  // the output serial buffer.  This can block for about about 2 ADC samples.
+  // the output serial buffer.  send_report() waits for room in the serial
+  // transmit buffer without blocking.
   if (get_adc_depth() < 4) {
+    if (have_reading && state == STATE_STAT) monitor_inputs(&reading);
+#ifdef CYCLE_ANALYSIS
+    process_cycle();
+#endif
+    poll_command();
     record_pulse_count();
-    if (Serial.availableForWrite() > 20) {
-      if (state > STATE_FREQ) report_pulse_count();
-      send_report();
-    }
+    if (state > STATE_FREQ) report_pulse_count();
+    queue_reports();
+    send_report();
   }
 }
 
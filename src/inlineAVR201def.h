@@ -35,6 +35,10 @@
 
 // modified as inline assembly in a C header file for the Arduino by Jose Gama, May 2015
 
+// Host builds of the firmware (host/devsim.cpp) are not AVR: there the
+// one routine the firmware uses, mac16x16_32, is plain C at the end.
+#ifdef __AVR__
+
 // ******************************************************************************
 // *
 // * FUNCTION
@@ -422,3 +426,9 @@ __asm__ __volatile__ ( \
 : "a" (multiplicand),  "a" (multiplier) \
 );
 
+#else // !__AVR__
+
+#define mac16x16_32(result, multiplicand, multiplier) \
+  ((result) += (int32_t) (int16_t) (multiplicand) * (int16_t) (multiplier))
+
+#endif // __AVR__
@@ -0,0 +1,72 @@
+//   EMONTX3-CONTINUOUS - continuous sampling Arduino firmware
+//
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   Memory use
+//
+//   The free SRAM between the variables (_end) and the top of the stack
+//   (__stack) is filled with STACK_PAINT at reset, before the C runtime
+//   sets up anything.  The stack grows down into it, so the lowest byte
+//   that no longer holds the paint marks the deepest the stack has been,
+//   interrupts included.  The firmware does not use malloc(), so nothing
+//   else writes there.  A local variable that is never written, or a
+//   byte that happens to equal STACK_PAINT, can hide the last few bytes.
+//
+//   The ring buffers are sized from the budget in cont.h; the check
+//   below keeps them inside it when they are changed.
+//
+
+#include <Arduino.h>
+#include "cont.h"
+
+#define STACK_PAINT 0xc5
+
+static_assert(N_READINGS*sizeof(struct adc_readings_struct) + N_VHIST_RING*sizeof(int16_t) +
+              N_REPORT*sizeof(struct report_struct) + UART_TX_SIZE + UART_RX_SIZE +
+              SRAM_ALARM + SRAM_OTHER + SRAM_STACK <= SRAM_BYTES,
+              "ring buffers exceed the SRAM budget in cont.h");
+
+extern uint8_t _end;     // first byte after the variables (linker)
+extern uint8_t __stack;  // top of the stack (linker)
+
+// Lowest byte found changed so far
+static const uint8_t *stack_low = &__stack;
+
+// paint_stack() - fill the free SRAM with STACK_PAINT.  Runs from .init1,
+//   before __zero_reg__ is cleared and the stack pointer is set, so it
+//   is plain assembler that uses no stack and no r1.
+void paint_stack(void) __attribute__((naked, used, section(".init1")));
+void paint_stack(void)
+{
+  __asm__ __volatile__ (
+    "    ldi r30, lo8(_end)\n"
+    "    ldi r31, hi8(_end)\n"
+    "    ldi r24, %0\n"
+    "    ldi r25, hi8(__stack)\n"
+    "    rjmp 2f\n"
+    "1:  st Z+, r24\n"
+    "2:  cpi r30, lo8(__stack)\n"
+    "    cpc r31, r25\n"
+    "    brlo 1b\n"
+    "    breq 1b\n"
+    :: "i" (STACK_PAINT) : "memory");
+}
+
+// stack_high_water() - deepest stack use since reset
+//   returns: [bytes] stack used
+//   Scans up from _end to the previous mark, a few cycles per free byte.
+uint16_t stack_high_water(void)
+{
+  const uint8_t *p = &_end;
+  while (p < stack_low && *p == STACK_PAINT) p++;
+  stack_low = p;
+  return &__stack - p + 1;
+}
+
+// stack_free() - SRAM never touched since reset, as of the last
+//   stack_high_water()
+uint16_t stack_free(void)
+{
+  return stack_low - &_end;
+}
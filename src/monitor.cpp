@@ -0,0 +1,90 @@
+//   EMONTX3-CONTINUOUS - continuous sampling Arduino firmware
+// 
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   Current transformer hot-plug monitor
+//
+//   Channel presence is first decided by scan_inputs().  After that, this
+//   module watches the raw readings of absent channels during idle time,
+//   and the variance of present channels at the end of each accumulation
+//   window.  Channels are enabled or retired only at a window boundary, so
+//   the statistics of a window are never mixed between the two states.
+//   Absent channels cost nothing in accum_stats().
+//
+
+#include <Arduino.h>
+#include <Math.h>
+#include "cont.h"
+#include "cal.h"
+
+// Raw readings of an absent channel, collected in idle time
+struct monitor_stats {
+  uint16_t n;       // number of readings
+  uint16_t nlive;   // number of readings above the pull-down level
+  int32_t  val_sum; // sum of raw readings (no offset applied to absent channels)
+};
+struct monitor_stats mstats[N_CUR_CHAN];
+
+// monitor_inputs() - accumulate raw readings of absent channels
+//   reading - current ADC reading
+// This is called only when the ADC ring buffer is nearly empty, so it
+// sees a sub-sample of all readings.  That is enough to estimate the
+// zero point of a newly connected CT.
+void monitor_inputs(struct adc_readings_struct *reading)
+{
+  uint8_t j;
+  for (j = 0; j<N_CUR_CHAN; j++) {
+    struct monitor_stats *m = &(mstats[j]);
+    if (istats[j].present || !adc_notice_chan[j]) continue;
+    if (m->n >= HOTPLUG_NREADINGS) continue; // Enough already; wait for window end
+
+    int16_t val = reading->vals[j+1];
+    m->val_sum += val;
+    m->n ++;
+    if (val >= HOTPLUG_MIN_ADU) m->nlive ++;
+  }
+}
+
+// update_inputs() - enable or retire current channels at a window boundary
+//   returns: 1 if the set of present channels changed; 0 otherwise
+uint8_t update_inputs(void)
+{
+  uint8_t j, changed = 0;
+
+  for (j = 0; j<N_CUR_CHAN; j++) {
+    struct monitor_stats *m = &(mstats[j]);
+    struct reading_stats *s = &(istats[j]);
+
+    if (!s->present) {
+      // Absent channel: enable it once every sampled reading is live
+      if (m->n < HOTPLUG_NREADINGS) continue;
+      if (m->nlive == m->n) {
+        reset_adc_offset(j+1);
+        set_adc_offset(j+1, m->val_sum / m->n);
+        iavg_ra[j] = 0;  // Restart running average
+        s->present = 1;
+        changed = 1;
+      }
+      memset(m,0,sizeof(*m));
+
+    } else if (vstats.n > 0) {
+      // Present channel: retire it if it sits quietly at the pull-down level,
+      // or is no longer to be noticed
+      float invn = 1.0 / vstats.n;
+      float mean = (float) s->val_sum * invn;
+      float var  = float40(&(s->val2_acc)) * invn - mean*mean;
+      if (!adc_notice_chan[j] ||
+          (mean + get_adc_offset(j+1) < HOTPLUG_MIN_ADU && var < HOTPLUG_MAX_VAR)) {
+        s->present = 0;
+        reset_adc_offset(j+1);
+        memset(m,0,sizeof(*m));
+        changed = 1;
+      }
+    }
+  }
+
+  // The new mask is reported by calc_stats()
+  if (changed) update_present_chans();
+  return changed;
+}
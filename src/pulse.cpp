@@ -19,42 +19,142 @@ uint32_t last_pulse_count = 0;
 
 const uint8_t pulse_countINT=         1;                              // INT 1 / Dig 3 Terminal Block / RJ45 Pulse counting pin(emonTx V3.4) - (INT0 / Dig2 emonTx V3.2)
 const uint8_t pulse_count_pin=        3;                              // INT 1 / Dig 3 Terminal Block / RJ45 Pulse counting pin(emonTx V3.4) - (INT0 / Dig2 emonTx V3.2)
-const uint8_t min_pulsewidth = 110;
+
+// Pulse edges are timestamped from Timer1, free-running at F_CPU/8 and
+// extended to 32 bits by its overflow interrupt (PULSE_TICKS_PER_US in
+// cont.h).  At 16 MHz a tick is 0.5 us, and the 32-bit time wraps after
+// about 35 minutes.  adc.cpp also reads it, to calibrate device time.
+#define PULSE_MIN_TICKS ((uint32_t) PULSE_DEBOUNCE_US * PULSE_TICKS_PER_US)
+#define PULSE_MAX_TICKS ((uint32_t) PULSE_MAX_INTERVAL * 1000000UL * PULSE_TICKS_PER_US)
+volatile uint16_t pulse_timer_hi = 0;
+
+// Ring buffer of accepted edge times, filled by the interrupt handler.
+// When it is full the new edge is dropped, and the number dropped is
+// kept with the next edge stored, so that its interval is known to span
+// more than one pulse.
+volatile uint32_t pulse_ring[N_PULSE_RING];
+volatile uint8_t pulse_gap[N_PULSE_RING];  // edges dropped before each (max 255)
+volatile uint8_t pulse_write_index = 0;
+volatile uint8_t pulse_read_index = 0;
+uint8_t pulse_dropped = 0;        // edges dropped since the last one stored (ISR only)
+
+// Pulse rate power estimate
+uint32_t pulse_prev_time = 0;     // [ticks] time of previous pulse
+uint8_t pulse_prev_valid = 0;     // pulse_prev_time is recent enough to use
+float pulse_power = 0.0;          // [W] power from the last pulse interval
+float pulse_pmin = 0, pulse_pmax = 0; // [W] range since last report
+uint8_t pulse_npower = 0;         // number of power estimates since last report
 
 void pulse_interrupt_handler();
 
+// pulse_timer() - current Timer1 time
+//   returns: time in ticks
+// Must be called with interrupts disabled.
+static inline uint32_t pulse_timer(void)
+{
+  uint16_t lo = TCNT1;
+  uint16_t hi = pulse_timer_hi;
+  // Account for an overflow that has not been serviced yet
+  if ((TIFR1 & _BV(TOV1)) && lo < 0x8000) hi++;
+  return ((uint32_t) hi << 16) | lo;
+}
+
 void init_pulse(void)
 {
   pulse_count = 0;  
   
+  // Timer1 free-running, prescalar 8, overflow interrupt
+  TCCR1A = 0;
+  TCCR1B = _BV(CS11);
+  TIMSK1 = _BV(TOIE1);
+
   pinMode(pulse_count_pin, INPUT_PULLUP);                     // Set emonTx V3.4 interrupt pulse counting pin as input (Dig 3 / INT1)
   attachInterrupt(pulse_countINT, pulse_interrupt_handler, FALLING);     // Attach pulse counting interrupt pulse counting
 }
 
+// get_pulse_time() - take the oldest edge time from the ring
+//   t - [ticks] edge time upon return
+//   gap - upon return, edges dropped just before this one (max 255)
+//   returns: 0 if the ring is empty; 1 if an edge time was returned
+uint8_t get_pulse_time(uint32_t *t, uint8_t *gap)
+{
+  uint8_t sreg;
+
+  sreg = SREG; cli();
+  {
+    if (pulse_read_index == pulse_write_index) { SREG = sreg; return 0; }
+    *t = pulse_ring[pulse_read_index];
+    *gap = pulse_gap[pulse_read_index];
+    pulse_read_index = (pulse_read_index + 1) % N_PULSE_RING;
+  }
+  SREG = sreg;
+  return 1;
+}
+
 void record_pulse_count(void)
 {
   uint8_t sreg;
-  if (pulse_count_ticks) {
-    sreg = SREG; cli();
-    {
+  uint32_t now, t;
+  uint8_t gap;
+
+  sreg = SREG; cli();
+  {
+    if (pulse_count_ticks) {
       pulse_count += pulse_count_ticks;
       pulse_count_ticks = 0;
     }
-    SREG = sreg;
+    now = pulse_timer();
+  }
+  SREG = sreg;
+
+  // Power from the interval between successive pulses; an interval
+  // with edges dropped in it spans gap+1 pulses, unless the count of
+  // them saturated
+  while (get_pulse_time(&t, &gap)) {
+    if (pulse_prev_valid && gap < 255) {
+      pulse_power = (gap + 1) * (PULSE_WH * 3600.0 * 1.0e6 * PULSE_TICKS_PER_US) / (float) (t - pulse_prev_time);
+      if (pulse_npower == 0 || pulse_power < pulse_pmin) pulse_pmin = pulse_power;
+      if (pulse_npower == 0 || pulse_power > pulse_pmax) pulse_pmax = pulse_power;
+      if (pulse_npower < 255) pulse_npower ++;
+    }
+    pulse_prev_time = t;
+    pulse_prev_valid = 1;
+  }
+
+  // Forget the previous pulse before the 32-bit tick time can wrap
+  if (pulse_prev_valid && (now - pulse_prev_time) > PULSE_MAX_TICKS) {
+    pulse_prev_valid = 0;
+    pulse_power = 0.0;
   }
 }
 
-uint32_t t_report_pulse = 0;
+uint64_t t_report_pulse = 0;  // [us] device time
+uint8_t pulse_reported = 0;   // t_report_pulse is valid
+uint32_t report_pulse_period = REPORT_PULSE_PERIOD; // [us]
 
 void report_pulse_count(void)
 {
-  uint32_t t = micros();
-  if (t_report_pulse == 0 || 
-      ((t - t_report_pulse) > REPORT_PULSE_PERIOD) && 
+  uint64_t t = get_time_us();
+  if (!pulse_reported || 
+      ((t - t_report_pulse) > report_pulse_period) && 
        (pulse_count != last_pulse_count)) {
+    if (!report_wait(REPORT_PULSE)) return;
     push_report_uint32("pulse",pulse_count,0);
+    if (pulse_reported) {
+      // Mean power from the pulses counted over the report period
+      float plav = (pulse_count - last_pulse_count) * PULSE_WH * 3600.0 * 1.0e6 / (float) (t - t_report_pulse);
+      push_report_float("plav", plav, 1, 0);
+    }
+    if (pulse_npower > 0) {
+      push_report_float("plsp", pulse_power, 1, 0);
+      push_report_float("plmn", pulse_pmin, 1, 0);
+      push_report_float("plmx", pulse_pmax, 1, 0);
+      pulse_npower = 0;
+    }
+    push_report_time(t);
     push_report_break();
     t_report_pulse = t;
+    pulse_reported = 1;
     last_pulse_count = pulse_count;
   }
 }
@@ -63,12 +163,31 @@ void report_pulse_count(void)
 //-------------------------------------------------------------------------------------------------------------------------------------------
 // The interrupt routine - runs each time a falling edge of a pulse is detected
 //-------------------------------------------------------------------------------------------------------------------------------------------
-unsigned long pulsetime=0;                                    // Record time of interrupt pulse
+uint32_t pulsetime=0;                                         // Record time of interrupt pulse [ticks]
 
 void pulse_interrupt_handler()
 {
-  if ( (millis() - pulsetime) > min_pulsewidth) {
+  uint32_t t = pulse_timer();
+  if ( (t - pulsetime) > PULSE_MIN_TICKS) {
+    uint8_t w = pulse_write_index;
+    uint8_t next = (w + 1) % N_PULSE_RING;
     pulse_count_ticks++;          //calculate Wh elapsed from time between pulses
+    // Timestamp the edge; if the ring is full, drop it and count it
+    // against the next edge stored
+    if (next == pulse_read_index) {
+      if (pulse_dropped < 255) pulse_dropped++;
+    } else {
+      pulse_ring[w] = t;
+      pulse_gap[w] = pulse_dropped;
+      pulse_dropped = 0;
+      pulse_write_index = next;
+    }
   }
-  pulsetime=millis();
+  pulsetime=t;
+}
+
+// Timer1 overflow extends the pulse timer to 32 bits
+ISR(TIMER1_OVF_vect)
+{
+  pulse_timer_hi++;
 }
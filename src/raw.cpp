@@ -0,0 +1,195 @@
+//   EMONTX3-CONTINUOUS - continuous sampling Arduino firmware
+//
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   Raw reading stream
+//
+//   For diagnosis, the ADC readings are streamed as they are taken from
+//   the ring buffer in loop(), before the state machine sees them, so the
+//   statistics are computed exactly as without the stream.  The selected
+//   channels of every raw_dec'th reading are packed into binary frames,
+//   which are interleaved with the text reports on the serial line:
+//
+//     byte 0      RAW_SYNC, which never occurs in the text reports
+//     byte 1      n, the number of bytes from byte 2 to the end of the payload
+//     byte 2      sequence number, incremented for every frame, including
+//                 frames dropped because the serial buffer was full
+//     byte 3-4    channel mask (bit 0 = voltage, bit j = CT channel j-1)
+//     byte 5      decimation: one reading sent for this many taken
+//     byte 6-7    [us] time per reading
+//     byte 8-11   [us] device time of the first reading (low 32 bits)
+//     payload     for each reading, for each channel in the mask, the raw
+//                 ADC value (0-1023) as the difference from the channel's
+//                 previous value in the frame (the first from 0), zigzag
+//                 coded in one byte (0zzzzzzz, -64..63) or two bytes
+//                 (1zzzzzzz zzzzzzzz, big-endian)
+//     last byte   XOR of bytes 1 to the end of the payload
+//   Multi-byte fields are little-endian.  Every frame is decoded on its
+//   own, so a lost frame loses only its readings.  A frame ends early when
+//   readings were lost by the device, or the sampling profile changes, so
+//   the readings of a frame are always evenly spaced; the host finds any
+//   readings lost between frames from the frame times.
+//
+//   At mains frequencies most differences fit in one byte, so a reading of
+//   five channels takes about 5 bytes, plus 13 bytes of frame overhead per
+//   5-10 readings.  Frames are built in place in the serial transmit
+//   buffer (uart_hold()), which holds back the text reports while a frame
+//   is open, so a frame is closed early when text is waiting.  The stream
+//   is paced by the serial line: a frame is only started when the transmit
+//   buffer has room for RAW_FRAME_SIZE bytes, and readings that find no
+//   room are dropped, counted as one frame in the sequence number.
+//   Estimated cost (not measured on hardware): ~35 cycles per channel per
+//   reading sent, plus ~40 cycles per byte in the transmit interrupt.
+//
+//   Raw values are restored by adding the zero point of each channel at the
+//   start of the frame.  Readings converted before the zero points were set
+//   at the end of the input scan, but read after it, are off by the zero
+//   point in that one frame.
+//
+//   Built only with RAW_STREAM (see cont.h).
+//
+
+#include <Arduino.h>
+#include "cont.h"
+
+#ifdef RAW_STREAM
+
+#define RAW_SYNC   0xA5
+#define RAW_HEADER 12  // bytes before the payload
+
+#if RAW_FRAME_SIZE < RAW_HEADER + 2*N_ADC_CHAN + 1 || RAW_FRAME_SIZE > UART_TX_SIZE/2
+#error "RAW_FRAME_SIZE must hold a reading of all channels, and fit twice in UART_TX_SIZE"
+#endif
+
+// Set from RAW_STREAM_CHAN and RAW_STREAM_DEC by setup()
+uint16_t raw_mask = 0;   // channels streamed; 0 = off
+uint8_t raw_dec = 1;     // decimation
+uint8_t raw_count = 0;   // readings to skip before the next one sent
+uint8_t raw_seq = 0;     // sequence number of the next frame
+uint8_t raw_maxlen = 0;  // [bytes] largest encoded reading
+uint8_t raw_dropped = 0; // readings were dropped since the last frame
+
+// Frame being built in the transmit buffer; raw_len is 0 when no frame
+// is open
+uint8_t raw_len = 0;
+uint8_t raw_sum = 0;     // XOR of the frame from byte 2
+uint16_t raw_usec = 0;   // [us] time per reading in the open frame
+int16_t raw_last[N_ADC_CHAN]; // previous value of each channel in the frame
+
+// raw_byte() - append a byte to the open frame
+static inline void raw_byte(uint8_t c)
+{
+  uart_tx_buf[(uint8_t) (uart_tx_head + raw_len) & (UART_TX_SIZE-1)] = c;
+  raw_len ++;
+  raw_sum ^= c;
+}
+
+// raw_flush() - close the open frame, and send it
+void raw_flush(void)
+{
+  uint8_t n = raw_len - 2;
+
+  if (raw_len == 0) return;
+  uart_tx_buf[(uint8_t) (uart_tx_head + 1) & (UART_TX_SIZE-1)] = n;
+  raw_byte(raw_sum ^ n);
+  uart_release(raw_len);
+  raw_seq ++;
+  raw_len = 0;
+}
+
+// raw_open() - start a frame with the given reading
+//   returns: 1 if started; 0 if the transmit buffer has no room
+static uint8_t raw_open(const struct adc_readings_struct *reading)
+{
+  uint8_t j;
+  uint16_t m;
+  uint32_t t = reading->t;
+
+  if (!uart_hold(RAW_FRAME_SIZE)) {
+    if (!raw_dropped) raw_seq ++;
+    raw_dropped = 1;
+    return 0;
+  }
+  raw_dropped = 0;
+  uart_tx_buf[uart_tx_head] = RAW_SYNC;
+  raw_len = 2;  // n is filled in by raw_flush()
+  raw_sum = 0;
+  raw_byte(raw_seq);
+  raw_byte(raw_mask);
+  raw_byte(raw_mask >> 8);
+  raw_byte(raw_dec);
+  raw_byte(raw_usec);
+  raw_byte(raw_usec >> 8);
+  for (j = 0; j<4; j++, t >>= 8) raw_byte(t);
+  // The readings have had the zero points removed; starting from minus
+  // the zero point makes the first difference the raw value
+  for (j = 0, m = raw_mask; m; j++, m >>= 1) {
+    if (m & 1) raw_last[j] = -get_adc_offset(j);
+  }
+  return 1;
+}
+
+// raw_put() - append one zigzag coded difference
+static inline void raw_put(int16_t d)
+{
+  uint16_t z = ((uint16_t) d << 1) ^ (uint16_t) (d >> 15);
+  if (z < 0x80) {
+    raw_byte(z);
+  } else {
+    raw_byte(0x80 | (z >> 8));
+    raw_byte(z);
+  }
+}
+
+// stream_raw() - add a reading to the raw stream
+//   reading - reading just taken from the ring buffer
+void stream_raw(const struct adc_readings_struct *reading)
+{
+  uint8_t j;
+  uint16_t m;
+
+  // Keep the readings of a frame evenly spaced
+  if (reading->gap || adc_reading_usec != raw_usec) {
+    raw_flush();
+    raw_usec = adc_reading_usec;
+    raw_count = 0;
+  }
+  if (raw_count) {
+    raw_count --;
+    return;
+  }
+  raw_count = raw_dec - 1;
+
+  if (raw_len == 0 && !raw_open(reading)) return;
+  for (j = 0, m = raw_mask; m; j++, m >>= 1) {
+    if (m & 1) {
+      int16_t val = reading->vals[j];
+      raw_put(val - raw_last[j]);
+      raw_last[j] = val;
+    }
+  }
+  // Send when another reading might not fit, or text is waiting
+  if (raw_len + raw_maxlen + 1 > RAW_FRAME_SIZE || report_waiting()) raw_flush();
+}
+
+// set_raw_stream() - select the channels and decimation of the raw stream
+//   mask - channels, bit 0 = voltage; 0 turns the stream off
+//   dec - one reading sent for every dec taken (1-255)
+//   returns: 1 if set; 0 if the arguments are invalid
+uint8_t set_raw_stream(uint16_t mask, uint8_t dec)
+{
+  uint8_t j;
+  if (dec == 0 || (N_ADC_CHAN < 16 && mask >= ((uint16_t) 1 << N_ADC_CHAN))) return 0;
+  raw_flush();
+  raw_mask = mask;
+  raw_dec = dec;
+  raw_count = 0;
+  raw_maxlen = 0;
+  for (j = 0; j<N_ADC_CHAN; j++) {
+    if (mask & ((uint16_t) 1 << j)) raw_maxlen += 2;
+  }
+  return 1;
+}
+
+#endif // RAW_STREAM
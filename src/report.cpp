@@ -20,6 +20,37 @@
 struct report_struct report_buffer[N_REPORT];
 uint8_t report_read_index = 0;
 uint8_t report_write_index = 0;
+// A report line has been started but not yet ended by a break
+uint8_t report_line_open = 0;
+// A line is waiting for room; set by report_wait(), cleared when the
+// ring has drained
+uint8_t report_held = 0;
+
+// report_room() - number of reports that can still be pushed
+uint8_t report_room(void)
+{
+  return N_REPORT - 1 - WRAP(report_write_index + N_REPORT - report_read_index);
+}
+
+// report_wait() - check that a line of reports can be queued now
+//   n - most entries the line can take
+//   returns: 1 if n entries fit; else 0, and the line must be tried
+//   again later
+uint8_t report_wait(uint8_t n)
+{
+  if (report_room() >= n) return 1;
+  report_held = 1;
+  return 0;
+}
+
+// report_waiting() - is anything queued to be sent as text?
+uint8_t report_waiting(void)
+{
+#ifdef FAST_ALARM
+  if (alarm_waiting()) return 1;
+#endif
+  return !EMPTY;
+}
 
 // ============================= PUSH REPORTS INTO RING BUFFER
 // push_report_break() - push a "line break" which indicates we are 
@@ -30,100 +61,123 @@ void push_report_break()
   if (FULL) return;
   // If a break is already in place then don't do another one
   if (report_write_index != report_read_index &&
-      report_buffer[WRAP(report_write_index-1)].type == BREAK_TYPE) return;
-  r->name[0] = 0;
-  r->type = BREAK_TYPE;
+      report_buffer[WRAP(report_write_index+N_REPORT-1)].format == BREAK_TYPE) return;
+  r->format = BREAK_TYPE;
   report_write_index = WRAP(report_write_index+1);
 }
 
-// push_report_float() - push a floating point variable
-//   name - 4-character name of variable
+// push_report() - fill in the next entry; the caller checks FULL
+//   name - name in flash; chan - channel number or REPORT_NOCHAN
+//   format - type, digits and retained flag
+static inline struct report_struct *push_report(PGM_P name, uint8_t chan, uint8_t format)
+{
+  struct report_struct *r = &(report_buffer[report_write_index]);
+  r->name = name;
+  r->chan = chan;
+  r->format = format;
+  report_write_index = WRAP(report_write_index+1);
+  return r;
+}
+
+// push_report_float_P() - push a floating point variable
+//   name - name of variable in flash (see push_report_float())
+//   chan - channel number appended to the name, or REPORT_NOCHAN
 //   value - floating point value of variable
 //   digits - number of floating point digits to report after decimal
 //   retained - is this an MQTT retained variable?  (1=yes; 0=no)
-void push_report_float(const char name[6], float value, uint8_t digits, uint8_t retained)
+void push_report_float_P(PGM_P name, uint8_t chan, float value, uint8_t digits, uint8_t retained)
 {
-  struct report_struct *r = &(report_buffer[report_write_index]);
   if (FULL) return;
-  strncpy(r->name,name,5);
-  r->name[6] = 0;
-  r->type = FLOAT_TYPE;
-  r->value.floatval = value;
-  r->digits = digits | (retained ? 0x80 : 0x00);
-  report_write_index = WRAP(report_write_index+1);
+  push_report(name, chan, FLOAT_TYPE | (digits << REPORT_DIGITS_SHIFT) |
+              (retained ? REPORT_RETAINED : 0))->value.floatval = value;
 }
 
-
-// push_report_int32() - push an integer variable
-//   name - 4-character name of variable
+// push_report_int32_P() - push an integer variable
+//   name, chan - as push_report_float_P()
 //   value - integer value of variable
 //   retained - is this an MQTT retained variable?  (1=yes; 0=no)
-void push_report_int32(const char name[6], int32_t value, uint8_t retained)
+void push_report_int32_P(PGM_P name, uint8_t chan, int32_t value, uint8_t retained)
 {
-  struct report_struct *r = &(report_buffer[report_write_index]);
   if (FULL) return;
-  strncpy(r->name,name,5);
-  r->name[6] = 0;
-  r->type = INT32_TYPE;
-  r->value.int32val = value;
-  r->digits = retained ? 0x80 : 0x00;
-  report_write_index = WRAP(report_write_index+1);
+  push_report(name, chan, INT32_TYPE | (retained ? REPORT_RETAINED : 0))->value.int32val = value;
 }
 
-// push_report_uint32() - push an unsigned integer variable
-//   name - 4-character name of variable
+// push_report_uint32_P() - push an unsigned integer variable
+//   name, chan - as push_report_float_P()
 //   value - unsigned integer value of variable
 //   retained - is this an MQTT retained variable?  (1=yes; 0=no)
-void push_report_uint32(const char name[6], uint32_t value, uint8_t retained)
+void push_report_uint32_P(PGM_P name, uint8_t chan, uint32_t value, uint8_t retained)
 {
-  struct report_struct *r = &(report_buffer[report_write_index]);
   if (FULL) return;
-  strncpy(r->name,name,5);
-  r->name[6] = 0;
-  r->type = UINT32_TYPE;
-  r->value.uint32val = value;
-  r->digits = retained ? 0x80 : 0x00;
-  report_write_index = WRAP(report_write_index+1);
+  push_report(name, chan, UINT32_TYPE | (retained ? REPORT_RETAINED : 0))->value.uint32val = value;
+}
+
+// push_report_time() - push the device time of a report batch, as whole
+//   seconds (tsec) and microseconds (tus)
+//   t - [us] device time (see get_time_us()), less than 71 minutes ago
+void push_report_time(uint64_t t)
+{
+  uint32_t sec, usec;
+  split_time(t, &sec, &usec);
+  push_report_uint32("tsec", sec, 0);
+  push_report_uint32("tus", usec, 0);
 }
 
 // ============================= SEND REPORTS FROM RING BUFFER
 
 // send_report() - send a single report from the ring buffer
-//   data is sent over the Serial() line.
+//   data is queued for the serial port, once there is room for all of it
 void send_report()
 {
-  uint8_t retained, digits;
+  uint8_t format, digits, i;
   struct report_struct *r = &(report_buffer[report_read_index]);
-  if (EMPTY) return;
+  char buf[32];  // "_name:" + float + ","
+  uint8_t n = 0;
+  char c;
+#ifdef FAST_ALARM
+  // Alarms go out ahead of the queued reports, between two lines
+  if (!report_line_open && send_alarm()) return;
+#endif
+  if (EMPTY) {
+    report_held = 0;
+    return;
+  }
   
-  digits   = r->digits;
-  retained = r->digits & 0x80;
-  digits   &= 0x7f;
+  format = r->format;
+  digits = (format >> REPORT_DIGITS_SHIFT) & 0x0f;
 
   // Output depends on the data type
-  switch(r->type) {
+  switch(format & REPORT_TYPE_MASK) {
     case VOID_TYPE: break;  // VOID_TYPE: do nothing
-    case BREAK_TYPE: Serial.println(""); break; // BREAK_TYPE: line break
+    case BREAK_TYPE: buf[n++] = '\r'; buf[n++] = '\n'; break; // BREAK_TYPE: line break
 
     // Numerical types
     default:
-      if (retained) Serial.print("_");
-      Serial.print(r->name);
-      Serial.print(":");
-      switch(r->type) {
+      if (format & REPORT_RETAINED) buf[n++] = '_';
+      for (i = 0; i<5 && (c = pgm_read_byte(r->name+i)); i++) buf[n++] = c;
+      if (r->chan != REPORT_NOCHAN) {
+        if (r->chan >= 10) buf[n++] = '0' + r->chan/10;
+        buf[n++] = '0' + r->chan%10;
+      }
+      buf[n++] = ':';
+      switch(format & REPORT_TYPE_MASK) {
         case FLOAT_TYPE: 
-          if (digits > 0) Serial.print(r->value.floatval,digits);
-          else            Serial.print(r->value.floatval); 
+          n += fmt_float(buf+n, r->value.floatval, (digits > 0) ? digits : 2);
           break;
-        case INT32_TYPE:  Serial.print(r->value.int32val); break;
-        case UINT32_TYPE: Serial.print(r->value.uint32val); break;
+        case INT32_TYPE:  n += fmt_int32(buf+n, r->value.int32val); break;
+        case UINT32_TYPE: n += fmt_uint32(buf+n, r->value.uint32val); break;
       }
-      Serial.print(",");
+      buf[n++] = ',';
       break;
   }
 
+  // Try again later if the serial port is busy
+  if (uart_room() < n) return;
+  uart_write(buf, n);
+
+  report_line_open = ((format & REPORT_TYPE_MASK) != BREAK_TYPE);
+
   // Reset this ring buffer entry
-  r->name[0] = 0; r->type = VOID_TYPE;
+  r->format = VOID_TYPE;
   report_read_index = WRAP(report_read_index+1);
 }
-
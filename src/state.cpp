@@ -11,32 +11,99 @@
 #include "cont.h"
 #include "cal.h"
 
-// Cumulative uptime in seconds
-uint32_t uptime = 0;
 // Currently accumulated reading stats
 struct reading_stats vstats, istats[N_CUR_CHAN];
 
-// Which channels to notice
-const uint8_t adc_notice_chan[N_CUR_CHAN] = ADC_NOTICE_CHAN;
+// Which channels to notice; may be changed at runtime
+uint8_t adc_notice_chan[N_CUR_CHAN] = ADC_NOTICE_CHAN;
+
+// Report periods [us]; may be changed at runtime
+uint32_t report_vrms_period = REPORT_VRMS_PERIOD;
+uint32_t report_pow_period = REPORT_POW_PERIOD;
+uint32_t report_energy_period = REPORT_ENERGY_PERIOD;
+// Requested sampling profile; applied at the next window boundary
+uint8_t sample_profile_req = ADC_PROFILE;
 
 // Calibration factors
 float VCAL, VCAL2;
-const float ical[N_CUR_CHAN] = {ICAL0, ICAL1, ICAL2, ICAL3}; // Current calibration
-const float iphcal[N_CUR_CHAN] = {IPH0, IPH1, IPH2, IPH3};   // Phase offset calibration
+const float ical[N_CUR_CHAN] PROGMEM = ICAL_CHANS;   // Current calibration
+const float iphcal[N_CUR_CHAN] PROGMEM = IPH_CHANS;  // Phase offset calibration
 float cosph[N_CUR_CHAN], sinph[N_CUR_CHAN];                  // Phase cos() and sin() factors
 
 // Running average mean voltage level, and current level
 float vavg_ra = 0.0;
-float iavg_ra[N_CUR_CHAN] = {0,0,0,0};
+float iavg_ra[N_CUR_CHAN] = {0};
+
+// Roll-up of the accumulation windows over the reporting intervals, so
+// that each report describes its whole interval rather than the last
+// window.  Every window is merged into the voltage interval, weighted by
+// its duration; when the voltage is reported, the voltage interval is
+// merged into the power interval.  Power is always reported together
+// with the voltage, so the power interval is made of whole voltage
+// intervals.  The current channels are merged straight into the power
+// interval, each with its own duration, as a channel's line may be sent
+// after further windows (see queue_reports()).  Mean squares are summed,
+// not RMS values, and the peaks are taken from the readings' minimum and
+// maximum.
+struct rollup_struct {
+  float t;           // [sec] duration
+  float v2t;         // [V^2 sec] time integral of the squared RMS voltage
+};
+struct rollup_chan_struct {
+  float t;           // [sec] duration
+  float pact, pret;  // [W sec], [VAR sec] active and reactive energy
+  float i2t;         // [A^2 sec] time integral of the squared RMS current
+  int16_t ipeak;     // [ADU] peak current
+};
+struct rollup_struct roll_vrms, roll_pow;
+uint16_t roll_vpp = 0;      // [ADU] largest peak-to-peak voltage, voltage interval
+uint16_t roll_ncycles = 0;  // mains cycles, voltage interval
+struct rollup_chan_struct roll_chan[N_CUR_CHAN];
+
+// Reports due from the windows, waiting for queue_reports()
+#define DUE_VOLTAGE 0x01
+#define DUE_POWER   0x02
+#define DUE_ENERGY  0x04  // in the metadata line, as are the following
+#define DUE_VDEL    0x08
+#define DUE_IMSK    0x10
+#define DUE_PROF    0x20
+#define DUE_META    0x40
+uint8_t report_due = 0;
+uint64_t report_due_time = 0;  // [us] device time of the last window
+// Next channel of the power report to queue; N_CUR_CHAN when none is due
+uint8_t report_chan = N_CUR_CHAN;
+// Next line of the reply to a query: 0 for the voltage and energy, then
+// one per channel; QUERY_IDLE when no query is waiting
+#define QUERY_IDLE 0xff
+uint8_t query_line = QUERY_IDLE;
 
 // Running counters for statistics accmulation
 uint32_t sample_period = 0;
 uint32_t vmains_period = 0;
 float vmains_fprod = 0.0;
 
-// Start of accumulation time
+// Start of accumulation time [us].  Reading times are the low 32 bits of
+// the device time (see get_time_us()); differences are exact for windows
+// much shorter than the 71 minute wrap.  A reading time may be zero, so
+// start_set tells whether start_time holds one yet.
 uint32_t start_time = 0;
+uint8_t start_set = 0;
 uint16_t ncycles = 0;
+// Readings in the current per-cycle partial sums, and whether they span
+// exactly one mains cycle (zero crossing to zero crossing)
+uint16_t nfold = 0;
+uint8_t cycle_whole = 0;
+// Time of the readings lost to ring buffer overflow in this window [us],
+// counted at the sample period in force when they were lost; and in total
+// since reset [ms], with the microseconds left over
+uint32_t lost_us = 0;
+uint32_t lost_ms_total = 0;
+uint16_t lost_us_frac = 0;
+// Readings still to discard after a sampling profile change, and the
+// time they took in this window [us].  They are not lost to overflow, so
+// they are kept out of _lost.
+uint8_t rate_settle = 0;
+uint32_t settle_us = 0;
 
 // =========================================================
 // Utility stuff
@@ -44,9 +111,28 @@ uint16_t ncycles = 0;
 int16_t vhist_ring[N_VHIST_RING];
 uint8_t vhist_cur = N_VHIST_RING;
 uint8_t vhist_lookback = 0;
+#ifdef THREE_PHASE
+// Leg of each current channel, and the voltage history lookback giving
+// the voltage of that leg and its quadrature
+const uint8_t ct_leg[N_CUR_CHAN] = CT_LEG;
+#ifndef ADC_INTERLEAVE
+uint8_t vhist_leg[N_CUR_CHAN], vhist_legdel[N_CUR_CHAN];
+#endif
+#endif
+#ifdef ADC_INTERLEAVE
+// Interpolated voltage history lookbacks [1/256 sample period], counted
+// from the voltage sample of the reading: the quadrature of the voltage,
+// and for each current channel the quadrature at the time of its own
+// sample (THREE_PHASE: of its leg), and its leg voltage.
+uint16_t vlook_vdel = 0;
+uint16_t vlook_del[N_CUR_CHAN];
+#ifdef THREE_PHASE
+uint16_t vlook_leg[N_CUR_CHAN];
+#endif
+#endif
 
 // Accumulated energy usage for active and reactive components...
-int16_t energy_fracac = 0, energy_fracre = 0;   // .. fractional
+int32_t energy_fracac = 0, energy_fracre = 0;   // .. fractional
 int32_t energy_active = 0, energy_reactive = 0; // .. integer
 
 // store_vhist() - store voltage reading
@@ -57,39 +143,214 @@ void store_vhist(int16_t val)
   vhist_cur = (vhist_cur + 1) % N_VHIST_RING;
   vhist_ring[vhist_cur] = val;
 }
+// store_vhist_gap() - store voltage reading that follows lost readings
+//   val - voltage value to store
+//   gap - number of readings lost just before this one
+// The lost readings are filled by linear interpolation, so that lookback
+// still counts sample periods across the gap.
+void store_vhist_gap(int16_t val, uint8_t gap)
+{
+  int16_t last = vhist_ring[vhist_cur % N_VHIST_RING];
+  int16_t dv = val - last;
+  uint16_t i = 1;  // 16 bits, so that the loop ends when gap is 255
+
+  // Only the most recent entries survive in the ring
+  if (gap >= N_VHIST_RING) i = gap - N_VHIST_RING + 2;
+  for (; i <= gap; i++) {
+    store_vhist(last + (int16_t) ((int32_t) dv * i / (gap + 1)));
+  }
+  store_vhist(val);
+}
 // retrieve_vhist() - retrieve voltage reading from history
 //   ilookback - look back this many samples
 //   returns: voltage value at requested lookback time
 int16_t retrieve_vhist(uint8_t ilookback)
 {
-  uint8_t cur = (vhist_cur + N_VHIST_RING - ilookback);
+  uint16_t cur = (vhist_cur + N_VHIST_RING - ilookback);
   while (cur >= N_VHIST_RING) cur -= N_VHIST_RING;
   return vhist_ring[cur];
 }
+#ifdef ADC_INTERLEAVE
+// retrieve_vhist_frac() - retrieve voltage from history, interpolated
+//   look - look back this many samples, in 1/256 of a sample
+//   returns: voltage value at requested lookback time
+int16_t retrieve_vhist_frac(uint16_t look)
+{
+  uint8_t k = look >> 8, w = look & 0xff;
+  int16_t v0 = retrieve_vhist(k);
+  int16_t v1 = retrieve_vhist(k+1);
+  return v0 + (int16_t) (((int32_t) (v1 - v0) * w) >> 8);
+}
+#endif
 // init_stats() - initialize statistics counters
 //   s - statistics counters to initialize
+// The results of the last window (val_rms, pow_ac, pow_re) are kept.
 void init_stats(struct reading_stats *s)
 {
   uint8_t present = s->present;
+  float val_rms = s->val_rms, pow_ac = s->pow_ac, pow_re = s->pow_re;
   memset(s,0,sizeof(*s));
   s->present = present;
+  s->val_rms = val_rms; s->pow_ac = pow_ac; s->pow_re = pow_re;
 }
 
-// update_uptime() - update current uptime 
-//   returns: uptime in seconds
-uint32_t update_uptime(void)
+// =========================================================
+// Accumulation kernels.  accum_stats() runs for every reading, so rather
+// than looping over all current channels and testing .present each time,
+// a straight-line kernel is generated at compile time for every presence
+// mask.  Each kernel has the accumulator inlined for exactly the channels
+// in its mask, working on fixed addresses, with no call or return per
+// channel.  The kernel is chosen through accum_kernel whenever presence
+// changes.
+//
+// Not measured: this was written without an AVR toolchain, so the
+// figures below are estimates.  A fixed-address channel should save
+// roughly 15 cycles of index and address arithmetic per reading over the
+// old loop (~60 cycles per reading with all four channels present, ~1.5%
+// CPU at ADC_PRESCALAR=64), and an absent channel ~20 cycles of loop
+// overhead.  The flash cost is one inlined accumulator per channel per
+// mask, 32 in all.  host/kernelsize.sh lists the .text of each kernel in
+// a build; for the cycles, count the instructions of
+// accum_kernel_mask<0xf> in avr-objdump -d against those of the loop in
+// accum_stats() of the build before the kernels.
+//
+// A table of 2^15 kernels is out of the question for the Mega board
+// profile, so there the generic kernel walks a list of the present
+// channels instead.  Its readings arrive 16/5 as slowly per channel, so
+// the extra ~15 cycles per channel are easily afforded (see the cycle
+// budget in cont.h).
+typedef void (*accum_kernel_t)(const int16_t *vals, int16_t vval, int16_t vdel);
+
+// accum_one() - accumulate one reading of current channel j
+// Always inlined, so that for a constant j it works on fixed addresses.
+static inline __attribute__((always_inline))
+void accum_one(uint8_t j, const int16_t *vals, int16_t vval, int16_t vdel)
 {
-  uint32_t new_millis = millis();
-  static uint32_t old_millis = 0;
+  struct reading_stats *s = &(istats[j]);
+  int16_t val = vals[j+1];
+
+#ifdef ADC_INTERLEAVE
+  // Voltage at the time of this current sample: the mean of the voltage
+  // samples on either side of it, and its quadrature from the history
+  vval = (vals[j == 0 ? 0 : VAFTER_SLOT(j-1)] + vals[VAFTER_SLOT(j)]) >> 1;
+  vdel = retrieve_vhist_frac(vlook_del[j]);
+#endif
+#ifdef THREE_PHASE
+  // Voltage of this channel's leg, from the voltage history
+  if (ct_leg[j] != 1) {
+#ifdef ADC_INTERLEAVE
+    vval = retrieve_vhist_frac(vlook_leg[j]);
+#else
+    vval = retrieve_vhist(vhist_leg[j]);
+    vdel = retrieve_vhist(vhist_legdel[j]);
+#endif
+  }
+#endif
 
-  // This is the upper part that counts rollovers
-  uint16_t upper = (uptime & 0xffc00000); 
-  if (new_millis < old_millis) upper += 0x00400000; // millis() rollover
+  // save old value and current value
+  s->oldval = s->val;
+  s->val = val;
 
-  uptime = upper | (new_millis >> 10);
-  old_millis = new_millis;
-  
-  return uptime;
+  // Accumulate ... 
+  s->val_sum += val;  // ... average current
+  mac16x16_32(s->val2_sum,val,val);    // .. squared current
+  mac16x16_32(s->prod_sum,val,vval);   // .. current x vnow
+  mac16x16_32(s->proddel_sum,val,vdel);// .. current x vthen
+
+  // min/max statistics
+  if (val > s->val_max) s->val_max = val;
+  if (val < s->val_min) s->val_min = val;
+}
+
+#if N_CUR_CHAN == 4
+// accum_chans<MASK,J>::run() - inlined accumulation of channels J.. in MASK
+template<uint8_t MASK, uint8_t J> struct accum_chans {
+  static inline __attribute__((always_inline))
+  void run(const int16_t *vals, int16_t vval, int16_t vdel) {
+    if (MASK & (1 << J)) accum_one(J, vals, vval, vdel);
+    accum_chans<MASK, J+1>::run(vals, vval, vdel);
+  }
+};
+template<uint8_t MASK> struct accum_chans<MASK, N_CUR_CHAN> {
+  static inline __attribute__((always_inline))
+  void run(const int16_t *vals, int16_t vval, int16_t vdel) { }
+};
+
+// accum_kernel_mask<MASK>() - kernel for one presence mask
+template<uint8_t MASK>
+void accum_kernel_mask(const int16_t *vals, int16_t vval, int16_t vdel)
+{
+  accum_chans<MASK, 0>::run(vals, vval, vdel);
+}
+
+// Kernel for each presence mask (bit j = current channel j)
+const accum_kernel_t accum_kernels[1 << N_CUR_CHAN] PROGMEM = {
+  accum_kernel_mask<0x0>, accum_kernel_mask<0x1>, accum_kernel_mask<0x2>, accum_kernel_mask<0x3>,
+  accum_kernel_mask<0x4>, accum_kernel_mask<0x5>, accum_kernel_mask<0x6>, accum_kernel_mask<0x7>,
+  accum_kernel_mask<0x8>, accum_kernel_mask<0x9>, accum_kernel_mask<0xa>, accum_kernel_mask<0xb>,
+  accum_kernel_mask<0xc>, accum_kernel_mask<0xd>, accum_kernel_mask<0xe>, accum_kernel_mask<0xf>
+};
+// Kernel currently in use
+accum_kernel_t accum_kernel = accum_kernel_mask<0>;
+
+#else
+// Present channels, for the generic kernel
+uint8_t accum_list[N_CUR_CHAN];
+uint8_t accum_nlist = 0;
+
+// accum_kernel_list() - generic kernel for the channels in accum_list[]
+void accum_kernel_list(const int16_t *vals, int16_t vval, int16_t vdel)
+{
+  uint8_t k;
+  for (k = 0; k<accum_nlist; k++) accum_one(accum_list[k], vals, vval, vdel);
+}
+// Kernel currently in use
+accum_kernel_t accum_kernel = accum_kernel_list;
+#endif
+
+// fold_stats() - fold per-cycle partial sums into the window sums
+//   s - statistics counters to fold
+void fold_stats(struct reading_stats *s)
+{
+  add40(&(s->val2_acc), s->val2_sum);
+  add40(&(s->prod_acc), s->prod_sum);
+  add40(&(s->proddel_acc), s->proddel_sum);
+  s->val2_sum = 0; s->prod_sum = 0; s->proddel_sum = 0;
+}
+
+// update_present_chans() - select the accumulation kernel for the
+//   present current channels
+//   returns: bit mask of present channels (bit j = current channel j)
+chanmask_t update_present_chans(void)
+{
+  uint8_t j;
+  chanmask_t mask = 0;
+#if N_CUR_CHAN == 4
+  for (j = 0; j<N_CUR_CHAN; j++) {
+    if (istats[j].present) mask |= (1 << j);
+  }
+  accum_kernel = (accum_kernel_t) pgm_read_ptr(&(accum_kernels[mask]));
+#else
+  accum_nlist = 0;
+  for (j = 0; j<N_CUR_CHAN; j++) {
+    if (istats[j].present) {
+      mask |= ((chanmask_t) 1 << j);
+      accum_list[accum_nlist++] = j;
+    }
+  }
+#endif
+#ifdef FAST_ALARM
+  update_alarm_chans(mask);
+#endif
+  return mask;
+}
+
+// query_registers() - report the current registers: the results of the
+//   last accumulation window and the energy totals.  The reply is queued
+//   by queue_reports().
+void query_registers(void)
+{
+  query_line = 0;
 }
 
 // Initialize calibration constants
@@ -119,17 +380,18 @@ void init_cal(void)
 uint8_t stabilize_inputs(struct adc_readings_struct *reading, 
                          uint8_t curstate, uint8_t nextstate)
 {
-  static uint16_t nreadings = 0;
+  static uint32_t t_start = 0;
+  static uint8_t started = 0;
 
   // Make sure all ADC channels are enabled
   init_adc_chans();
-  nreadings++;
-  // AVR ADC reads at 9615 Hz for default ADC prescalar of 128
-  // Use desired stabilization duration to compute number of cycles
-  if (nreadings < ((uint16_t) (9615 / N_ADC_CHAN) * (128/ADC_PRESCALAR) * (STABILIZE_DURATION/1000000))) return curstate;
+  // Wait for the stabilization duration, by the reading timestamps, so
+  // that this does not depend on the sampling rate
+  if (!started) { t_start = reading->t; started = 1; }
+  if ((reading->t - t_start) < STABILIZE_DURATION) return curstate;
   
-  Serial.println("#STATE_STAB complete");
-  nreadings = 0;
+  uart_println("#STATE_STAB complete");
+  started = 0;
   return nextstate;
 }
 
@@ -178,11 +440,13 @@ uint8_t scan_inputs(struct adc_readings_struct *reading,
     }
   }
   nreadings ++;
-  if (nreadings < 4000) return curstate;
+  // Scan for SCAN_DURATION by the reading timestamps, whatever the
+  // sampling rate; cont.h checks that the counts and sums cannot overflow
+  if ((reading->t - start_time) < SCAN_DURATION) return curstate;
 
-  Serial.println("#STATE_SCAN complete");
+  uart_println("#STATE_SCAN complete");
   sample_period = (reading->t - start_time) / nreadings;
-  Serial.print("#tsample = ");Serial.println(sample_period);
+  uart_print("#tsample = ");uart_print_uint(sample_period);uart_println("");
   
   if (vstats.present || (vstats.n > 0 && vstats.val_sum != 0)) {
     int16_t mean = vstats.val_sum / vstats.n;
@@ -190,9 +454,9 @@ uint8_t scan_inputs(struct adc_readings_struct *reading,
     set_adc_offset(0, mean);
     vstats.val_sum = 0; vstats.n = 0;
         
-    Serial.print("#vstats.val_mean = ");Serial.print(mean);Serial.print(" min/max=");Serial.print(vstats.val_min);Serial.print("/");Serial.println(vstats.val_max);
+    uart_print("#vstats.val_mean = ");uart_print_int(mean);uart_print(" min/max=");uart_print_int(vstats.val_min);uart_print("/");uart_print_int(vstats.val_max);uart_println("");
   } else {
-    Serial.println("#ERROR - no voltage input");
+    uart_println("#ERROR - no voltage input");
     return STATE_STAB; // Return to the signal stabilization phase
   }
   for (j = 0; j<N_CUR_CHAN; j++) {
@@ -203,7 +467,7 @@ uint8_t scan_inputs(struct adc_readings_struct *reading,
       istats[j].present = 1;
       set_adc_offset(j+1, mean);
       istats[j].val_sum = 0; istats[j].n = 0;
-      Serial.print("#istats[");Serial.print(j);Serial.print("].val_mean = ");Serial.print(mean);Serial.print(" min/max=");Serial.print(istats[j].val_min);Serial.print("/");Serial.println(istats[j].val_max);
+      uart_print("#istats[");uart_print_int(j);uart_print("].val_mean = ");uart_print_int(mean);uart_print(" min/max=");uart_print_int(istats[j].val_min);uart_print("/");uart_print_int(istats[j].val_max);uart_println("");
     } else {
         // Found no signal on this input channel, do we disable it?
         // The answer is, as we get more rapid-fire ADC readings, we tend to overflow
@@ -214,13 +478,16 @@ uint8_t scan_inputs(struct adc_readings_struct *reading,
     }
   }
   if (n_cur_chan == 0) {
-    Serial.println("#ERROR - no current inputs enabled");
+    uart_println("#ERROR - no current inputs enabled");
     return STATE_STAB;  // Return to the signal stabilization phase, look for inputs
   }
 
+  push_report_int32("imsk", update_present_chans(), 1);
+  push_report_break();
+
   nreadings = 0;  // Initialize to zero in case we come back to this state
   first = 1;
-  start_time = 0;
+  start_set = 0;
   init_stats(&vstats);
   return nextstate;
 }
@@ -242,13 +509,13 @@ uint8_t zero_crossing(struct adc_readings_struct *reading, uint8_t nclear,
   nreadings ++;
 
   // Store voltage reading in ring buffer
-  store_vhist(vstats.val);
+  store_vhist_gap(vstats.val, reading->gap);
 
   // Clear out the input queue at least nclear items
   if (nreadings > nclear &&
       vstats.oldval < 0 && vstats.val >= 0) {
-      Serial.print("#STATE_ZERO - t=");
-      Serial.println(reading->t - old_time);
+      uart_print("#STATE_ZERO - t=");
+      uart_print_uint(reading->t - old_time); uart_println("");
       max_adc_depth = 0;
       old_time = reading->t;
       nreadings = 0;
@@ -267,13 +534,16 @@ uint8_t zero_crossing(struct adc_readings_struct *reading, uint8_t nclear,
 uint8_t accum_freq(struct adc_readings_struct *reading, 
                    uint8_t curstate, uint8_t nextstate)
 {  
-  if (start_time == 0) start_time = reading->t; // GLOBAL: start_time
+  if (!start_set) { // GLOBAL: start_time
+    start_time = reading->t;
+    start_set = 1;
+  }
   
   vstats.oldval = vstats.val;
   vstats.val = reading->vals[0];
 
   // Store voltage reading in ring buffer
-  store_vhist(vstats.val);
+  store_vhist_gap(vstats.val, reading->gap);
 
   // Wait for a zero crossing
   if (! (vstats.oldval < 0 && vstats.val >= 0)) return curstate;
@@ -284,47 +554,147 @@ uint8_t accum_freq(struct adc_readings_struct *reading,
   return STATE_CALF; // Advance to calculate info from this accumulation
 }
 
-// STATE_CALF: Calculate mains frequency
-//   reading - current ADC reading
-//   curstate - current state
-//   nextstate - default next state
-uint8_t calc_freq(struct adc_readings_struct *reading,
-                  uint8_t curstate, uint8_t nextstate)
+#ifdef ADC_INTERLEAVE
+// vhist_frac_lookback() - voltage history lookback for a time interval
+//   t - time to look back [us]
+//   returns: lookback in 1/256 of a sample period
+uint16_t vhist_frac_lookback(float t)
 {
-  uint8_t j;
+  float look = t * (float) 256.0 / sample_period + (float) 0.5;
+  if (look < 0) look = 0;
+  if (look >= (float) (N_VHIST_RING-1) * 256) {
+    uart_println("#ERROR - voltage history too short for lookback");
+    look = (N_VHIST_RING-1) * 256 - 1;
+  }
+  return (uint16_t) look;
+}
+#endif
 
-  // Determine the mains period (1/frequency)
-  vmains_period = (reading->t - start_time) / ncycles; // GLOBAL: vmains_period
-  Serial.print("#STATE_FREQ:vmains_period=");
-  Serial.println(vmains_period);
+// derive_rate_constants() - derive the constants that depend on the
+//   sample period and the mains period: the quadrature lookback, and the
+//   phase correction factors of each channel
+void derive_rate_constants(void)
+{
+  uint8_t j;
 
   // Compute one quarter of mains period, in units of sample period,
   // the 2*sample_period is for rounding to the nearest sample
   // One quarter of the mains period is used for lookback when computing
   // in-phase and quadrature products.
   vhist_lookback = (vmains_period + 2*sample_period) / (sample_period*4); // GLOBAL: vhist_lookback
-  Serial.print("#STATE_FREQ:vmains_quadlookback=");
-  Serial.println(vhist_lookback);
+#ifdef ADC_INTERLEAVE
+  vlook_vdel = vhist_frac_lookback((float) vmains_period / 4);
+#endif
 
   // Compute cos() and sin() phase correction factors.  We use the
   // known sample period to compute the offset between the current
   // sample and the voltage sample, plus any calibration phase offset.
   for (j=0; j<N_CUR_CHAN; j++) {
-    float ph = M_PI/180.0*(PHV + iphcal[j]) 
-               + (float) 2.0 * M_PI * (j+1) * sample_period / N_ADC_CHAN / vmains_period;
-    cosph[j] = cos(ph);
-    sinph[j] = sin(ph);
+    float ph = M_PI/180.0*(PHV + pgm_read_float(&iphcal[j]));
+    float gain = 1.0;
+#ifdef ADC_INTERLEAVE
+    // The current is paired with the voltage at its own sample time, so
+    // no rotation is needed for the offset.  Averaging two voltage samples
+    // reduces the amplitude of the fundamental by cos(pi*d/T), for samples
+    // d apart, which is restored here.  The history lookbacks are counted
+    // from the current sample.
+    {
+      float toff = (float) sample_period * adc_chan_offset[j] / ADC_NCONV;
+      float tleg = 0;
+#ifdef THREE_PHASE
+      tleg = (float) vmains_period * (ct_leg[j]-1) / 3;
+      vlook_leg[j] = vhist_frac_lookback(tleg - toff);
+      if (ct_leg[j] == 1)
+#endif
+      gain = 1.0 / cos(M_PI * 2.0 * sample_period / ADC_NCONV / vmains_period);
+      vlook_del[j] = vhist_frac_lookback(tleg + (float) vmains_period / 4 - toff);
+    }
+#else
+    ph += (float) 2.0 * M_PI * adc_chan_offset[j] * sample_period / ADC_NCONV / vmains_period;
+#ifdef THREE_PHASE
+    // The leg voltage is taken a whole number of samples back; rotate by
+    // the difference from the exact 1/3 or 2/3 cycle
+    {
+      uint32_t tleg = vmains_period * (ct_leg[j]-1) / 3;
+      vhist_leg[j] = (tleg + sample_period/2) / sample_period;
+      if (vhist_leg[j] + vhist_lookback >= N_VHIST_RING) {
+        uart_println("#ERROR - voltage history too short for leg lookback");
+        vhist_leg[j] = N_VHIST_RING - 1 - vhist_lookback;
+      }
+      vhist_legdel[j] = vhist_leg[j] + vhist_lookback;
+      ph += (float) 2.0 * M_PI * ((float) vhist_leg[j]*sample_period - tleg) / vmains_period;
+    }
+#endif
+#endif
+    cosph[j] = gain * cos(ph);
+    sinph[j] = gain * sin(ph);
   }
+}
+
+// STATE_CALF: Calculate mains frequency
+//   reading - current ADC reading
+//   curstate - current state
+//   nextstate - default next state
+uint8_t calc_freq(struct adc_readings_struct *reading,
+                  uint8_t curstate, uint8_t nextstate)
+{
+  // Determine the mains period (1/frequency)
+  vmains_period = (reading->t - start_time) / ncycles; // GLOBAL: vmains_period
+  uart_print("#STATE_FREQ:vmains_period=");
+  uart_print_uint(vmains_period); uart_println("");
+
+  derive_rate_constants();
+  uart_print("#STATE_FREQ:vmains_quadlookback=");
+  uart_print_uint(vhist_lookback); uart_println("");
 
   // Reset global variables for next go round
   ncycles = 0;       // GLOBAL: ncycles
-  start_time = 0;    // GLOBAL: start_time
+  start_set = 0;     // GLOBAL: start_time
   max_adc_depth = 0; // GLOBAL: max_adc_depth
   return nextstate;
 }
 
 
 
+// fold_all_stats() - fold the per-cycle sums of all channels
+void fold_all_stats(void)
+{
+  uint8_t j;
+  fold_stats(&vstats);
+  for (j = 0; j<N_CUR_CHAN; j++) {
+    if (istats[j].present) fold_stats(&istats[j]);
+  }
+  nfold = 0;
+#ifdef FAST_ALARM
+  fold_alarm();
+#endif
+}
+
+// settle_rate() - handle a reading after a sampling profile change
+//   reading - current ADC reading
+// The readings are not accumulated until the ring buffer holds only
+// readings at the new rate and the voltage history has been refilled.
+// The switch is made at a window boundary, so the time they took is the
+// time since start_time.  The new sample period is the nominal reading
+// period, which the device clock is counted in, and the constants that
+// depend on it are derived again.  The reading period is then measured
+// against Timer1 again, to calibrate device time.
+static void settle_rate(struct adc_readings_struct *reading)
+{
+  vstats.oldval = vstats.val;
+  vstats.val = reading->vals[0];
+  store_vhist(vstats.val);
+  if (vstats.oldval < 0 && vstats.val >= 0) ncycles++;
+  cycle_whole = 0;
+  if (--rate_settle > 0) return;
+
+  settle_us = reading->t - start_time;
+  sample_period = adc_reading_usec;
+  derive_rate_constants();
+  vmains_fprod = 0; // Measure the quadrature correction again
+  calibrate_clock();
+}
+
 // =========================================================
 // STATE_STAT: Main state, accumulate statistics
 //   reading - current ADC reading
@@ -335,13 +705,27 @@ uint8_t accum_stats(struct adc_readings_struct *reading, uint32_t tdur,
                       uint8_t curstate, uint8_t nextstate)
 {
   int16_t vval, vdel;
-  uint8_t j;
   uint8_t zero_crossing;
 
   // Initialize GLOBAL variables start_time and ncycles
-  if (start_time == 0) {
+  if (!start_set) {
     start_time = reading->t;
+    start_set = 1;
     ncycles = 0; 
+    nfold = 0;
+    cycle_whole = 0;
+  }
+
+  // Sampling profile was just changed
+  if (rate_settle) {
+    settle_rate(reading);
+    return curstate;
+  }
+  // Readings were lost just before this one.  The sums only cover the
+  // readings received, and the mains cycle in progress is incomplete.
+  if (reading->gap) {
+    lost_us += reading->gap * sample_period;
+    cycle_whole = 0;
   }
 
   // Voltage statistics
@@ -352,8 +736,13 @@ uint8_t accum_stats(struct adc_readings_struct *reading, uint32_t tdur,
 
     // Store voltage reading in ring buffer, and retrive lookback
     // value corresponding to ~90 degrees out of phase.
-    store_vhist(vval);
+    if (reading->gap) store_vhist_gap(vval, reading->gap);
+    else store_vhist(vval);
+#ifdef ADC_INTERLEAVE
+    vdel = retrieve_vhist_frac(vlook_vdel);
+#else
     vdel = retrieve_vhist(vhist_lookback);
+#endif
 
     // Accumulate...
     vstats.val_sum += vval;  // ... average voltage
@@ -372,35 +761,36 @@ uint8_t accum_stats(struct adc_readings_struct *reading, uint32_t tdur,
     if (vval < vstats.val_min) vstats.val_min = vval;
   }
 
-  // Compute current stats
-  for (j = 0; j<N_CUR_CHAN; j++) {
-    int16_t val = reading->vals[j+1];
-    if (istats[j].present) {
-      // save old value and current value
-      istats[j].oldval = istats[j].val;
-      istats[j].val = val;
-
-      // Accumulate ... 
-      istats[j].val_sum += val;  // ... average current
-      //istats[j].val2_sum += (int32_t) val*val;
-      //istats[j].prod_sum += (int32_t) val*vval;
-      //istats[j].proddel_sum += (int32_t) val*vdel;
-      
-      mac16x16_32(istats[j].val2_sum,val,val);    // .. squared current
-      mac16x16_32(istats[j].prod_sum,val,vval);   // .. current x vnow
-      mac16x16_32(istats[j].proddel_sum,val,vdel);// .. current x vthen
-
-      istats[j].n ++;
-    }
-  }
+  // Compute current stats; only present channels are visited
+  accum_kernel(reading->vals, vval, vdel);
+#ifdef FAST_ALARM
+  if (alarm_nres) accum_resid(reading->vals);
+#endif
 
   // Determine if we are at zero-crossing
   zero_crossing = (vstats.oldval < 0 && vstats.val >= 0);
-  // If not, then return immediately
-  if (!zero_crossing) return curstate;
+  nfold ++;
+#ifdef FAST_ALARM
+  // Check the alarm thresholds every half cycle, before the partial sums
+  // are folded (or at least before they are full, without a voltage)
+  if (zero_crossing || (vstats.oldval >= 0 && vstats.val < 0) ||
+      nfold >= FOLD_READINGS) check_alarm(reading->t, nfold);
+#endif
+  // If not, then return immediately (unless the partial sums are full)
+  if (!zero_crossing) {
+    if (nfold < FOLD_READINGS) return curstate;
+    fold_all_stats();
+    cycle_whole = 0;
+    return curstate;
+  }
 
   // We are at a zero crossing, so bunch more calculations could be coming
   ncycles++;
+#ifdef CYCLE_ANALYSIS
+  if (cycle_whole) snap_cycle(reading->t, nfold);
+#endif
+  fold_all_stats();
+  cycle_whole = 1;
 
   // Wait duration of at least tdur
   if ((reading->t - start_time) < tdur) return curstate;
@@ -410,6 +800,170 @@ uint8_t accum_stats(struct adc_readings_struct *reading, uint32_t tdur,
   return STATE_CALS;
 }
 
+// =========================================================
+// Reporting of the accumulation windows.  calc_stats() marks the reports
+// that fall due; queue_reports() queues each line once the report ring
+// has room for it (see report_wait()).  A line that waits is tried again
+// from loop(), while further windows keep rolling into its interval.
+
+// queue_reports() - queue the lines that are due: the window's voltage
+//   and power, the metadata, a query reply, the demand and the per-cycle
+//   distribution
+void queue_reports(void)
+{
+  uint8_t j;
+
+  // Reporting: voltage (and always report voltage with current), over the
+  // voltage interval, which then goes into the power interval.  It waits
+  // for the power lines of the last report.
+  if ((report_due & (DUE_VOLTAGE | DUE_POWER)) && report_chan == N_CUR_CHAN &&
+      report_wait(REPORT_VOLTAGE)) {
+    float vrms = sqrt(roll_vrms.v2t / roll_vrms.t);
+    float crest_factor = 1.0;
+    push_report_float("vrms", vrms, 2, 0);
+    if (roll_ncycles > 0) push_report_float("vfrq", roll_ncycles / roll_vrms.t, 3, 0);
+    // Crest factor = SEMI-AMPLITUDE / RMS = 1.414 for sine wave
+    if (vrms > 100.0) crest_factor = roll_vpp*VCAL/2.0 / vrms;
+    push_report_float("vcrs",crest_factor, 3, 0);
+    roll_pow.t   += roll_vrms.t;
+    roll_pow.v2t += roll_vrms.v2t;
+    memset(&roll_vrms,0,sizeof(roll_vrms));
+    roll_vpp = 0;
+    roll_ncycles = 0;
+
+    if (report_due & DUE_POWER) {
+#ifdef THREE_PHASE
+      // Three-phase totals over the power interval.  With a single voltage
+      // transformer the legs are assumed balanced, so each leg in use
+      // reports the measured voltage.
+      float p3ac = 0, p3re = 0;
+      uint8_t legs = 0;
+      vrms = sqrt(roll_pow.v2t / roll_pow.t);
+      for (j = 0; j<N_CUR_CHAN; j++) {
+        struct rollup_chan_struct *r = &(roll_chan[j]);
+        if (istats[j].present && r->t > 0) {
+          p3ac += r->pact / r->t;
+          p3re += r->pret / r->t;
+          legs |= 1 << (ct_leg[j]-1);
+        }
+      }
+      for (j = 0; j<3; j++) {
+        if (legs & (1 << j)) {
+          push_chan_float("vlg", j+1, vrms, 2, 0);
+        }
+      }
+      push_report_float("p3ac", p3ac, 1, 0);
+      push_report_float("p3re", p3re, 1, 0);
+      push_report_float("p3ap", sqrt(p3ac*p3ac + p3re*p3re), 1, 0);
+#endif
+      report_chan = 0;
+#ifdef CYCLE_ANALYSIS
+      // Distribution of per-cycle active power over the same period
+      cycle_dist_chan = 0;
+#endif
+    }
+    push_report_time(report_due_time);
+    push_report_break();
+    report_due = (report_due & ~(DUE_VOLTAGE | DUE_POWER)) | DUE_META;
+  }
+
+  // Reporting: current and power, as means over each channel's power
+  // interval, one line per channel
+  while (report_chan < N_CUR_CHAN) {
+    struct rollup_chan_struct *r = &(roll_chan[report_chan]);
+    j = report_chan;
+    if (istats[j].present && r->t > 0) {
+      float invt = 1.0 / r->t;
+      float vrms = sqrt(roll_pow.v2t / roll_pow.t);
+      float irms = sqrt(r->i2t * invt);
+      float pac = r->pact * invt, pre = r->pret * invt;
+      float pap, power_factor, ipeak;
+
+      if (!report_wait(REPORT_CHAN)) break;
+      // RMS current
+      push_chan_float("irm", j, irms, 3, 0);
+      // Active and reactive power
+      push_chan_float("pac", j, pac, 1, 0); // pac - active power
+      push_chan_float("pre", j, pre, 1, 0); // pre - reactive power
+      pap = (irms*vrms);
+      power_factor = 1.0;
+      if (pap > MIN_POWER && pap >= pac) power_factor = pac / pap;
+      push_chan_float("pow", j, power_factor, 4, 0);
+
+      // Peak current and crest factor
+      ipeak = r->ipeak * pgm_read_float(&ical[j]);
+      push_chan_float("ipk", j, ipeak, 2, 0);
+      if (irms > 0) {
+        push_chan_float("icf", j, ipeak / irms, 3, 0);
+      }
+      push_report_time(report_due_time);
+      push_report_break();
+    }
+    memset(r,0,sizeof(*r));
+    report_chan ++;
+    if (report_chan == N_CUR_CHAN) memset(&roll_pow,0,sizeof(roll_pow));
+  }
+
+  // Reporting: If we reported any other data, also report realtime data
+  // processing info, along with any change of the inputs and the energy
+  // registers when they are due
+  if ((report_due & DUE_META) && report_wait(REPORT_META)) {
+    uint32_t sec, usec;
+    if (report_due & DUE_VDEL) push_report_float("vdel", vmains_fprod, 4, 0);
+    if (report_due & DUE_IMSK) {
+      chanmask_t mask = 0;
+      for (j = 0; j<N_CUR_CHAN; j++) {
+        if (istats[j].present) mask |= ((chanmask_t) 1 << j);
+      }
+      push_report_int32("imsk", mask, 1);
+    }
+    if (report_due & DUE_PROF) push_report_int32("prof", get_adc_profile(), 1);
+    // Reporting: total energy usage
+    if (report_due & DUE_ENERGY) {
+      push_report_int32("enac",energy_active, 1);
+      push_report_int32("enre",energy_reactive, 1);
+    }
+    push_report_int32("adcd", max_adc_depth, 1);
+    push_report_int32("novr", n_overflow, 1);
+    push_report_uint32("lost", lost_ms_total, 1);
+    split_time(report_due_time, &sec, &usec);
+    push_report_uint32("uptm", sec, 1);
+    push_report_uint32("stkh", stack_high_water(), 1);
+    push_report_uint32("memf", stack_free(), 1);
+    push_report_time(report_due_time);
+    push_report_break();
+    max_adc_depth = 0;
+    report_due &= ~(DUE_ENERGY | DUE_VDEL | DUE_IMSK | DUE_PROF | DUE_META);
+  }
+
+  // Reply to a query: the registers of the last window, one line for the
+  // voltage and energy, then one per channel
+  while (query_line != QUERY_IDLE) {
+    if (query_line == 0) {
+      if (!report_wait(REPORT_QUERY)) break;
+      push_report_float("vrms",vstats.val_rms, 2, 0);
+      push_report_int32("enac",energy_active, 1);
+      push_report_int32("enre",energy_reactive, 1);
+      push_report_uint32("uptm", get_time_sec(), 1);
+      push_report_time(get_time_us());
+      push_report_break();
+    } else if (istats[j = query_line-1].present) {
+      if (!report_wait(REPORT_QUERY)) break;
+      push_chan_float("irm", j, istats[j].val_rms, 3, 0);
+      push_chan_float("pac", j, istats[j].pow_ac, 1, 0);
+      push_chan_float("pre", j, istats[j].pow_re, 1, 0);
+      push_report_time(get_time_us());
+      push_report_break();
+    }
+    query_line = (query_line == N_CUR_CHAN) ? QUERY_IDLE : query_line + 1;
+  }
+
+  report_demand();
+#ifdef CYCLE_ANALYSIS
+  report_cycle_dist(report_due_time);
+#endif
+}
+
 // =========================================================
 // STATE_CALS: Calculate statistics
 //   reading - current ADC reading
@@ -419,19 +973,30 @@ uint8_t calc_stats(struct adc_readings_struct *reading,
                    uint8_t curstate, uint8_t nextstate)
 {
   static float itot_old = -999;
-  static uint32_t t_report_vrms = 0, t_report_pow = 0, t_report_energy = 0;
+  static uint64_t t_report_energy = 0;
+  static uint8_t energy_reported = 0;
+  static chanmask_t calc_mask = 0;  // channels computed in the previous window
+  chanmask_t mask = 0;
+  float pow_en[N_CUR_CHAN];         // [W] active power for the window's energy
+  uint64_t now = get_time_us();
   float vavg, itot = 0.0;
-  uint8_t reported = 0;
   float invwt;
   uint8_t j;
-  float accum_time;
-  static uint16_t ncycles_freq = 0; // Accumulated data for accurate frequency measurement
-  static float accum_freq = 0.0;
-
-  float crest_factor = 1.0, vmains_freq = 0.0;
+  float accum_time, tlost;
 
   invwt = 1.0 / vstats.n;               // For averaging
   accum_time = 1.0e-6*(reading->t - start_time); // [sec] Accumulation duration since start to now
+  // The averages only cover the readings received.  Energy is computed
+  // over the whole accum_time; for the time of the readings lost to
+  // overflow or discarded after a profile change it is estimated with
+  // the power of the previous window.
+  tlost = 1.0e-6*(lost_us + settle_us);
+  if (tlost > accum_time) tlost = accum_time;
+  lost_ms_total += lost_us / 1000;
+  lost_us_frac += lost_us % 1000;
+  if (lost_us_frac >= 1000) { lost_ms_total ++; lost_us_frac -= 1000; }
+  lost_us = 0;
+  settle_us = 0;
   
   // MAINS VOLTAGE CALCULATIONS
   {
@@ -446,28 +1011,26 @@ uint8_t calc_stats(struct adc_readings_struct *reading,
 
     // Now compute RMS voltage as sqrt(<V^2> - <V>)
     vavg2 = vavg_ra*vavg_ra;
-    vrms2 = (float) vstats.val2_sum * vcal2 - vavg2;
+    vrms2 = float40(&vstats.val2_acc) * vcal2 - vavg2;
     if (vrms2 <= 0) vrms2 = 0; // guard domain error
     vrms = sqrt(vrms2);
     vstats.val_rms = vrms;
     // Compute voltage peak half-amplitude
     vstats.pow_ac = (vstats.val_max-vstats.val_min)*VCAL/2.0;
-    // Compute the crest factor = SEMI-AMPLITUDE / RMS = 1.414 for sine wave
-    if (vstats.val_rms > 100.0) crest_factor = vstats.pow_ac / vstats.val_rms;
-    // Compute the mains frequency.  Actually store accumulated data so that
-    // we can compute a more accurate frequency value.
-    ncycles_freq += ncycles;
-    accum_freq   += accum_time;
+    // Roll the window into the voltage interval.  The mains frequency is
+    // measured over the whole interval too, for a more accurate value.
+    roll_vrms.t   += accum_time;
+    roll_vrms.v2t += vrms2 * accum_time;
+    roll_ncycles  += ncycles;
+    if ((uint16_t) (vstats.val_max-vstats.val_min) > roll_vpp) roll_vpp = vstats.val_max-vstats.val_min;
     
     if (vmains_fprod == 0) {
       //Serial.print("#n=");Serial.println(vstats.n);
       //Serial.print("#proddel_sum=");Serial.println(vstats.proddel_sum);
-      vmains_fprod = (float) vstats.proddel_sum * invwt * VCAL2 - vavg2;
+      vmains_fprod = float40(&vstats.proddel_acc) * invwt * VCAL2 - vavg2;
       vmains_fprod /= vrms2;
       //Serial.print("#vmains_fprod=");Serial.println(vmains_fprod,5);
-      push_report_float("vdel", vmains_fprod, 4, 0);
-      push_report_break();
-      reported = 1;
+      report_due |= DUE_VDEL | DUE_META;
     }
 
 
@@ -479,8 +1042,11 @@ uint8_t calc_stats(struct adc_readings_struct *reading,
     if (istats[j].present) {
       float iavg, iavg2, irms2, irms;
       float pre0, pac0, pre1, pac1;
-      float p_offset;
-      float ical1 = ical[j]*invwt, ical2 = ical1*ical[j], ivcal = ical1*VCAL;
+      float p_offset, eac, ere;
+      // Powers of the previous window, kept by init_stats()
+      float pac_prev = istats[j].pow_ac, pre_prev = istats[j].pow_re;
+      float icalj = pgm_read_float(&ical[j]);
+      float ical1 = icalj*invwt, ical2 = ical1*icalj, ivcal = ical1*VCAL;
       int32_t old_energy_active = energy_active, old_energy_reactive = energy_reactive;
 
       // Compute running average current
@@ -492,15 +1058,15 @@ uint8_t calc_stats(struct adc_readings_struct *reading,
       p_offset = vavg_ra * iavg_ra[j]; // iavg*v_avg = bias in P
 
       // RMS current
-      irms2 = (float) istats[j].val2_sum * ical2 - iavg2;
+      irms2 = float40(&istats[j].val2_acc) * ical2 - iavg2;
       if (irms2 <= 0) irms2 = 0; // guard domain error
       irms = sqrt(irms2);
       istats[j].val_rms = irms;
       itot += irms;
 
       // Raw active and reactive power
-      pac0 = (float) istats[j].prod_sum    * ivcal - p_offset;
-      pre0 = (float) istats[j].proddel_sum * ivcal - p_offset;
+      pac0 = float40(&istats[j].prod_acc)    * ivcal - p_offset;
+      pre0 = float40(&istats[j].proddel_acc) * ivcal - p_offset;
 
       // Correct reactive power for not being perfectly 90 degrees behind active  
       pac1 = pac0;
@@ -510,19 +1076,38 @@ uint8_t calc_stats(struct adc_readings_struct *reading,
       istats[j].pow_ac =  cosph[j]*pac1 - sinph[j]*pre1;
       istats[j].pow_re = +sinph[j]*pac1 + cosph[j]*pre1; // + for inductive loads
 
+      // Energy of the window [W-sec], the lost time at the previous
+      // window's power if the channel was computed then
+      mask |= (chanmask_t) 1 << j;
+      if (!(calc_mask & ((chanmask_t) 1 << j))) {
+        pac_prev = istats[j].pow_ac; pre_prev = istats[j].pow_re;
+      }
+      eac = istats[j].pow_ac * (accum_time - tlost) + pac_prev * tlost;
+      ere = istats[j].pow_re * (accum_time - tlost) + pre_prev * tlost;
+      pow_en[j] = eac / accum_time;
+
+      // Roll the window into the power interval
+      {
+        struct rollup_chan_struct *r = &(roll_chan[j]);
+        r->t    += accum_time;
+        r->pact += eac;
+        r->pret += ere;
+        r->i2t  += irms2 * accum_time;
+        if (istats[j].val_max > r->ipeak) r->ipeak = istats[j].val_max;
+        if (-istats[j].val_min > r->ipeak) r->ipeak = -istats[j].val_min;
+      }
+
       // Compute accumulated energy = (time)*(power)
       // Note that this calculation is done in energy units of Watt-sec
       // At the smallest measurable loads of 10-20 Watts, this unit has plenty
       // of resolution.  At the largest measureable loads of 100 Amp per circuit
-      // we do not have overflow.  This is 100Amp x 240VAC = 24000 W-hr which
-      // is under the 32K overflow limit.
-      energy_fracac += ( accum_time * istats[j].pow_ac ); // Energy in Watt-sec
-      energy_fracre += ( accum_time * istats[j].pow_re );
+      // over a 60 sec window we do not have overflow.  This is
+      // 100Amp x 240VAC x 60 sec = 1.44e6 W-sec, well within 32 bits.
+      energy_fracac += eac; // Energy in Watt-sec
+      energy_fracre += ere;
       // Any rollovers of 3600 Watt-sec is a Watt-hr
-      while (energy_fracac > +3600) { energy_fracac -= 3600; energy_active ++; }
-      while (energy_fracac < -3600) { energy_fracac += 3600; energy_active --; }
-      while (energy_fracre > +3600) { energy_fracre -= 3600; energy_reactive ++; }
-      while (energy_fracre < -3600) { energy_fracre += 3600; energy_reactive --; }
+      energy_active   += energy_fracac / 3600; energy_fracac %= 3600;
+      energy_reactive += energy_fracre / 3600; energy_fracre %= 3600;
       
       // Detect signed rollover of 32-bit integer
       if ((old_energy_active >  0x70000000 && energy_active < 0) ||
@@ -532,75 +1117,44 @@ uint8_t calc_stats(struct adc_readings_struct *reading,
     }
   }
 
-  // Decide on which items to report
-  uint8_t report_voltage = ( t_report_vrms == 0 || (reading->t - t_report_vrms) > REPORT_VRMS_PERIOD );
-  uint8_t report_power = (itot_old == -999  // initial reading
-      || fabs(itot - itot_old) > REPORT_POW_ILIMIT  // Current limit changes
-      || (reading->t - t_report_pow) > REPORT_POW_PERIOD);
-
-  // Reporting: voltage (and always report voltage with current)
-  if (report_voltage || report_power) {
-    push_report_float("vrms",vstats.val_rms, 2, 0);
-    if (ncycles_freq > 0 && accum_freq > 0) {
-      float vmains_freq = ncycles_freq / accum_freq;
-      push_report_float("vfrq",vmains_freq, 3, 0);
-      ncycles_freq = 0;
-      accum_freq   = 0;
-    }
-    push_report_float("vcrs",crest_factor, 3, 0);
-    t_report_vrms = reading->t;
-    reported = 1;
-  }
-  // Reporting: current and power.  Do an update when...
-  if (report_power) { // Time limit expires
-    char irmnam[5] = "irm0", pacnam[5] = "pac0", prenam[5] = "pre0";
-    char pwfnam[5] = "pow0";
-
-    for (j = 0; j<N_CUR_CHAN; j++) {
-      if (istats[j].present) {
-        float pap, power_factor;
-        
-        // RMS current
-        irmnam[3] = '0'+j; push_report_float(irmnam, istats[j].val_rms, 3, 0);
-        // Active and reactive power
-        pacnam[3] = '0'+j; push_report_float(pacnam, istats[j].pow_ac, 1, 0); // pac - active power
-        prenam[3] = '0'+j; push_report_float(prenam, istats[j].pow_re, 1, 0); // pre - reactive power
-        pap = (istats[j].val_rms*vstats.val_rms);
-        power_factor = 1.0;
-        if (pap > MIN_POWER && pap >= istats[j].pow_ac) power_factor = istats[j].pow_ac / pap;
-        pwfnam[3] = '0'+j; push_report_float(pwfnam, power_factor, 4, 0);
-        reported = 1;
-      }
-    }
+  calc_mask = mask;
+
+  // Demand interval registers
+  record_demand(now, reading->t - start_time, pow_en);
 
-    t_report_pow = reading->t;
+  // Decide on which items to report, by the time the intervals cover
+  if (roll_vrms.t * 1.0e6 > report_vrms_period) report_due |= DUE_VOLTAGE;
+  if (itot_old == -999  // initial reading
+      || fabs(itot - itot_old) > REPORT_POW_ILIMIT  // Current limit changes
+      || (roll_pow.t + roll_vrms.t) * 1.0e6 > report_pow_period) {
+    report_due |= DUE_POWER;
     itot_old = itot;
   }
-
-  // Reporting: total energy usage
-  if ( t_report_energy == 0 || (reading->t - t_report_energy) > REPORT_ENERGY_PERIOD) {
-    push_report_int32("enac",energy_active, 1);
-    push_report_int32("enre",energy_reactive, 1);
-    t_report_energy = reading->t;
-    reported = 1;
+  if ( !energy_reported || (now - t_report_energy) > report_energy_period) {
+    report_due |= DUE_ENERGY | DUE_META;
+    t_report_energy = now;
+    energy_reported = 1;
   }
+  report_due_time = now;
+
+  // Enable newly connected channels and retire disconnected ones, now
+  // that this window's statistics have been used
+  if (update_inputs()) report_due |= DUE_IMSK | DUE_META;
 
   // Reset the accumulated statistics
   start_time = reading->t;
   ncycles = 0;
   init_stats(&vstats);
   for (j=0; j<N_CUR_CHAN; j++) init_stats(&istats[j]);
-  
-  // Reporting: If we reported other any other data, also report
-  // realtime data processing info
-  if (reported) {
-    report_pulse_count();
-    push_report_int32("adcd", max_adc_depth, 1);
-    push_report_int32("novr", n_overflow, 1);
-    push_report_uint32("uptm", update_uptime(), 1);
-    push_report_break();
-    max_adc_depth = 0;      
+
+  // Switch the sampling profile at the window boundary
+  if (sample_profile_req != get_adc_profile()) {
+    set_adc_profile(sample_profile_req);
+    rate_settle = N_READINGS + N_VHIST_RING;
+    report_due |= DUE_PROF | DUE_META;
   }
+
+  queue_reports();
   return nextstate;
 }
 
@@ -0,0 +1,285 @@
+//   EMONTX3-CONTINUOUS - continuous sampling Arduino firmware
+//
+//   Copyright (C) 2018 C. B. Markwardt
+//   License: GNU GPL V3
+//
+//   Serial port driver
+//
+//   A small interrupt-driven driver for USART0, used instead of the Arduino
+//   Serial object.  Output is copied into a ring buffer in bulk and drained
+//   by the data register empty interrupt; binary frames can also be built
+//   in place in the ring (uart_hold()).  The reports never wait for the
+//   line: uart_write() accepts what fits and says how much that was.
+//   HardwareSerial instead makes a virtual call per byte, and busy-waits
+//   when its 64 byte buffer is full, which can overflow the ADC ring
+//   buffer.  Only the uart_print*() functions wait for room, so that the
+//   startup and diagnostic messages come out whole; they are sent outside
+//   of the measurements, and readings lost meanwhile are marked as gaps.
+//
+//   Received characters are buffered by the receive interrupt until
+//   poll_command() reads them.
+//
+
+#include <Arduino.h>
+#include "cont.h"
+
+#if (UART_TX_SIZE & (UART_TX_SIZE-1)) || UART_TX_SIZE > 256
+#error "UART_TX_SIZE must be a power of 2, at most 256"
+#endif
+#if (UART_RX_SIZE & (UART_RX_SIZE-1)) || UART_RX_SIZE > 256
+#error "UART_RX_SIZE must be a power of 2, at most 256"
+#endif
+#define UART_TX_MASK (UART_TX_SIZE-1)
+#define UART_RX_MASK (UART_RX_SIZE-1)
+
+// Baud rate register, for double speed mode (same rounding as HardwareSerial)
+#define UART_UBRR ((F_CPU/4/UART_BAUD - 1)/2)
+
+// USART0 interrupt vectors have the unit number on the ATmega2560
+#if defined(USART0_UDRE_vect)
+#define UART_UDRE_vect USART0_UDRE_vect
+#define UART_RX_vect   USART0_RX_vect
+#else
+#define UART_UDRE_vect USART_UDRE_vect
+#define UART_RX_vect   USART_RX_vect
+#endif
+
+// Transmit ring buffer.  head is written only by the main program, tail
+// only by the interrupt handler; both are single bytes, so no locking is
+// needed.
+uint8_t uart_tx_buf[UART_TX_SIZE];
+volatile uint8_t uart_tx_head = 0;
+volatile uint8_t uart_tx_tail = 0;
+// A frame is being built in place from head on (see uart_hold())
+uint8_t uart_tx_held = 0;
+// Receive ring buffer.  head is written by the interrupt handler.
+uint8_t uart_rx_buf[UART_RX_SIZE];
+volatile uint8_t uart_rx_head = 0;
+volatile uint8_t uart_rx_tail = 0;
+
+// init_uart() - initialize USART0 at UART_BAUD, 8 data bits, no parity
+void init_uart(void)
+{
+  UBRR0  = UART_UBRR;
+  UCSR0A = _BV(U2X0);                  // Double speed
+  UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);  // 8N1
+  UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+}
+
+// uart_room() - free space in the transmit buffer
+//   returns: number of bytes that uart_write() would accept now
+uint8_t uart_room(void)
+{
+  if (uart_tx_held) return 0;
+  return UART_TX_MASK - ((uint8_t) (uart_tx_head - uart_tx_tail) & UART_TX_MASK);
+}
+
+// uart_write() - queue bytes for transmission, without waiting
+//   buf - bytes to send
+//   n - number of bytes
+//   returns: number of bytes accepted, from the start of buf
+uint8_t uart_write(const char *buf, uint8_t n)
+{
+  uint8_t head = uart_tx_head;
+  uint8_t room = UART_TX_MASK - ((uint8_t) (head - uart_tx_tail) & UART_TX_MASK);
+  uint8_t i;
+
+  if (uart_tx_held) return 0;
+  if (n > room) n = room;
+  if (n == 0) return 0;
+  for (i = 0; i<n; i++) {
+    uart_tx_buf[head] = buf[i];
+    head = (head + 1) & UART_TX_MASK;
+  }
+  uart_tx_head = head;
+  // Make sure the interrupt handler is sending.  If it runs between the
+  // read and the write of UCSR0B, it may be enabled once more than needed.
+  UCSR0B |= _BV(UDRIE0);
+  return n;
+}
+
+// uart_hold() - start a frame built in place in the transmit buffer.
+//   The caller writes byte i of the frame to
+//   uart_tx_buf[(uint8_t) (uart_tx_head + i) & (UART_TX_SIZE-1)], and
+//   nothing else can be queued until uart_release().
+//   n - most bytes the frame can take
+//   returns: 1 if there is room for them; 0 otherwise
+uint8_t uart_hold(uint8_t n)
+{
+  if (uart_room() < n) return 0;
+  uart_tx_held = 1;
+  return 1;
+}
+
+// uart_release() - send the frame started with uart_hold()
+//   n - number of bytes written
+void uart_release(uint8_t n)
+{
+  uart_tx_head = (uart_tx_head + n) & UART_TX_MASK;
+  uart_tx_held = 0;
+  UCSR0B |= _BV(UDRIE0);
+}
+
+// uart_read() - next received character
+//   returns: the character, or -1 if none has been received
+int16_t uart_read(void)
+{
+  uint8_t tail = uart_rx_tail;
+  uint8_t c;
+  if (tail == uart_rx_head) return -1;
+  c = uart_rx_buf[tail];
+  uart_rx_tail = (tail + 1) & UART_RX_MASK;
+  return c;
+}
+
+// ============================= Formatted output
+// Numbers are formatted like the Arduino Print class, so that the output
+// is unchanged: floats with a fixed number of decimals, or nan, inf and
+// ovf (beyond the range of uint32_t).
+
+// fmt_uint32() - format an unsigned integer
+//   buf - output, at least 10 characters
+//   returns: number of characters
+uint8_t fmt_uint32(char *buf, uint32_t value)
+{
+  char tmp[10];
+  uint8_t n = 0, i = 0;
+  do {
+    tmp[n++] = '0' + (value % 10);
+    value /= 10;
+  } while (value);
+  while (n) buf[i++] = tmp[--n];
+  return i;
+}
+
+// fmt_int32() - format a signed integer
+//   buf - output, at least 11 characters
+//   returns: number of characters
+uint8_t fmt_int32(char *buf, int32_t value)
+{
+  if (value >= 0) return fmt_uint32(buf, value);
+  buf[0] = '-';
+  return 1 + fmt_uint32(buf+1, - (uint32_t) value);
+}
+
+// fmt_float() - format a float with a fixed number of decimals
+//   buf - output, at least 12+digits characters
+//   digits - decimals, at most 7
+//   returns: number of characters
+uint8_t fmt_float(char *buf, float value, uint8_t digits)
+{
+  uint8_t n = 0, i;
+  float rounding = 0.5, rem;
+  uint32_t ipart;
+
+  if (isnan(value)) { memcpy_P(buf, PSTR("nan"), 3); return 3; }
+  if (isinf(value)) { memcpy_P(buf, PSTR("inf"), 3); return 3; }
+  if (value > 4294967040.0 || value < -4294967040.0) { memcpy_P(buf, PSTR("ovf"), 3); return 3; }
+  if (digits > 7) digits = 7;
+  if (value < 0) { buf[n++] = '-'; value = -value; }
+
+  for (i = 0; i<digits; i++) rounding /= 10.0;
+  value += rounding;
+  ipart = (uint32_t) value;
+  rem = value - (float) ipart;
+  n += fmt_uint32(buf+n, ipart);
+  if (digits > 0) buf[n++] = '.';
+  for (i = 0; i<digits; i++) {
+    uint8_t d;
+    rem *= 10.0;
+    d = (uint8_t) rem;
+    buf[n++] = '0' + d;
+    rem -= d;
+  }
+  return n;
+}
+
+// uart_wait() - wait until n bytes fit in the transmit buffer.  An open
+//   raw frame is sent first, as nothing can be queued behind it.
+//   n - number of bytes, less than UART_TX_SIZE
+static void uart_wait(uint8_t n)
+{
+#ifdef RAW_STREAM
+  if (uart_tx_held) raw_flush();
+#endif
+  while (uart_room() < n) ;
+}
+
+// uart_put() - send n bytes, waiting for room
+static void uart_put(const char *buf, uint8_t n)
+{
+  uart_wait(n);
+  uart_write(buf, n);
+}
+
+// uart_write_P() - send n bytes from flash, waiting for room
+static void uart_write_P(PGM_P s, uint8_t n)
+{
+  char buf[16];
+  while (n > 0) {
+    uint8_t k = (n < sizeof(buf)) ? n : sizeof(buf);
+    memcpy_P(buf, s, k);
+    uart_put(buf, k);
+    s += k;
+    n -= k;
+  }
+}
+
+// uart_print_P() - send a string from flash, waiting for room; use
+//   uart_print("...")
+void uart_print_P(PGM_P s)
+{
+  uart_write_P(s, strlen_P(s));
+}
+
+// uart_println_P() - send a string from flash and a line break, waiting
+//   for room; use uart_println("...")
+void uart_println_P(PGM_P s)
+{
+  uart_write_P(s, strlen_P(s));
+  uart_write_P(PSTR("\r\n"), 2);
+}
+
+// uart_print_int() - send a signed integer, waiting for room
+void uart_print_int(int32_t value)
+{
+  char buf[11];
+  uart_put(buf, fmt_int32(buf, value));
+}
+
+// uart_print_uint() - send an unsigned integer, waiting for room
+void uart_print_uint(uint32_t value)
+{
+  char buf[10];
+  uart_put(buf, fmt_uint32(buf, value));
+}
+
+
+// ============================= UART Interrupt handlers
+// Transmit: about 40 cycles per byte, including interrupt entry.  At
+// 1000000 baud, a byte every 160 CPU cycles, a continuous stream would take
+// a quarter of the CPU; at 115200 baud it takes 3%.
+ISR(UART_UDRE_vect)
+{
+  uint8_t tail = uart_tx_tail;
+  if (tail == uart_tx_head) {
+    UCSR0B &= ~_BV(UDRIE0); // Nothing to send
+    return;
+  }
+  UDR0 = uart_tx_buf[tail];
+  tail = (tail + 1) & UART_TX_MASK;
+  uart_tx_tail = tail;
+  if (tail == uart_tx_head) UCSR0B &= ~_BV(UDRIE0);
+}
+
+// Receive: characters that do not fit are dropped
+ISR(UART_RX_vect)
+{
+  uint8_t c = UDR0;
+  uint8_t head = uart_rx_head;
+  uint8_t next = (head + 1) & UART_RX_MASK;
+  if (next != uart_rx_tail) {
+    uart_rx_buf[head] = c;
+    uart_rx_head = next;
+  }
+}